@@ -0,0 +1,235 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+/**
+ *  Admission control, checked right after accept() and before a process
+ *  is forked or a socket handed to a worker. From the environment:
+ *
+ *      SERVER_MAX_ACTIVE  connections served at the same time by all
+ *                         processes together (default 0: no cap)
+ *      SERVER_IP_RATE     new connections per second one client IPv4
+ *                         address may open (default 0: no limit)
+ *      SERVER_IP_BURST    how many of them may come at once (default: the
+ *                         rate, at least 1)
+ *      SERVER_IP_TABLE    client addresses tracked at the same time
+ *                         (default 4096, rounded up to a power of two)
+ *
+ *  Everything lives in one MAP_SHARED mapping made before the first fork,
+ *  so all processes enforce the same limits. The per-address state is a
+ *  fixed-size open-addressing table with linear probing; an entry is the
+ *  address and one 64-bit word, the time its token bucket is full again
+ *  (GCRA, the token bucket as a single timestamp), so checking and
+ *  charging an address is one compare-and-swap without a lock. An entry
+ *  whose bucket is full carries no information and is taken over by the
+ *  next new address that probes past it. When every probed entry is busy
+ *  the connection is admitted and counted as a table miss.
+ *
+ *  A rejected connection is closed with a zero linger: the client gets a
+ *  RST, and the server keeps no TIME_WAIT state for it.
+ */
+
+#define ADMISSION_PROBES 16
+#define ADMISSION_DEFAULT_TABLE 4096
+
+enum admission_verdict
+{
+    ADMISSION_ADMIT,
+    ADMISSION_FULL,         // SERVER_MAX_ACTIVE reached
+    ADMISSION_RATE_LIMITED  // the address is over SERVER_IP_RATE
+};
+
+struct admission_entry
+{
+    atomic_uint ip;         // network byte order, 0: empty
+    atomic_ullong fullAt;   // monotonic ns at which the bucket is full again
+};
+
+struct admission_shared
+{
+    _Alignas(64) atomic_long active;
+    atomic_ulong tableMisses;
+    _Alignas(64) struct admission_entry entries[];
+};
+
+struct admission
+{
+    long maxActive;
+    long long intervalNs;   // one token
+    long long burstNs;      // how far fullAt may run ahead of now
+    unsigned mask;
+    struct admission_shared* shared;
+};
+
+static long admission_env(const char* name, long fallback)
+{
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return fallback;
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed < 0)
+    {
+        fprintf(stderr, "%s=%s is not a number\n", name, value);
+        exit(EXIT_FAILURE);
+    }
+    return parsed;
+}
+
+static void admission_init(struct admission* a)
+{
+    bzero(a, sizeof(struct admission));
+    a->maxActive = admission_env("SERVER_MAX_ACTIVE", 0);
+    long rate = admission_env("SERVER_IP_RATE", 0);
+    long burst = admission_env("SERVER_IP_BURST", rate);
+    if (burst < 1)
+        burst = 1;
+    long tableSize = admission_env("SERVER_IP_TABLE", ADMISSION_DEFAULT_TABLE);
+    unsigned size = 1;
+    while (size < (unsigned long)tableSize && size < (1U << 24))
+        size <<= 1;
+    if (rate > 0)
+    {
+        a->intervalNs = 1000000000LL / rate;
+        a->burstNs = a->intervalNs * burst;
+        a->mask = size - 1;
+    }
+
+    size_t bytes = sizeof(struct admission_shared)
+        + (rate > 0 ? size * sizeof(struct admission_entry) : 0);
+    a->shared = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (a->shared == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (a->maxActive > 0)
+        printf("admission: at most %ld active connections\n", a->maxActive);
+    if (rate > 0)
+        printf("admission: %ld connections/s per client address, bursts of %ld, "
+               "%u addresses tracked\n", rate, burst, size);
+}
+
+static inline unsigned long long admission_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// takes one token of the address; 0 when its bucket is empty
+static int admission_take_token(struct admission* a, uint32_t ip)
+{
+    unsigned long long now = admission_now();
+    unsigned slot = (unsigned)(((uint64_t)ip * 0x9E3779B97F4A7C15ULL) >> 32) & a->mask;
+    struct admission_entry* entry = NULL;
+    int probe = 0;
+    for (; probe < ADMISSION_PROBES; ++probe, slot = (slot + 1) & a->mask)
+    {
+        struct admission_entry* e = &a->shared->entries[slot];
+        unsigned owner = atomic_load_explicit(&e->ip, memory_order_acquire);
+        if (owner == ip)
+        {
+            entry = e;
+            break;
+        }
+        // an empty entry, or one with a full bucket that nobody needs any more
+        int idle = owner == 0
+            || atomic_load_explicit(&e->fullAt, memory_order_relaxed) <= now;
+        if (entry == NULL && idle)
+            entry = e;
+        if (owner == 0)
+            break;
+    }
+    if (entry == NULL)
+    {
+        atomic_fetch_add_explicit(&a->shared->tableMisses, 1, memory_order_relaxed);
+        return 1;
+    }
+    // a full bucket needs no reset; if another process claims the entry
+    // at the same moment, both addresses share one bucket for a while
+    unsigned owner = atomic_load_explicit(&entry->ip, memory_order_acquire);
+    if (owner != ip)
+        atomic_compare_exchange_strong_explicit(&entry->ip, &owner, ip,
+                                                memory_order_acq_rel, memory_order_acquire);
+
+    unsigned long long fullAt = atomic_load_explicit(&entry->fullAt, memory_order_relaxed);
+    while (1)
+    {
+        unsigned long long from = fullAt > now ? fullAt : now;
+        unsigned long long next = from + a->intervalNs;
+        if (next > now + a->burstNs)
+            return 0;
+        if (atomic_compare_exchange_weak_explicit(&entry->fullAt, &fullAt, next,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return 1;
+    }
+}
+
+/**
+ *  Decides about a connection that was just accepted. ADMISSION_ADMIT
+ *  counts it as active until admission_leave().
+ */
+static enum admission_verdict admission_check(struct admission* a, const struct sockaddr_in* peer)
+{
+    // the cap first: a connection turned away for it costs the address no token
+    long active = atomic_fetch_add_explicit(&a->shared->active, 1, memory_order_relaxed);
+    if (a->maxActive > 0 && active >= a->maxActive)
+    {
+        atomic_fetch_sub_explicit(&a->shared->active, 1, memory_order_relaxed);
+        return ADMISSION_FULL;
+    }
+    if (a->intervalNs > 0 && peer->sin_family == AF_INET
+        && !admission_take_token(a, peer->sin_addr.s_addr))
+    {
+        atomic_fetch_sub_explicit(&a->shared->active, 1, memory_order_relaxed);
+        return ADMISSION_RATE_LIMITED;
+    }
+    return ADMISSION_ADMIT;
+}
+
+static inline void admission_leave(struct admission* a)
+{
+    atomic_fetch_sub_explicit(&a->shared->active, 1, memory_order_relaxed);
+}
+
+// count connections of a process that died before it could leave for them
+static inline void admission_release(struct admission* a, long count)
+{
+    if (count > 0)
+        atomic_fetch_sub_explicit(&a->shared->active, count, memory_order_relaxed);
+}
+
+// RST instead of FIN: nothing is sent and no TIME_WAIT is left behind
+static inline void admission_reject(int sockfd)
+{
+    struct linger lingering;
+    lingering.l_onoff = 1;
+    lingering.l_linger = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lingering, sizeof(lingering));
+    close(sockfd);
+}
+
+static inline void admission_report(const struct admission* a)
+{
+    unsigned long misses = atomic_load_explicit(&a->shared->tableMisses, memory_order_relaxed);
+    if (misses > 0)
+        printf("admission: %lu connections admitted because the address table was full\n",
+               misses);
+}
+
+#endif
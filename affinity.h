@@ -0,0 +1,211 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+/**
+ *  Where the workers of a server run. SERVER_CPUS=<list> pins worker n
+ *  (a process, or a thread in the modes that run several per process) to
+ *  the n-th CPU of the list, round robin. A pinned worker keeps its caches
+ *  warm instead of following the scheduler around, and the memory it
+ *  touches first comes from its own NUMA node. The list holds CPU numbers,
+ *  ranges and nodeN for every CPU of NUMA node N, in the order workers
+ *  take them:
+ *
+ *      SERVER_CPUS=0-3,8       SERVER_CPUS=node1       SERVER_CPUS=node0,node1
+ *
+ *  node0,node1 fills node 0 before a worker lands on node 1. CPUs the
+ *  process may not run on (taskset, cpusets) are left out.
+ *
+ *  A per-worker SO_REUSEPORT listener is tagged with its worker's CPU
+ *  (SO_INCOMING_CPU), and affinity_steer_reuseport() hands the group a
+ *  classic BPF program that picks the listener by the CPU the SYN or
+ *  datagram arrived on: the connection is served on the core whose NIC
+ *  queue received it. A CPU without a listener falls back to the usual
+ *  hash.
+ */
+
+struct cpu_placement
+{
+    int count;              // 0: placement is left to the scheduler
+    int cpus[CPU_SETSIZE];
+};
+
+// appends every CPU of NUMA node n that is in allowed
+static int affinity_add_node(struct cpu_placement* p, int node, const cpu_set_t* allowed)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "fopen(%s) : %s\n", path, strerror(errno));
+        return 0;
+    }
+    char list[4096];
+    int ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return 0;
+
+    char* item = strtok(list, ",\n");
+    for (; item != NULL; item = strtok(NULL, ",\n"))
+    {
+        int first = 0, last = 0;
+        int fields = sscanf(item, "%d-%d", &first, &last);
+        if (fields < 1)
+            return 0;
+        if (fields == 1)
+            last = first;
+        for (; first <= last && p->count < CPU_SETSIZE; ++first)
+        {
+            if (CPU_ISSET(first, allowed))
+                p->cpus[p->count++] = first;
+        }
+    }
+    return 1;
+}
+
+static int affinity_parse(struct cpu_placement* p, const char* spec, const cpu_set_t* allowed)
+{
+    char* copy = strdup(spec);
+    if (copy == NULL)
+        return 0;
+    int ok = 1;
+    char* saved = NULL;
+    char* item = strtok_r(copy, ",", &saved);
+    for (; ok && item != NULL; item = strtok_r(NULL, ",", &saved))
+    {
+        char* end = NULL;
+        if (strncmp(item, "node", 4) == 0)
+        {
+            long node = strtol(item + 4, &end, 10);
+            ok = end != item + 4 && *end == '\0' && node >= 0
+                && affinity_add_node(p, (int)node, allowed);
+            continue;
+        }
+        long first = strtol(item, &end, 10);
+        long last = first;
+        if (end != item && *end == '-')
+            last = strtol(end + 1, &end, 10);
+        if (end == item || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            ok = 0;
+            break;
+        }
+        for (; first <= last && p->count < CPU_SETSIZE; ++first)
+        {
+            if (CPU_ISSET(first, allowed))
+                p->cpus[p->count++] = (int)first;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+static void affinity_init(struct cpu_placement* p)
+{
+    bzero(p, sizeof(struct cpu_placement));
+    const char* spec = getenv("SERVER_CPUS");
+    if (spec == NULL || *spec == '\0')
+        return;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        fprintf(stderr, "sched_getaffinity() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!affinity_parse(p, spec, &allowed))
+    {
+        fprintf(stderr, "SERVER_CPUS=%s: expected CPU numbers, ranges or nodeN\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    if (p->count == 0)
+    {
+        fprintf(stderr, "SERVER_CPUS=%s: none of these CPUs is available\n", spec);
+        exit(EXIT_FAILURE);
+    }
+    printf("workers pinned round robin to %d CPUs:", p->count);
+    int i = 0;
+    for (; i < p->count; ++i)
+        printf(" %d", p->cpus[i]);
+    printf("\n");
+}
+
+// the CPU of worker n, -1 without placement
+static inline int affinity_cpu(const struct cpu_placement* p, int worker)
+{
+    return p->count > 0 ? p->cpus[worker % p->count] : -1;
+}
+
+// pins the calling thread (and the threads it starts later); returns the CPU or -1
+static int affinity_pin(const struct cpu_placement* p, int worker)
+{
+    int cpu = affinity_cpu(p, worker);
+    if (cpu == -1)
+        return -1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        fprintf(stderr, "sched_setaffinity(%d) : %s\n", cpu, strerror(errno));
+        return -1;
+    }
+    return cpu;
+}
+
+static inline void affinity_incoming_cpu(int sockfd, int cpu)
+{
+    if (cpu == -1)
+        return;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+        fprintf(stderr, "setsockopt(SO_INCOMING_CPU) : %s\n", strerror(errno));
+}
+
+/**
+ *  listenerCpus[i] is the CPU of the i-th socket that joined the reuseport
+ *  group of sockfd. The program returns the index of the first listener
+ *  on the receiving CPU, or an index past the group so that the kernel
+ *  hashes as usual.
+ */
+static inline int affinity_steer_reuseport(int sockfd, const int* listenerCpus, int count)
+{
+    // one compare and one return per listener, the load and the fallback
+    if (count < 1 || 2 * count + 2 > BPF_MAXINSNS)
+        return 0;
+    struct sock_filter* code = calloc(2 * count + 2, sizeof(struct sock_filter));
+    if (code == NULL)
+        return 0;
+    int n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    int i = 0;
+    for (; i < count; ++i)
+    {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 (unsigned)listenerCpus[i], 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (unsigned)i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffffu);
+
+    struct sock_fprog prog;
+    prog.len = (unsigned short)n;
+    prog.filter = code;
+    int attached = setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                              &prog, sizeof(prog)) == 0;
+    if (!attached)
+        fprintf(stderr, "setsockopt(SO_ATTACH_REUSEPORT_CBPF) : %s\n", strerror(errno));
+    free(code);
+    return attached;
+}
+
+#endif
@@ -0,0 +1,408 @@
+#!/bin/bash
+#
+# Benchmark harness for the server models.
+#
+#   bench.sh build            compile every server and the client into ./build
+#   bench.sh run [options]    start each server on loopback, drive it with
+#                             the load mode of the client at increasing
+#                             concurrency and append one row per run to
+#                             <outdir>/results.csv and results.json
+#
+# Every run gets a fresh server process tree. While the client runs the
+# tree (the server's session) is sampled from /proc for peak RSS, process
+# and thread count; CPU time is read once the client has finished, so it
+# covers the live processes plus every child the server has already reaped.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+BUILD="$ROOT/build"
+SOURCES="initial perrequest prefork prethreaded epollserver uringserver client"
+
+MODELS="initial,perrequest,prefork,prethreaded,epollserver,uringserver"
+LEVELS="1,10,100"
+CONNECTIONS=200
+MESSAGES=5
+INTERVAL_MS=10
+SIZE=9
+RATE=0
+BYTE_RATE=0
+DURATION_MS=0
+DEFER_ACCEPT_S=0
+PROFILE=default
+PORT=6680
+TRANSPORTS=tcp
+WORKERS=8
+TIMEOUT=300
+OUTDIR=""
+
+usage()
+{
+    cat <<EOF
+usage: bench.sh build
+       bench.sh run [-m model,...] [-c concurrency,...] [-n connectionsPerRun]
+                    [-k messagesPerConnection] [-i intervalMs] [-s messageSize]
+                    [-r messagesPerSecond] [-b bytesPerSecond] [-d durationMs]
+                    [-D deferAcceptSec] [-P socketProfile] [-w workers] [-p port] [-T tcp,unix,seqpacket]
+                    [-t timeoutSec] [-o outdir]
+
+models: initial perrequest prefork prefork-mutex prefork-fcntl prefork-reuseport
+        prefork-pass prefork-threads prethreaded epollserver uringserver
+        epollserver-broadcast (one generated stream for all connections)
+        prefork-udp prefork-udp-shared (datagrams: -c flows, -n requests)
+defaults: -m $MODELS -c $LEVELS -n $CONNECTIONS -k $MESSAGES -i $INTERVAL_MS
+          -s $SIZE -w $WORKERS -p $PORT -T $TRANSPORTS -t $TIMEOUT
+          -o bench-results/<timestamp>
+
+-r paces every connection to that many messages per second instead of -i,
+-b to that many bytes per second (SO_MAX_PACING_RATE), -d ends every
+stream after that many milliseconds; -k 0 -d <ms> streams for the whole
+duration. 0 leaves the setting off.
+
+-D sets SERVER_DEFER_ACCEPT_S (TCP_DEFER_ACCEPT) and lets every TCP client
+greet (client -g), so a server only accepts connections that have sent
+something. Many short connections, e.g. -k 1 -i 0 -c 100 -n 20000, show
+the accept path's connections/s with and without it.
+
+-P runs server and client with SOCKET_PROFILE=default, low-latency or
+bulk-throughput (tuning.h); the SOCKET_* settings of bench.sh's own
+environment override single options of it. The profile is a column of
+the results.
+
+-T repeats every run over each transport: unix and seqpacket serve on
+<outdir>/server.sock instead of the port (the udp and SO_REUSEPORT
+models only run over tcp). With more than one transport the runs end with a table of p50 and
+connections/s of every unix run relative to its tcp run.
+EOF
+}
+
+build()
+{
+    mkdir -p "$BUILD"
+    local failed=0
+    local name
+    for name in $SOURCES; do
+        echo "cc $name.c"
+        if ! ${CC:-cc} ${CFLAGS:--O2 -Wall} -pthread -o "$BUILD/$name" "$ROOT/$name.c"; then
+            echo "bench.sh: $name did not build" >&2
+            failed=1
+        fi
+    done
+    return $failed
+}
+
+# the address argument of the servers for transport $1
+server_address()
+{
+    case "$1" in
+        tcp) echo "$PORT" ;;
+        *) echo "$1:$SOCKET_PATH" ;;
+    esac
+}
+
+# prints the server command line for a model over transport $2
+server_command()
+{
+    local model=$1
+    local address
+    address=$(server_address "$2")
+    local bin="$BUILD"
+    case "$model" in
+        initial|perrequest|epollserver|uringserver)
+            echo "$bin/$model $address" ;;
+        prefork)
+            echo "$bin/prefork $address $WORKERS" ;;
+        prefork-mutex|prefork-fcntl|prefork-reuseport|prefork-pass)
+            echo "$bin/prefork -a ${model#prefork-} $address $WORKERS" ;;
+        prefork-threads)
+            echo "$bin/prefork -a reuseport -t $WORKERS $address 2" ;;
+        prefork-udp)
+            echo "$bin/prefork -u $address $WORKERS" ;;
+        prefork-udp-shared)
+            echo "$bin/prefork -u -a shared $address $WORKERS" ;;
+        prethreaded)
+            echo "$bin/prethreaded $address $WORKERS 1024" ;;
+        epollserver-broadcast)
+            echo "env BROADCAST=gen $bin/epollserver $address" ;;
+        *)
+            return 1 ;;
+    esac
+}
+
+# succeeds once something listens on 127.0.0.1:$PORT or 0.0.0.0:$PORT,
+# with "udp" as $1 once a datagram socket is bound there, and with
+# "unix" or "seqpacket" once the socket file exists
+port_listening()
+{
+    local hexPort
+    hexPort=$(printf '%04X' "$PORT")
+    if [ "${1:-tcp}" = unix ] || [ "${1:-tcp}" = seqpacket ]; then
+        [ -S "$SOCKET_PATH" ]
+    elif [ "${1:-tcp}" = udp ]; then
+        grep -qE "^ *[0-9]+: (00000000|0100007F):$hexPort [0-9A-F]+:[0-9A-F]+ 07 " /proc/net/udp
+    else
+        grep -qE "^ *[0-9]+: (00000000|0100007F):$hexPort [0-9A-F]+:[0-9A-F]+ 0A " /proc/net/tcp
+    fi
+}
+
+# "rssKb processes threads cpuTicks" for every process in session $1
+sample_session()
+{
+    local session=$1
+    local rss=0 procs=0 threads=0 ticks=0
+    local stat line
+    for stat in /proc/[0-9]*/stat; do
+        read -r line 2>/dev/null < "$stat" || continue
+        # fields after "(comm) ": state ppid pgrp session ...
+        local fields=(${line##*) })
+        [ "${fields[3]}" = "$session" ] || continue
+        procs=$((procs + 1))
+        threads=$((threads + fields[17]))
+        rss=$((rss + fields[21]))
+        ticks=$((ticks + fields[11] + fields[12]))
+        # children already reaped by the session leader
+        if [ "${stat#/proc/}" = "$session/stat" ]; then
+            ticks=$((ticks + fields[13] + fields[14]))
+        fi
+    done
+    echo "$((rss * PAGE_KB)) $procs $threads $ticks"
+}
+
+sampler()
+{
+    local session=$1
+    local out=$2
+    while kill -0 "$session" 2>/dev/null; do
+        sample_session "$session" >> "$out"
+        sleep 0.1
+    done
+}
+
+# value of key=... in the client's histogram line for $2
+histogram_field()
+{
+    awk -v name="$2" -v key="$3" '$1 == name {
+        for (i = 2; i <= NF; ++i) { split($i, kv, "="); if (kv[1] == key) print kv[2] } }' "$1"
+}
+
+run_one()
+{
+    local model=$1
+    local concurrency=$2
+    local transport=$3
+    local command
+    if ! command=$(server_command "$model" "$transport"); then
+        echo "bench.sh: unknown model $model" >&2
+        return 1
+    fi
+
+    local protocol=$transport
+    local clientMode=""
+    [ "$DEFER_ACCEPT_S" != 0 ] && [ "$transport" = tcp ] && clientMode=-g
+    case "$model" in
+        *-udp*|prefork-reuseport|prefork-threads)
+            if [ "$transport" != tcp ]; then
+                echo "== $model has no $transport transport, skipped"
+                return 0
+            fi ;;
+    esac
+    case "$model" in
+        *-udp*) protocol=udp; clientMode=-u ;;
+    esac
+    local target=(127.0.0.1 "$PORT")
+    if [ "$transport" != tcp ]; then
+        target=("$(server_address "$transport")")
+        rm -f "$SOCKET_PATH"
+    fi
+
+    local log="$OUTDIR/logs/$model-c$concurrency"
+    [ "$transport" = tcp ] || log="$OUTDIR/logs/$model-$transport-c$concurrency"
+    echo "== $model, concurrency $concurrency, $transport"
+    PAYLOAD_MESSAGES=$MESSAGES PAYLOAD_INTERVAL_MS=$INTERVAL_MS PAYLOAD_SIZE=$SIZE \
+        PAYLOAD_RATE=$RATE PAYLOAD_BYTE_RATE=$BYTE_RATE PAYLOAD_DURATION_MS=$DURATION_MS \
+        SERVER_DEFER_ACCEPT_S=$DEFER_ACCEPT_S SOCKET_PROFILE=$PROFILE setsid $command > "$log.server" 2>&1 &
+    local server=$!
+
+    local waited=0
+    until port_listening $protocol; do
+        sleep 0.1
+        waited=$((waited + 1))
+        if [ $waited -ge 50 ] || ! kill -0 $server 2>/dev/null; then
+            echo "bench.sh: $model did not start listening, see $log.server" >&2
+            kill -KILL -- -$server 2>/dev/null
+            wait $server 2>/dev/null
+            return 1
+        fi
+    done
+
+    : > "$log.samples"
+    sampler $server "$log.samples" &
+    local samplerPid=$!
+
+    SOCKET_PROFILE=$PROFILE timeout -s INT "$TIMEOUT" "$BUILD/client" $clientMode -c "$concurrency" -n "$CONNECTIONS" \
+        "${target[@]}" > "$log.client" 2>&1
+    local clientStatus=$?
+
+    local final
+    final=$(sample_session $server)
+    kill $samplerPid 2>/dev/null
+    wait $samplerPid 2>/dev/null
+
+    kill -INT $server 2>/dev/null
+    waited=0
+    while kill -0 $server 2>/dev/null && [ $waited -lt 50 ]; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    kill -KILL -- -$server 2>/dev/null
+    wait $server 2>/dev/null
+
+    local completed failed elapsed connsPerSec msgsPerSec
+    read -r completed failed elapsed < <(awk '$1 == "load:" && $3 == "started," {
+        print $4, $6, $11 }' "$log.client")
+    read -r connsPerSec msgsPerSec < <(awk '$1 == "load:" && $3 == "connections/s," {
+        print $2, $4 }' "$log.client")
+    local p50 p99 p999
+    p50=$(histogram_field "$log.client" total p50)
+    p99=$(histogram_field "$log.client" total p99)
+    p999=$(histogram_field "$log.client" total p99.9)
+
+    local peak
+    peak=$(echo "$final" | cat - "$log.samples" | awk '
+        $1 > rss { rss = $1 } $2 > procs { procs = $2 } $3 > threads { threads = $3 }
+        END { print rss + 0, procs + 0, threads + 0 }')
+    local peakRss peakProcs peakThreads ticks
+    read -r peakRss peakProcs peakThreads <<< "$peak"
+    ticks=$(echo "$final" | awk '{ print $4 }')
+    local cpu
+    cpu=$(awk -v t="$ticks" -v hz="$CLK_TCK" 'BEGIN { printf "%.2f", t / hz }')
+
+    if [ $clientStatus -ne 0 ]; then
+        echo "bench.sh: client exited with status $clientStatus, see $log.client" >&2
+    fi
+
+    echo "$COMMIT,$PROFILE,$model,$transport,$concurrency,$CONNECTIONS,$MESSAGES,$INTERVAL_MS,$SIZE,$RATE,$BYTE_RATE,$DURATION_MS,$DEFER_ACCEPT_S,${completed:-0},${failed:-0},${elapsed:-},${connsPerSec:-},${msgsPerSec:-},${p50:-},${p99:-},${p999:-},$peakRss,$peakProcs,$peakThreads,$cpu,$clientStatus" \
+        | tee -a "$OUTDIR/results.csv"
+}
+
+csv_to_json()
+{
+    awk -F, '
+        NR == 1 { for (i = 1; i <= NF; ++i) key[i] = $i; n = NF; print "["; next }
+        {
+            printf "%s  {", (NR > 2 ? ",\n" : "")
+            for (i = 1; i <= n; ++i) {
+                v = $i
+                if (key[i] == "commit" || key[i] == "profile" || key[i] == "model" || key[i] == "transport" || v !~ /^-?[0-9]+(\.[0-9]+)?$/) v = "\"" v "\""
+                printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], v
+            }
+            printf "}"
+        }
+        END { print "\n]" }' "$1"
+}
+
+# p50 and connections/s of every non-tcp row against the tcp row of the
+# same model and concurrency: "0.60x p50" is 40% lower latency
+compare_transports()
+{
+    awk -F, '
+        NR == 1 { for (i = 1; i <= NF; ++i) col[$i] = i; next }
+        {
+            key = $col["model"] " c" $col["concurrency"]
+            if ($col["transport"] == "tcp") {
+                p50[key] = $col["p50_ms"]; cps[key] = $col["conns_per_sec"]
+            } else {
+                rows[++n] = key SUBSEP $col["transport"] SUBSEP $col["p50_ms"] SUBSEP $col["conns_per_sec"]
+            }
+        }
+        END {
+            if (n == 0)
+                exit
+            printf "%-28s %-10s %12s %14s\n", "model", "transport", "p50 vs tcp", "conns/s vs tcp"
+            for (i = 1; i <= n; ++i) {
+                split(rows[i], r, SUBSEP)
+                a = (p50[r[1]] > 0 && r[3] != "") ? sprintf("%.2fx", r[3] / p50[r[1]]) : "-"
+                b = (cps[r[1]] > 0 && r[4] != "") ? sprintf("%.2fx", r[4] / cps[r[1]]) : "-"
+                printf "%-28s %-10s %12s %14s\n", r[1], r[2], a, b
+            }
+        }' "$1"
+}
+
+run()
+{
+    local opt intervalGiven=0
+    OPTIND=1
+    while getopts "m:c:n:k:i:s:r:b:d:D:P:w:p:T:t:o:h" opt; do
+        case "$opt" in
+            m) MODELS=$OPTARG ;;
+            c) LEVELS=$OPTARG ;;
+            n) CONNECTIONS=$OPTARG ;;
+            k) MESSAGES=$OPTARG ;;
+            i) INTERVAL_MS=$OPTARG; intervalGiven=1 ;;
+            s) SIZE=$OPTARG ;;
+            r) RATE=$OPTARG ;;
+            b) BYTE_RATE=$OPTARG ;;
+            d) DURATION_MS=$OPTARG ;;
+            D) DEFER_ACCEPT_S=$OPTARG ;;
+            P) PROFILE=$OPTARG ;;
+            w) WORKERS=$OPTARG ;;
+            p) PORT=$OPTARG ;;
+            T) TRANSPORTS=$OPTARG ;;
+            t) TIMEOUT=$OPTARG ;;
+            o) OUTDIR=$OPTARG ;;
+            *) usage; exit 1 ;;
+        esac
+    done
+
+    # a byte rate alone streams back to back and lets the kernel pace
+    if [ "$BYTE_RATE" != 0 ] && [ $intervalGiven = 0 ]; then
+        INTERVAL_MS=0
+    fi
+
+    if [ ! -x "$BUILD/client" ]; then
+        build || exit 1
+    fi
+
+    OUTDIR=${OUTDIR:-"$ROOT/bench-results/$(date +%Y%m%d-%H%M%S)"}
+    mkdir -p "$OUTDIR/logs"
+    OUTDIR=$(cd "$OUTDIR" && pwd)
+    SOCKET_PATH="$OUTDIR/server.sock"
+    COMMIT=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+    PAGE_KB=$(($(getconf PAGESIZE) / 1024))
+    CLK_TCK=$(getconf CLK_TCK)
+
+    if port_listening || port_listening udp; then
+        echo "bench.sh: port $PORT is already in use" >&2
+        exit 1
+    fi
+
+    echo "commit,profile,model,transport,concurrency,connections,messages,interval_ms,message_size,rate,byte_rate,duration_ms,defer_accept_s,completed,failed,elapsed_sec,conns_per_sec,msgs_per_sec,p50_ms,p99_ms,p999_ms,peak_rss_kb,peak_processes,peak_threads,cpu_sec,client_status" \
+        > "$OUTDIR/results.csv"
+
+    local model concurrency transport
+    for model in ${MODELS//,/ }; do
+        for concurrency in ${LEVELS//,/ }; do
+            for transport in ${TRANSPORTS//,/ }; do
+                run_one "$model" "$concurrency" "$transport"
+            done
+        done
+    done
+    rm -f "$SOCKET_PATH"
+
+    csv_to_json "$OUTDIR/results.csv" > "$OUTDIR/results.json"
+    if [ "$TRANSPORTS" != tcp ]; then
+        compare_transports "$OUTDIR/results.csv"
+    fi
+    echo "results: $OUTDIR/results.csv $OUTDIR/results.json"
+}
+
+case "${1:-}" in
+    build)
+        build ;;
+    run)
+        shift
+        run "$@" ;;
+    *)
+        usage
+        exit 1 ;;
+esac
@@ -0,0 +1,322 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ *  Fan-out channel for the broadcast mode of epollserver. Every published
+ *  message is allocated once and queued; a subscriber is a cursor into
+ *  that queue (the next message it has to send and how much of it went
+ *  out already), so one update for 50k clients is one buffer that 50k
+ *  sendmsg() calls point at. A message counts the subscribers that still
+ *  have to send it and is freed by the last one; since every subscriber
+ *  moves front to back, messages die in queue order.
+ *
+ *  Configured from the environment:
+ *
+ *      BROADCAST            gen   publish the payload message every
+ *                                 payload interval
+ *                           -     publish every line read from stdin
+ *                           path  publish one line of that file every
+ *                                 payload interval
+ *      BROADCAST_MAX_LAG    messages a subscriber may have queued
+ *                           (default 1024)
+ *      BROADCAST_SLOW       what happens to a subscriber that falls
+ *                           further behind:
+ *                           drop        skip its oldest messages (default);
+ *                                       one stuck halfway through a
+ *                                       message is closed
+ *                           disconnect  close it
+ *                           lag         hold the publisher back until the
+ *                                       slowest subscriber caught up
+ *
+ *  With drop and disconnect no more than BROADCAST_MAX_LAG + 1 messages
+ *  are ever held, with lag about as many.
+ */
+
+#define BROADCAST_MAX_MESSAGE 65536
+#define BROADCAST_MAX_IOV 64
+
+enum broadcast_source
+{
+    BROADCAST_OFF,
+    BROADCAST_GENERATOR,
+    BROADCAST_STDIN,
+    BROADCAST_FILE
+};
+
+enum broadcast_policy
+{
+    BROADCAST_DROP,
+    BROADCAST_DISCONNECT,
+    BROADCAST_LAG
+};
+
+struct broadcast_message
+{
+    struct broadcast_message* next;
+    unsigned long seq;
+    unsigned long refs;         // subscribers that still have to send it
+    size_t size;
+    char data[];
+};
+
+struct subscriber
+{
+    struct broadcast_message* at;   // next message to send, NULL: up to date
+    size_t offset;                  // bytes of it already sent
+    int evicted;                    // BROADCAST_DISCONNECT: close it
+    struct subscriber* prev;
+    struct subscriber* next;
+};
+
+// the struct that embeds a subscriber as member
+#define subscriber_owner(s, type, member) ((type*)((char*)(s) - offsetof(type, member)))
+
+struct broadcast
+{
+    enum broadcast_source source;
+    const char* path;
+    enum broadcast_policy policy;
+    unsigned long maxLag;
+    int ended;                      // the source has nothing more
+    struct broadcast_message* head; // oldest message still held
+    struct broadcast_message* tail;
+    unsigned long published;        // sequence number of the next message
+    size_t held;
+    size_t heldPeak;
+    struct subscriber* subscribers;
+    size_t subscriberCount;
+    unsigned long dropped;          // messages skipped for slow subscribers
+    unsigned long evicted;
+};
+
+static inline const char* broadcast_policy_name(enum broadcast_policy policy)
+{
+    switch (policy)
+    {
+    case BROADCAST_DROP:
+        return "drop";
+    case BROADCAST_DISCONNECT:
+        return "disconnect";
+    default:
+        return "lag";
+    }
+}
+
+static void broadcast_init(struct broadcast* ch)
+{
+    bzero(ch, sizeof(struct broadcast));
+    const char* source = getenv("BROADCAST");
+    if (source == NULL || *source == '\0')
+        return;
+    if (strcmp(source, "gen") == 0)
+        ch->source = BROADCAST_GENERATOR;
+    else if (strcmp(source, "-") == 0)
+        ch->source = BROADCAST_STDIN;
+    else
+    {
+        ch->source = BROADCAST_FILE;
+        ch->path = source;
+    }
+
+    ch->maxLag = 1024;
+    const char* maxLag = getenv("BROADCAST_MAX_LAG");
+    if (maxLag != NULL && *maxLag != '\0')
+    {
+        char* end = NULL;
+        long parsed = strtol(maxLag, &end, 10);
+        if (*end != '\0' || parsed <= 0)
+        {
+            fprintf(stderr, "BROADCAST_MAX_LAG=%s is not a positive number\n", maxLag);
+            exit(EXIT_FAILURE);
+        }
+        ch->maxLag = (unsigned long)parsed;
+    }
+
+    const char* policy = getenv("BROADCAST_SLOW");
+    if (policy == NULL || *policy == '\0' || strcmp(policy, "drop") == 0)
+        ch->policy = BROADCAST_DROP;
+    else if (strcmp(policy, "disconnect") == 0)
+        ch->policy = BROADCAST_DISCONNECT;
+    else if (strcmp(policy, "lag") == 0)
+        ch->policy = BROADCAST_LAG;
+    else
+    {
+        fprintf(stderr, "BROADCAST_SLOW=%s: use drop, disconnect or lag\n", policy);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("broadcast: %s, slow subscribers: %s beyond %lu messages\n",
+           ch->source == BROADCAST_GENERATOR ? "generated messages"
+           : ch->source == BROADCAST_STDIN ? "lines from stdin" : ch->path,
+           broadcast_policy_name(ch->policy), ch->maxLag);
+}
+
+// messages queued for a subscriber, the one under way included
+static inline unsigned long broadcast_lag(const struct broadcast* ch, const struct subscriber* sub)
+{
+    return sub->at != NULL ? ch->published - sub->at->seq : 0;
+}
+
+static inline void broadcast_release(struct broadcast* ch, struct broadcast_message* msg)
+{
+    --msg->refs;
+    while (ch->head != NULL && ch->head->refs == 0)
+    {
+        struct broadcast_message* dead = ch->head;
+        ch->head = dead->next;
+        if (ch->head == NULL)
+            ch->tail = NULL;
+        --ch->held;
+        free(dead);
+    }
+}
+
+static inline void broadcast_subscribe(struct broadcast* ch, struct subscriber* sub)
+{
+    bzero(sub, sizeof(struct subscriber));
+    sub->next = ch->subscribers;
+    if (ch->subscribers != NULL)
+        ch->subscribers->prev = sub;
+    ch->subscribers = sub;
+    ++ch->subscriberCount;
+}
+
+static inline void broadcast_unsubscribe(struct broadcast* ch, struct subscriber* sub)
+{
+    while (sub->at != NULL)
+    {
+        struct broadcast_message* msg = sub->at;
+        sub->at = msg->next;
+        broadcast_release(ch, msg);
+    }
+    if (sub->prev != NULL)
+        sub->prev->next = sub->next;
+    else
+        ch->subscribers = sub->next;
+    if (sub->next != NULL)
+        sub->next->prev = sub->prev;
+    sub->prev = sub->next = NULL;
+    --ch->subscriberCount;
+}
+
+static inline unsigned long broadcast_slowest(const struct broadcast* ch)
+{
+    unsigned long slowest = 0;
+    const struct subscriber* sub = ch->subscribers;
+    for (; sub != NULL; sub = sub->next)
+    {
+        unsigned long lag = broadcast_lag(ch, sub);
+        if (lag > slowest)
+            slowest = lag;
+    }
+    return slowest;
+}
+
+/**
+ *  Queues a copy of data for every subscriber and applies the slow
+ *  subscriber policy. With BROADCAST_LAG the caller checks
+ *  broadcast_slowest() first and does not publish while it is at
+ *  maxLag.
+ */
+static void broadcast_publish(struct broadcast* ch, const char* data, size_t size)
+{
+    struct broadcast_message* msg = malloc(sizeof(struct broadcast_message) + size);
+    if (msg == NULL)
+    {
+        fprintf(stderr, "malloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    msg->next = NULL;
+    msg->seq = ch->published++;
+    msg->refs = ch->subscriberCount;
+    msg->size = size;
+    memcpy(msg->data, data, size);
+    if (ch->subscriberCount == 0)
+    {
+        free(msg);
+        return;
+    }
+    if (ch->tail != NULL)
+        ch->tail->next = msg;
+    else
+        ch->head = msg;
+    ch->tail = msg;
+    if (++ch->held > ch->heldPeak)
+        ch->heldPeak = ch->held;
+
+    struct subscriber* sub = ch->subscribers;
+    for (; sub != NULL; sub = sub->next)
+    {
+        if (sub->at == NULL)
+        {
+            sub->at = msg;
+            continue;
+        }
+        if (broadcast_lag(ch, sub) <= ch->maxLag || ch->policy == BROADCAST_LAG)
+            continue;
+        // a message that is half sent cannot be skipped without garbling the stream
+        while (ch->policy == BROADCAST_DROP && sub->offset == 0
+               && broadcast_lag(ch, sub) > ch->maxLag)
+        {
+            struct broadcast_message* skipped = sub->at;
+            sub->at = skipped->next;
+            ++ch->dropped;
+            broadcast_release(ch, skipped);
+        }
+        if (broadcast_lag(ch, sub) > ch->maxLag && !sub->evicted)
+        {
+            sub->evicted = 1;
+            ++ch->evicted;
+        }
+    }
+}
+
+// what the subscriber has to send next, up to count whole messages
+static inline int broadcast_iov(const struct subscriber* sub, struct iovec* iov, int count)
+{
+    int n = 0;
+    size_t skip = sub->offset;
+    const struct broadcast_message* msg = sub->at;
+    for (; msg != NULL && n < count && n < BROADCAST_MAX_IOV; msg = msg->next, ++n)
+    {
+        iov[n].iov_base = (void*)(msg->data + skip);
+        iov[n].iov_len = msg->size - skip;
+        skip = 0;
+    }
+    return n;
+}
+
+// moves the cursor over bytes that went out; returns the messages completed
+static inline int broadcast_sent(struct broadcast* ch, struct subscriber* sub, size_t bytes)
+{
+    int completed = 0;
+    while (sub->at != NULL && bytes >= sub->at->size - sub->offset)
+    {
+        struct broadcast_message* msg = sub->at;
+        bytes -= msg->size - sub->offset;
+        sub->offset = 0;
+        sub->at = msg->next;
+        broadcast_release(ch, msg);
+        ++completed;
+    }
+    sub->offset += bytes;
+    return completed;
+}
+
+static inline void broadcast_report(const struct broadcast* ch)
+{
+    printf("broadcast: %lu messages published, at most %zu held, "
+           "%lu dropped for slow subscribers, %lu subscribers evicted\n",
+           ch->published, ch->heldPeak, ch->dropped, ch->evicted);
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,6 +10,880 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "transport.h"
+#include "tuning.h"
+
+/**
+ *  Load generator mode (any of -c, -r, -d, -n):
+ *  one process keeps many non-blocking connections in an epoll set,
+ *  opening new ones to hold the target concurrency (-c) and/or at the
+ *  target rate (-r), until -d seconds passed or -n connections were
+ *  opened. Then it waits for the open ones to finish and prints
+ *  percentile histograms of
+ *   connect    - connect() start to connection established
+ *   ttfb       - connect() start to the first received byte
+ *   interval   - time between consecutive messages of a connection
+ *   total      - connect() start to the server closing the connection
+ *
+ *  With -u the same options drive the datagram service of prefork -u
+ *  instead: -c UDP sockets ("flows", each its own source port, so a
+ *  SO_REUSEPORT server spreads them over its workers) each send -b
+ *  requests with one sendmmsg() and collect the replies with recvmmsg()
+ *  before sending the next batch. -n counts requests. A reply that has
+ *  not arrived LOSS_TIMEOUT_MS after its batch went out is lost. The
+ *  summary keeps the TCP wording so the benchmark parses both: a request
+ *  is "started", a reply "completed", a lost reply "failed", and total
+ *  is the time from sending a batch to each of its replies.
+ *
+ *  -g sends a short greeting as soon as a connection is established. The
+ *  servers speak first and read it only when they defer accept()
+ *  (SERVER_DEFER_ACCEPT_S), which keeps the connection from them until
+ *  the client has sent something.
+ *
+ *  Every socket gets the options of SOCKET_PROFILE and the SOCKET_*
+ *  settings (tuning.h). With fast open the client greets as with -g: the
+ *  greeting is what travels in the SYN.
+ *
+ *  A serverIP of unix:/path or seqpacket:/path connects to a server
+ *  listening on that AF_UNIX socket (see transport.h); serverPort, the
+ *  client address, -S, -P and -u do not apply there.
+ */
+
+unsigned long long monotonic_micros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**
+ *  Log-linear histogram of microsecond values: every power of two is
+ *  split into 128 linear sub-buckets, so any percentile is within ~1%.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+struct histogram
+{
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long min;
+    unsigned long long max;
+};
+
+int histogram_index(unsigned long long value)
+{
+    if (value < HIST_SUB_BUCKETS)
+        return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (int)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+    return (shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// upper bound of the values that fall into bucket index
+unsigned long long histogram_value(int index)
+{
+    if (index < HIST_SUB_BUCKETS)
+        return (unsigned long long)index;
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    unsigned long long sub = (unsigned long long)(index % HIST_SUB_BUCKETS);
+    return ((HIST_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void histogram_add(struct histogram* hist, unsigned long long value)
+{
+    ++hist->counts[histogram_index(value)];
+    if (hist->count == 0 || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+    ++hist->count;
+    hist->sum += value;
+}
+
+unsigned long long histogram_percentile(const struct histogram* hist, double percentile)
+{
+    if (hist->count == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    unsigned long long seen = 0;
+    int i = 0;
+    for (; i < HIST_BUCKETS; ++i)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            unsigned long long value = histogram_value(i);
+            return value > hist->max ? hist->max : value;
+        }
+    }
+    return hist->max;
+}
+
+void print_histogram(const char* name, const struct histogram* hist)
+{
+    if (hist->count == 0)
+    {
+        printf("%-9s n=0\n", name);
+        return;
+    }
+    printf("%-9s n=%llu min=%.3f mean=%.3f p50=%.3f p90=%.3f p99=%.3f p99.9=%.3f max=%.3f ms\n",
+           name, hist->count, hist->min / 1000.0, (double)hist->sum / hist->count / 1000.0,
+           histogram_percentile(hist, 50) / 1000.0, histogram_percentile(hist, 90) / 1000.0,
+           histogram_percentile(hist, 99) / 1000.0, histogram_percentile(hist, 99.9) / 1000.0,
+           hist->max / 1000.0);
+}
+
+/**
+ *  Source sweeping: new connections go round-robin over every
+ *  (source address, source port) pair, so the connections one host can
+ *  hold against a single server port are bounded by addresses x ports
+ *  rather than by the ephemeral range of one address. Without a port
+ *  range the kernel picks the port at connect() time
+ *  (IP_BIND_ADDRESS_NO_PORT), which keeps every address's full range.
+ */
+struct source_range
+{
+    uint32_t first; // host byte order
+    uint32_t count;
+};
+
+struct source_pool
+{
+    struct source_range* ranges;
+    int rangeCount;
+    unsigned long long addressCount;
+    uint16_t portLow;   // 0: any port
+    uint16_t portHigh;
+    unsigned long long next;
+    unsigned long bindFailures;
+};
+
+// "a.b.c.d" or "a.b.c.d/prefix"
+int source_pool_add(struct source_pool* pool, const char* spec)
+{
+    char address[32];
+    int prefix = 32;
+    const char* slash = strchr(spec, '/');
+    size_t addressLen = slash ? (size_t)(slash - spec) : strlen(spec);
+    if (addressLen == 0 || addressLen >= sizeof(address))
+        return 0;
+    memcpy(address, spec, addressLen);
+    address[addressLen] = '\0';
+    if (slash)
+    {
+        char* end = NULL;
+        prefix = (int)strtol(slash + 1, &end, 10);
+        if (*end != '\0' || prefix < 1 || prefix > 32)
+            return 0;
+    }
+
+    struct in_addr inAddr;
+    if (inet_pton(AF_INET, address, &inAddr) != 1)
+        return 0;
+
+    uint32_t mask = prefix == 32 ? 0xffffffffu : ~(0xffffffffu >> prefix);
+    struct source_range range;
+    range.first = ntohl(inAddr.s_addr) & mask;
+    range.count = prefix == 32 ? 1 : (uint32_t)(~mask + 1ULL);
+    if (prefix <= 30)
+    {
+        // network and broadcast addresses are not usable sources
+        range.first += 1;
+        range.count -= 2;
+    }
+
+    struct source_range* grown = realloc(pool->ranges,
+                                         (pool->rangeCount + 1) * sizeof(struct source_range));
+    if (grown == NULL)
+    {
+        fprintf(stderr, "realloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pool->ranges = grown;
+    pool->ranges[pool->rangeCount++] = range;
+    pool->addressCount += range.count;
+    return 1;
+}
+
+// comma separated list of addresses and CIDR ranges
+int source_pool_parse(struct source_pool* pool, const char* list)
+{
+    char* copy = strdup(list);
+    char* saveptr = NULL;
+    char* item = strtok_r(copy, ",", &saveptr);
+    int ok = item != NULL;
+    for (; ok && item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        if (!source_pool_add(pool, item))
+        {
+            fprintf(stderr, "bad source address: %s\n", item);
+            ok = 0;
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+int parse_port_range(const char* spec, uint16_t* low, uint16_t* high)
+{
+    int first = 0;
+    int last = 0;
+    int parsed = sscanf(spec, "%d-%d", &first, &last);
+    if (parsed == 1)
+        last = first;
+    else if (parsed != 2)
+        return 0;
+    if (first < 1 || last > 65535 || first > last)
+        return 0;
+    *low = (uint16_t)first;
+    *high = (uint16_t)last;
+    return 1;
+}
+
+unsigned long long source_pool_tuples(const struct source_pool* pool)
+{
+    unsigned long long ports = pool->portLow ? pool->portHigh - pool->portLow + 1 : 1;
+    return pool->addressCount * ports;
+}
+
+void source_pool_pick(struct source_pool* pool, struct sockaddr_in* addr)
+{
+    unsigned long long index = pool->next++ % source_pool_tuples(pool);
+    unsigned long long addressIndex = index % pool->addressCount;
+    int i = 0;
+    while (addressIndex >= pool->ranges[i].count)
+        addressIndex -= pool->ranges[i++].count;
+
+    bzero(addr, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(pool->ranges[i].first + (uint32_t)addressIndex);
+    if (pool->portLow)
+        addr->sin_port = htons(pool->portLow + (uint16_t)(index / pool->addressCount));
+}
+
+// binds sockfd to the next free source tuple
+int bind_next_source(struct source_pool* pool, int sockfd)
+{
+    int enable = 1;
+    if (pool->portLow)
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+    else
+        setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(int));
+
+    // a port still held by an earlier connection is skipped, not fatal
+    int attempt = 0;
+    for (; attempt < 16; ++attempt)
+    {
+        struct sockaddr_in addr;
+        source_pool_pick(pool, &addr);
+        if (bind(sockfd, (const struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return 1;
+        ++pool->bindFailures;
+        if (errno != EADDRINUSE)
+            break;
+    }
+    fprintf(stderr, "bind() : %s\n", strerror(errno));
+    return 0;
+}
+
+struct load_config
+{
+    struct transport server;        // AF_UNIX: serverAddr is unused
+    struct sockaddr_in serverAddr;
+    struct source_pool* sources;    // NULL: let the kernel choose
+    int concurrency;        // 0: limited by the rate only
+    double rate;            // new connections per second, 0: as fast as concurrency allows
+    double duration;        // seconds, 0: until totalConnections
+    unsigned long totalConnections; // 0: until duration
+    int datagrams;          // UDP mode: concurrency is the number of flows
+    int batch;              // UDP mode: requests per sendmmsg()
+    int greet;              // send GREETING once connected
+    struct socket_tuning tuning;
+};
+
+#define GREETING "hi\n"
+
+struct load_conn
+{
+    int sockfd;             // -1: free slot
+    int connected;
+    int greet;
+    unsigned long messages;
+    unsigned long long startedAt;
+    unsigned long long firstByteAt;
+    unsigned long long lastMessageAt;
+};
+
+struct load_stats
+{
+    unsigned long started;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long long bytes;
+    unsigned long long messages;
+    struct histogram connect;
+    struct histogram ttfb;
+    struct histogram interval;
+    struct histogram total;
+};
+
+static volatile sig_atomic_t needToFinish = 0;
+void sig_int()
+{
+    needToFinish = 1;
+}
+
+void raise_nofile_limit()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+}
+
+static const struct sockaddr* server_address(const struct load_config* cfg, socklen_t* len)
+{
+    if (cfg->server.family == AF_UNIX)
+    {
+        *len = sizeof(cfg->server.unixAddr);
+        return (const struct sockaddr *)&cfg->server.unixAddr;
+    }
+    *len = sizeof(cfg->serverAddr);
+    return (const struct sockaddr *)&cfg->serverAddr;
+}
+
+// returns 0 when the connection could not even be started
+int start_connection(const struct load_config* cfg, int epollFd, struct load_conn* conn,
+                     uint32_t slot, struct load_stats* stats)
+{
+    ++stats->started;
+    conn->connected = 0;
+    conn->greet = cfg->greet;
+    conn->messages = 0;
+    conn->firstByteAt = 0;
+    conn->lastMessageAt = 0;
+    conn->startedAt = monotonic_micros();
+    conn->sockfd = transport_socket(&cfg->server, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn->sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        ++stats->failed;
+        return 0;
+    }
+    tuning_client(&cfg->tuning, conn->sockfd, cfg->server.family, cfg->greet);
+
+    if (cfg->sources != NULL)
+    {
+        if (!bind_next_source(cfg->sources, conn->sockfd))
+        {
+            close(conn->sockfd);
+            conn->sockfd = -1;
+            ++stats->failed;
+            return 0;
+        }
+    }
+
+    socklen_t addrLen;
+    const struct sockaddr* addr = server_address(cfg, &addrLen);
+    int connected = connect(conn->sockfd, addr, addrLen);
+    // a unix listener with a full backlog fails at once with EAGAIN: counted as failed
+    if (connected == -1 && errno != EINPROGRESS)
+    {
+        fprintf(stderr, "connect() : %s\n", strerror(errno));
+        close(conn->sockfd);
+        conn->sockfd = -1;
+        ++stats->failed;
+        return 0;
+    }
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    ev.data.u32 = slot;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, conn->sockfd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return 1;
+}
+
+void finish_connection(int epollFd, struct load_conn* conn, int ok, struct load_stats* stats)
+{
+    if (ok)
+    {
+        ++stats->completed;
+        histogram_add(&stats->total, monotonic_micros() - conn->startedAt);
+    }
+    else
+    {
+        ++stats->failed;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+    close(conn->sockfd);
+    conn->sockfd = -1;
+}
+
+// returns 0 when the connection is over
+int handle_connection_event(int epollFd, struct load_conn* conn, uint32_t events,
+                            struct load_stats* stats)
+{
+    unsigned long long now = monotonic_micros();
+    if (!conn->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int soError = 0;
+        socklen_t len = sizeof(soError);
+        getsockopt(conn->sockfd, SOL_SOCKET, SO_ERROR, &soError, &len);
+        if (soError != 0)
+        {
+            fprintf(stderr, "connect() : %s\n", strerror(soError));
+            finish_connection(epollFd, conn, 0, stats);
+            return 0;
+        }
+        conn->connected = 1;
+        histogram_add(&stats->connect, now - conn->startedAt);
+        if (conn->greet && send(conn->sockfd, GREETING, sizeof(GREETING) - 1, MSG_NOSIGNAL) == -1)
+        {
+            fprintf(stderr, "send() : %s\n", strerror(errno));
+            finish_connection(epollFd, conn, 0, stats);
+            return 0;
+        }
+    }
+
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        return 1;
+
+    char recvbuffer[4096];
+    while (1)
+    {
+        ssize_t bytesReceived = recv(conn->sockfd, recvbuffer, sizeof(recvbuffer), 0);
+        if (bytesReceived > 0)
+        {
+            if (conn->firstByteAt == 0)
+            {
+                conn->firstByteAt = now;
+                histogram_add(&stats->ttfb, now - conn->startedAt);
+            }
+            stats->bytes += bytesReceived;
+            unsigned long newMessages = 0;
+            ssize_t i = 0;
+            for (; i < bytesReceived; ++i)
+                newMessages += recvbuffer[i] == '\n';
+            if (newMessages > 0)
+            {
+                if (conn->lastMessageAt != 0)
+                    histogram_add(&stats->interval, now - conn->lastMessageAt);
+                conn->lastMessageAt = now;
+                conn->messages += newMessages;
+                stats->messages += newMessages;
+            }
+            continue;
+        }
+        if (bytesReceived == 0)
+        {
+            finish_connection(epollFd, conn, 1, stats);
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        if (errno == EINTR)
+            continue;
+        fprintf(stderr, "recv() : %s\n", strerror(errno));
+        finish_connection(epollFd, conn, 0, stats);
+        return 0;
+    }
+}
+
+void run_load(const struct load_config* cfg)
+{
+    raise_nofile_limit();
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(sigact));
+    sigact.sa_handler = sig_int;
+    sigaction(SIGINT, &sigact, NULL);
+
+    int slots = cfg->concurrency > 0 ? cfg->concurrency : 65536;
+    struct load_conn* conns = calloc(slots, sizeof(struct load_conn));
+    uint32_t* freeSlots = calloc(slots, sizeof(uint32_t));
+    struct load_stats* stats = calloc(1, sizeof(struct load_stats));
+    if (conns == NULL || freeSlots == NULL || stats == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int freeCount = 0;
+    int i = slots - 1;
+    for (; i >= 0; --i)
+    {
+        conns[i].sockfd = -1;
+        freeSlots[freeCount++] = (uint32_t)i;
+    }
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        fprintf(stderr, "epoll_create1() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("load: concurrency = %d, rate = %.1f/s, duration = %.1f s, connections = %lu\n",
+           cfg->concurrency, cfg->rate, cfg->duration, cfg->totalConnections);
+    if (cfg->sources != NULL)
+    {
+        printf("load: %llu source addresses x %d ports = %llu source tuples\n",
+               cfg->sources->addressCount,
+               cfg->sources->portLow ? cfg->sources->portHigh - cfg->sources->portLow + 1 : 0,
+               source_pool_tuples(cfg->sources));
+        if (cfg->concurrency > 0 && (unsigned long long)cfg->concurrency > source_pool_tuples(cfg->sources))
+            printf("load: warning: concurrency exceeds the number of source tuples\n");
+    }
+
+    unsigned long long startedAt = monotonic_micros();
+    unsigned long long stopOpeningAt = cfg->duration > 0
+        ? startedAt + (unsigned long long)(cfg->duration * 1e6) : 0;
+    double launchInterval = cfg->rate > 0 ? 1e6 / cfg->rate : 0;
+    unsigned long long nextLaunchAt = startedAt;
+    int open = 0;
+    int opening = 1;
+
+    struct epoll_event events[1024];
+    while (open > 0 || opening)
+    {
+        unsigned long long now = monotonic_micros();
+        if (opening && (needToFinish
+                        || (stopOpeningAt && now >= stopOpeningAt)
+                        || (cfg->totalConnections && stats->started >= cfg->totalConnections)))
+        {
+            opening = 0;
+            printf("load: stopped opening connections after %.3f s, waiting for %d\n",
+                   (now - startedAt) / 1e6, open);
+        }
+
+        while (opening && freeCount > 0 && now >= nextLaunchAt
+               && (!cfg->totalConnections || stats->started < cfg->totalConnections))
+        {
+            uint32_t slot = freeSlots[--freeCount];
+            if (start_connection(cfg, epollFd, &conns[slot], slot, stats))
+                ++open;
+            else
+                freeSlots[freeCount++] = slot;
+            if (launchInterval > 0)
+            {
+                nextLaunchAt += (unsigned long long)launchInterval;
+                // do not burst to catch up after a stall
+                if (nextLaunchAt + 1000000ULL < now)
+                    nextLaunchAt = now;
+            }
+        }
+
+        int timeoutMs = -1;
+        if (opening)
+        {
+            unsigned long long wakeAt = stopOpeningAt;
+            if (launchInterval > 0 && freeCount > 0 && (wakeAt == 0 || nextLaunchAt < wakeAt))
+                wakeAt = nextLaunchAt;
+            if (wakeAt != 0)
+                timeoutMs = wakeAt > now ? (int)((wakeAt - now + 999) / 1000) : 0;
+        }
+        if (needToFinish && !opening)
+            break;
+        // the last start failed at once (e.g. reset by admission control): nothing to wait for
+        if (open == 0 && timeoutMs == -1)
+            continue;
+
+        int ready = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), timeoutMs);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < ready; ++i)
+        {
+            uint32_t slot = events[i].data.u32;
+            struct load_conn* conn = &conns[slot];
+            int wasConnected = conn->connected;
+            if (!handle_connection_event(epollFd, conn, events[i].events, stats))
+            {
+                --open;
+                freeSlots[freeCount++] = slot;
+                continue;
+            }
+            // from now on only incoming data matters
+            if (!wasConnected && conn->connected)
+            {
+                struct epoll_event ev;
+                bzero(&ev, sizeof(ev));
+                ev.events = EPOLLIN | EPOLLRDHUP;
+                ev.data.u32 = slot;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->sockfd, &ev);
+            }
+        }
+    }
+
+    double elapsed = (monotonic_micros() - startedAt) / 1e6;
+    printf("load: %lu started, %lu completed, %lu failed, %d abandoned in %.3f s\n",
+           stats->started, stats->completed, stats->failed, open, elapsed);
+    printf("load: %.1f connections/s, %.1f messages/s, %llu bytes\n",
+           elapsed > 0 ? stats->completed / elapsed : 0.0,
+           elapsed > 0 ? stats->messages / elapsed : 0.0, stats->bytes);
+    if (cfg->sources != NULL && cfg->sources->bindFailures)
+        printf("load: %lu source tuples were busy and skipped\n", cfg->sources->bindFailures);
+    print_histogram("connect", &stats->connect);
+    print_histogram("ttfb", &stats->ttfb);
+    print_histogram("interval", &stats->interval);
+    print_histogram("total", &stats->total);
+
+    close(epollFd);
+    free(conns);
+    free(freeSlots);
+    free(stats);
+}
+
+#define UDP_MAX_BATCH 256
+#define LOSS_TIMEOUT_MS 200
+
+struct udp_flow
+{
+    int sockfd;
+    int outstanding;                // replies still expected for the last batch
+    unsigned long long sentAt;
+};
+
+int open_udp_flow(const struct load_config* cfg, struct udp_flow* flow)
+{
+    flow->outstanding = 0;
+    flow->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (flow->sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        return 0;
+    }
+    tuning_apply(&cfg->tuning, flow->sockfd, 0);
+    if (cfg->sources != NULL && !bind_next_source(cfg->sources, flow->sockfd))
+    {
+        close(flow->sockfd);
+        return 0;
+    }
+    // a connected socket sends without an address and only hears the server
+    if (connect(flow->sockfd, (const struct sockaddr *)&cfg->serverAddr,
+                sizeof(cfg->serverAddr)) == -1)
+    {
+        fprintf(stderr, "connect() : %s\n", strerror(errno));
+        close(flow->sockfd);
+        return 0;
+    }
+    return 1;
+}
+
+void send_udp_batch(struct udp_flow* flow, int count, struct load_stats* stats)
+{
+    static char request[] = "hi\n";
+    struct iovec iov;
+    iov.iov_base = request;
+    iov.iov_len = sizeof(request) - 1;
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    bzero(msgs, count * sizeof(struct mmsghdr));
+    int i = 0;
+    for (; i < count; ++i)
+    {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    flow->sentAt = monotonic_micros();
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = sendmmsg(flow->sockfd, msgs + sent, count - sent, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // a full send buffer or a refused port: these requests are lost
+            if (errno != EAGAIN && errno != ECONNREFUSED)
+                fprintf(stderr, "sendmmsg() : %s\n", strerror(errno));
+            stats->failed += count - sent;
+            break;
+        }
+        sent += n;
+    }
+    stats->started += count;
+    flow->outstanding = sent;
+}
+
+void receive_udp_replies(struct udp_flow* flow, struct load_stats* stats)
+{
+    static char buffers[UDP_MAX_BATCH][2048];
+    struct iovec iovs[UDP_MAX_BATCH];
+    struct mmsghdr msgs[UDP_MAX_BATCH];
+    bzero(msgs, sizeof(msgs));
+    int i = 0;
+    for (; i < UDP_MAX_BATCH; ++i)
+    {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1)
+    {
+        int n = recvmmsg(flow->sockfd, msgs, UDP_MAX_BATCH, MSG_DONTWAIT, NULL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+                fprintf(stderr, "recvmmsg() : %s\n", strerror(errno));
+            return;
+        }
+        unsigned long long now = monotonic_micros();
+        for (i = 0; i < n; ++i)
+        {
+            // a reply that comes after its batch was written off is not counted twice
+            if (flow->outstanding == 0)
+                continue;
+            --flow->outstanding;
+            ++stats->completed;
+            ++stats->messages;
+            stats->bytes += msgs[i].msg_len;
+            histogram_add(&stats->total, now - flow->sentAt);
+        }
+    }
+}
+
+void run_udp_load(const struct load_config* cfg)
+{
+    raise_nofile_limit();
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(sigact));
+    sigact.sa_handler = sig_int;
+    sigaction(SIGINT, &sigact, NULL);
+
+    int flowCount = cfg->concurrency > 0 ? cfg->concurrency : 1;
+    int batch = cfg->batch > 0 ? cfg->batch : 32;
+    if (batch > UDP_MAX_BATCH)
+        batch = UDP_MAX_BATCH;
+    struct udp_flow* flows = calloc(flowCount, sizeof(struct udp_flow));
+    struct load_stats* stats = calloc(1, sizeof(struct load_stats));
+    if (flows == NULL || stats == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        fprintf(stderr, "epoll_create1() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int i = 0;
+    for (; i < flowCount; ++i)
+    {
+        if (!open_udp_flow(cfg, &flows[i]))
+            exit(EXIT_FAILURE);
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)i;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, flows[i].sockfd, &ev) == -1)
+        {
+            fprintf(stderr, "epoll_ctl() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("load: udp, %d flows x %d requests per batch, duration = %.1f s, requests = %lu\n",
+           flowCount, batch, cfg->duration, cfg->totalConnections);
+    unsigned long long startedAt = monotonic_micros();
+    unsigned long long stopSendingAt = cfg->duration > 0
+        ? startedAt + (unsigned long long)(cfg->duration * 1e6) : 0;
+    int sending = 1;
+    int waiting = 0;
+
+    struct epoll_event events[1024];
+    while (sending || waiting > 0)
+    {
+        unsigned long long now = monotonic_micros();
+        if (sending && (needToFinish
+                        || (stopSendingAt && now >= stopSendingAt)
+                        || (cfg->totalConnections && stats->started >= cfg->totalConnections)))
+            sending = 0;
+
+        // a flow whose batch is answered, or given up on, sends the next one
+        waiting = 0;
+        for (i = 0; i < flowCount; ++i)
+        {
+            struct udp_flow* flow = &flows[i];
+            if (flow->outstanding > 0 && now - flow->sentAt >= LOSS_TIMEOUT_MS * 1000ULL)
+            {
+                stats->failed += flow->outstanding;
+                flow->outstanding = 0;
+            }
+            if (flow->outstanding == 0 && sending)
+            {
+                int count = batch;
+                if (cfg->totalConnections && cfg->totalConnections - stats->started < (unsigned long)count)
+                    count = (int)(cfg->totalConnections - stats->started);
+                if (count > 0)
+                    send_udp_batch(flow, count, stats);
+            }
+            waiting += flow->outstanding > 0;
+        }
+        if (needToFinish && !sending)
+            break;
+        if (!sending && waiting == 0)
+            break;
+
+        int ready = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), 10);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < ready; ++i)
+            receive_udp_replies(&flows[events[i].data.u32], stats);
+    }
+
+    double elapsed = (monotonic_micros() - startedAt) / 1e6;
+    int abandoned = 0;
+    for (i = 0; i < flowCount; ++i)
+    {
+        abandoned += flows[i].outstanding;
+        close(flows[i].sockfd);
+    }
+    printf("load: %lu started, %lu completed, %lu failed, %d abandoned in %.3f s\n",
+           stats->started, stats->completed, stats->failed, abandoned, elapsed);
+    printf("load: %.1f connections/s, %.1f messages/s, %llu bytes\n",
+           elapsed > 0 ? stats->completed / elapsed : 0.0,
+           elapsed > 0 ? stats->messages / elapsed : 0.0, stats->bytes);
+    print_histogram("total", &stats->total);
+
+    close(epollFd);
+    free(flows);
+    free(stats);
+}
+
 int main(int argc, char** argv)
 {
     if (argc >= 2)
@@ -16,15 +891,91 @@ int main(int argc, char** argv)
         int cmpRes = strcmp(argv[1], "--help");
         if (cmpRes == 0)
         {
-            printf("usage: client [serverIP] [serverPort] [clientIP] [clientPort]\n");
+            printf("usage: client [-c concurrency] [-r connectsPerSecond] [-d durationSeconds] "
+                   "[-n connections] [-S sourceAddr[/prefix][,...]] [-P portLow-portHigh] "
+                   "[-u [-b requestsPerBatch]] [-g] "
+                   "[serverIP|unix:path|seqpacket:path] [serverPort] [clientIP] [clientPort]\n");
             exit(EXIT_SUCCESS);
         }    
     }
 
+    struct load_config load;
+    bzero(&load, sizeof(load));
+    struct source_pool sources;
+    bzero(&sources, sizeof(sources));
+    int loadMode = 0;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "c:r:d:n:S:P:ub:g")) != -1)
+    {
+        switch (opt)
+        {
+        case 'S':
+            if (!source_pool_parse(&sources, optarg))
+                exit(EXIT_FAILURE);
+            break;
+        case 'P':
+            if (!parse_port_range(optarg, &sources.portLow, &sources.portHigh))
+            {
+                fprintf(stderr, "bad port range: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            load.concurrency = atoi(optarg);
+            break;
+        case 'r':
+            load.rate = atof(optarg);
+            break;
+        case 'd':
+            load.duration = atof(optarg);
+            break;
+        case 'n':
+            load.totalConnections = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            load.datagrams = 1;
+            break;
+        case 'b':
+            load.batch = atoi(optarg);
+            break;
+        case 'g':
+            // not a load option: greets in either mode
+            load.greet = 1;
+            continue;
+        default:
+            fprintf(stderr, "try client --help\n");
+            exit(EXIT_FAILURE);
+        }
+        loadMode = 1;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (loadMode && load.concurrency <= 0 && load.rate <= 0)
+        load.concurrency = 1;
+    if (loadMode && load.duration <= 0 && load.totalConnections == 0)
+        load.duration = 10;
+
     char serverIP[32] = "127.0.0.1";
-    if (argc >= 2)
-        strncpy(serverIP, argv[1], sizeof(serverIP));
-    printf("server ip = %s\n", serverIP);
+    load.server.family = AF_INET;
+    load.server.type = SOCK_STREAM;
+    if (argc >= 2 && (strncmp(argv[1], "unix:", 5) == 0 || strncmp(argv[1], "seqpacket:", 10) == 0))
+    {
+        if (!transport_parse(argv[1], &load.server))
+            exit(EXIT_FAILURE);
+        if (load.datagrams || sources.rangeCount != 0 || sources.portLow != 0)
+        {
+            fprintf(stderr, "-u, -S and -P need a TCP server\n");
+            exit(EXIT_FAILURE);
+        }
+        printf("server path = %s (%s)\n", load.server.unixAddr.sun_path,
+               transport_name(&load.server));
+    }
+    else
+    {
+        if (argc >= 2)
+            strncpy(serverIP, argv[1], sizeof(serverIP));
+        printf("server ip = %s\n", serverIP);
+    }
 
     uint16_t serverPort = 6666;
     if (argc >= 3)
@@ -52,15 +1003,50 @@ int main(int argc, char** argv)
     else
         printf("clientPort = auto\n");
 
+    tuning_init(&load.tuning);
+    if (load.tuning.fastOpen > 0 && load.server.family == AF_INET && !load.datagrams)
+        load.greet = 1;
+
+    if (loadMode && load.server.family == AF_UNIX)
+    {
+        run_load(&load);
+        exit(EXIT_SUCCESS);
+    }
+    if (loadMode)
+    {
+        load.serverAddr.sin_family = AF_INET;
+        load.serverAddr.sin_port = htons(serverPort);
+        if (inet_pton(AF_INET, serverIP, &load.serverAddr.sin_addr.s_addr) != 1)
+        {
+            fprintf(stderr, "inet_pton() : cannot convert serverIP\n");
+            exit(EXIT_FAILURE);
+        }
+        // a fixed clientPort cannot be shared by many connections: use -P
+        if (sources.rangeCount == 0 && !isUniversalClientIP
+            && !source_pool_parse(&sources, clientIP))
+            exit(EXIT_FAILURE);
+        if (sources.rangeCount == 0 && sources.portLow != 0)
+            source_pool_parse(&sources, "0.0.0.0");
+        if (sources.rangeCount != 0)
+            load.sources = &sources;
+        if (load.datagrams)
+            run_udp_load(&load);
+        else
+            run_load(&load);
+        free(sources.ranges);
+        exit(EXIT_SUCCESS);
+    }
+
     printf("preparing to connect...\n");
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = transport_socket(&load.server, 0);
     if (sock == -1)
     {
         fprintf(stderr, "socket() : %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    tuning_client(&load.tuning, sock, load.server.family, load.greet);
 
-    if (!isUniversalClientIP || clientPort != 0)
+    if (load.server.family == AF_INET && (!isUniversalClientIP || clientPort != 0))
     {
         printf("binding client to %s:%d\n", clientIP, (int)clientPort);
 
@@ -104,18 +1090,28 @@ int main(int argc, char** argv)
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_port = htons(serverPort);
     int convertedServIP = inet_pton(AF_INET, serverIP, &serverAddr.sin_addr.s_addr);
-    if (convertedServIP != 1)
+    if (load.server.family == AF_INET && convertedServIP != 1)
     {
         fprintf(stderr, "inet_pton() : cannot convert serverIP\n");
         exit(EXIT_FAILURE);
     }
     
-    int connected = connect(sock, (const struct sockaddr *)&serverAddr, sizeof(serverAddr));
+    int connected;
+    if (load.server.family == AF_UNIX)
+        connected = connect(sock, (const struct sockaddr *)&load.server.unixAddr,
+                            sizeof(load.server.unixAddr));
+    else
+        connected = connect(sock, (const struct sockaddr *)&serverAddr, sizeof(serverAddr));
     if (connected == -1)
     {
         fprintf(stderr, "connect() : %s\n", strerror(errno));
         exit(EXIT_FAILURE);            
     }
+    if (load.greet && send(sock, GREETING, sizeof(GREETING) - 1, MSG_NOSIGNAL) == -1)
+    {
+        fprintf(stderr, "send() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     char recvbuffer[1024];
 
@@ -0,0 +1,120 @@
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+
+/**
+ *  Fixed-capacity arena for the per-connection state of the event-driven
+ *  servers. SERVER_MAX_CONNECTIONS (default 65536) objects are reserved
+ *  up front as one slab with mmap(); every object starts on a cache line,
+ *  so a connection never shares a line with its neighbour. Objects are
+ *  carved from the slab in order the first time they are needed, so only
+ *  the pages of the peak concurrency ever get touched; a closed
+ *  connection's object goes on a LIFO free list and is the next one
+ *  handed out while it is still in cache. Accept and close never call
+ *  malloc(), and the memory is bounded by the capacity. When the pool is
+ *  full the server refuses the connection.
+ */
+
+#define CONNPOOL_ALIGN 64
+#define CONNPOOL_DEFAULT_CAPACITY 65536
+
+struct connpool_free
+{
+    struct connpool_free* next;
+};
+
+struct connpool
+{
+    char* slab;
+    size_t objectSize;      // rounded up to CONNPOOL_ALIGN
+    size_t capacity;
+    size_t carved;          // objects taken from the slab so far
+    size_t inUse;
+    size_t peak;
+    struct connpool_free* freeList;
+};
+
+static void connpool_init(struct connpool* pool, size_t objectSize)
+{
+    bzero(pool, sizeof(struct connpool));
+    pool->objectSize = (objectSize + CONNPOOL_ALIGN - 1) & ~(size_t)(CONNPOOL_ALIGN - 1);
+    pool->capacity = CONNPOOL_DEFAULT_CAPACITY;
+    const char* value = getenv("SERVER_MAX_CONNECTIONS");
+    if (value != NULL && *value != '\0')
+    {
+        char* end = NULL;
+        long parsed = strtol(value, &end, 10);
+        if (*end != '\0' || parsed <= 0)
+        {
+            fprintf(stderr, "SERVER_MAX_CONNECTIONS=%s is not a positive number\n", value);
+            exit(EXIT_FAILURE);
+        }
+        // the slab's size must not wrap around into a small mapping
+        if ((size_t)parsed > SIZE_MAX / pool->objectSize)
+        {
+            fprintf(stderr, "SERVER_MAX_CONNECTIONS=%s is too large for %zu byte connections\n",
+                    value, pool->objectSize);
+            exit(EXIT_FAILURE);
+        }
+        pool->capacity = (size_t)parsed;
+    }
+
+    size_t bytes = pool->capacity * pool->objectSize;
+    pool->slab = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->slab == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap(connection pool) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    printf("connection pool: %zu x %zu bytes (%.1f MB reserved)\n",
+           pool->capacity, pool->objectSize, bytes / 1048576.0);
+}
+
+// a zeroed object, or NULL when all capacity objects are in use
+static inline void* connpool_get(struct connpool* pool)
+{
+    void* obj;
+    if (pool->freeList != NULL)
+    {
+        obj = pool->freeList;
+        pool->freeList = pool->freeList->next;
+    }
+    else if (pool->carved < pool->capacity)
+        obj = pool->slab + pool->carved++ * pool->objectSize;
+    else
+        return NULL;
+    if (++pool->inUse > pool->peak)
+        pool->peak = pool->inUse;
+    bzero(obj, pool->objectSize);
+    return obj;
+}
+
+static inline void connpool_put(struct connpool* pool, void* obj)
+{
+    struct connpool_free* node = (struct connpool_free*)obj;
+    node->next = pool->freeList;
+    pool->freeList = node;
+    --pool->inUse;
+}
+
+static inline void connpool_report(const struct connpool* pool)
+{
+    printf("connection pool: peak %zu of %zu connections, %.1f KB touched\n",
+           pool->peak, pool->capacity, pool->carved * pool->objectSize / 1024.0);
+}
+
+static inline void connpool_destroy(struct connpool* pool)
+{
+    munmap(pool->slab, pool->capacity * pool->objectSize);
+    pool->slab = NULL;
+}
+
+#endif
@@ -0,0 +1,957 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "timerwheel.h"
+#include "connpool.h"
+#include "broadcast.h"
+#include "tuning.h"
+#include "upgrade.h"
+
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct metrics metrics;
+static struct worker_metrics* counters;
+static struct timeouts timeouts;
+static struct timer_wheel wheel;
+static struct connpool pool;
+static struct broadcast channel;
+static int epollFd = -1;
+
+/**
+ *  One process, no blocking calls:
+ *
+ *  epoll_wait(listen socket, timerfd, blocked connections)
+ *     listen socket readable -> accept4() until EAGAIN,
+ *                               send first message, schedule the next one
+ *     timerfd expired        -> advance the timing wheel: every connection
+ *                               whose timer passed sends its next messages
+ *                               (or closes after the last) or is reaped;
+ *                               re-arm timerfd to the wheel's next tick
+ *     connection writable    -> finish the send the client blocked
+ *
+ *  A connection has three timers in the wheel (timerwheel.h): its next
+ *  scheduled send, the write timeout while a send waits for the client to
+ *  read, and its lifetime. Only a blocked connection is in the epoll set;
+ *  a client that stops reading is closed after SERVER_WRITE_TIMEOUT_MS.
+ *
+ *  With BROADCAST set (broadcast.h) every connection is a subscriber of
+ *  one channel instead of running its own schedule: a publish timer (or
+ *  stdin becoming readable) queues the next message once and every
+ *  subscriber that is not blocked sends it right away; a blocked one
+ *  catches up from the queue on EPOLLOUT. PAYLOAD_MESSAGES and
+ *  PAYLOAD_DURATION_MS limit what one subscriber gets.
+ */
+
+#define MAX_EVENTS 256
+#define MAX_TICK_NS 1000000LL
+#define MIN_TICK_NS 10000LL
+
+// epoll data.ptr is a connection or one of these
+static char listenerEvent;
+static char timerEvent;
+static char sourceEvent;
+static char upgradeEvent;
+
+int create_server_socket(const struct transport* transport)
+{
+    int sockfd = transport_socket(transport, SOCK_NONBLOCK);
+    if (sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+void set_reuse_addr_opt(int sockfd)
+{
+    int enable = 1;
+    int setOptRes = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+                               &enable, sizeof(int));
+    if (setOptRes == -1)
+    {
+        fprintf(stderr, "setsockopt() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bind_server_socket(int sockfd, const struct transport* transport)
+{
+    int binded = transport_bind(sockfd, transport);
+    if (binded == -1)
+    {
+        fprintf(stderr, "bind() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void listen_server_socket(int sockfd)
+{
+    int listened = listen(sockfd, tuning.backlog);
+    if (listened == -1)
+    {
+        fprintf(stderr, "listen() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+typedef void (*sighandler_t)(int);
+void set_signal_handler(int sigNumber, const char* sigPresentation,
+                        sighandler_t handler)
+{
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(struct sigaction));
+    sigact.sa_handler = handler;
+    int sigActionSet = sigaction(sigNumber, &sigact, NULL);
+    if (sigActionSet == -1)
+    {
+        fprintf(stderr, "sigaction(%s) : %s\n", sigPresentation, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int needToFinish = 0;
+void sig_int()
+{
+    needToFinish = 1;
+}
+
+void set_sigint_handler()
+{
+    set_signal_handler(SIGINT, "SIGINT", sig_int);
+}
+
+// tens of thousands of connections need tens of thousands of descriptors
+void raise_nofile_limit()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+    {
+        fprintf(stderr, "getrlimit() : %s\n", strerror(errno));
+        return;
+    }
+    if (lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+            fprintf(stderr, "setrlimit() : %s\n", strerror(errno));
+    }
+    printf("descriptor limit = %llu\n", (unsigned long long)lim.rlim_cur);
+}
+
+// lives in the connection pool; what every step touches comes first
+struct connection
+{
+    int sockfd;
+    int sndBatch;       // messages in the send under way
+    size_t sndOffset;   // bytes of it already sent
+    struct payload_stream stream;
+    struct timer sendTimer;
+    int watched;        // in the epoll set, waiting for EPOLLOUT
+    struct subscriber sub;
+    struct payload_sent sndCost;
+    struct timer writeTimer;
+    struct timer lifeTimer;
+    struct connection* prev;
+    struct connection* next;
+    struct sockaddr_in addr;
+    char ipStr[INET_ADDRSTRLEN];
+};
+
+// every open connection, for the shutdown
+struct connection_list
+{
+    struct connection* head;
+    size_t size;
+};
+
+static struct connection_list connections;
+
+void connection_list_add(struct connection_list* list, struct connection* conn)
+{
+    conn->prev = NULL;
+    conn->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = conn;
+    list->head = conn;
+    ++list->size;
+}
+
+void connection_list_remove(struct connection_list* list, struct connection* conn)
+{
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        list->head = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    conn->prev = conn->next = NULL;
+    --list->size;
+}
+
+void arm_timer(int timerFd, const struct timer_wheel* w)
+{
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+    // all zeroes disarms the timer
+    timer_wheel_next(w, &spec.it_value);
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        fprintf(stderr, "timerfd_settime() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// the peer for log lines, formatted the first time one is written
+const char* connection_peer(struct connection* conn)
+{
+    if (conn->ipStr[0] == '\0' && transport_peer(&conn->addr, conn->ipStr) == NULL)
+        strcpy(conn->ipStr, "?");
+    return conn->ipStr;
+}
+
+void close_connection(struct connection* conn)
+{
+    log_debug("closing connection: %s:%d\n", connection_peer(conn),
+              (int)ntohs(conn->addr.sin_port));
+    timer_wheel_cancel(&wheel, &conn->sendTimer);
+    timer_wheel_cancel(&wheel, &conn->writeTimer);
+    timer_wheel_cancel(&wheel, &conn->lifeTimer);
+    if (channel.source != BROADCAST_OFF)
+        broadcast_unsubscribe(&channel, &conn->sub);
+    connection_list_remove(&connections, conn);
+    // close() takes a watched socket out of the epoll set
+    close(conn->sockfd);
+    connpool_put(&pool, conn);
+    metrics_gauge(&counters->active, -1);
+}
+
+// EPOLLOUT interest while a send waits for the client
+void watch_writable(struct connection* conn, int on)
+{
+    if (conn->watched == on)
+        return;
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epollFd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, conn->sockfd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(%s) : %s\n", on ? "EPOLL_CTL_ADD" : "EPOLL_CTL_DEL",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    conn->watched = on;
+}
+
+#define SEND_CLOSE 0
+#define SEND_DONE 1
+#define SEND_BLOCKED 2
+
+/**
+ *  Sends the messages that are due, coalesced into as few calls as
+ *  possible. A full socket buffer is not an error: SEND_BLOCKED, and the
+ *  rest of the batch goes out when the socket is writable again.
+ */
+int send_next_message(struct connection* conn)
+{
+    int clientPort = (int)ntohs(conn->addr.sin_port);
+    if (conn->sndOffset == 0)
+    {
+        conn->sndBatch = payload_stream_due(&payload, &conn->stream);
+        bzero(&conn->sndCost, sizeof(conn->sndCost));
+        log_trace("sending packet number %d to %s:%d\n", conn->stream.sent + 1,
+                  connection_peer(conn), clientPort);
+    }
+    size_t batchSize = payload.messageSize * conn->sndBatch;
+    while (conn->sndOffset < batchSize)
+    {
+        ssize_t sent = payload_send(&payload, &conn->stream, conn->sockfd, conn->sndBatch,
+                                    conn->sndOffset, &conn->sndCost);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SEND_BLOCKED;
+            if (errno == EPIPE || errno == ECONNRESET)
+            {
+                metrics_add(&counters->epipeCloses, 1);
+                log_debug("outgoing connection closed: %s:%d\n", connection_peer(conn), clientPort);
+            }
+            else
+                fprintf(stderr, "send(%s:%d) : %s\n", connection_peer(conn), clientPort,
+                        strerror(errno));
+            return SEND_CLOSE;
+        }
+        conn->sndOffset += sent;
+    }
+    conn->sndOffset = 0;
+    payload_stream_sent(&payload, &conn->stream, conn->sndBatch);
+    metrics_batch_sent(counters, conn->sndBatch, batchSize, conn->sndCost.syscalls);
+    metrics_zerocopy(counters, conn->sndCost.zerocopyBytes, conn->sndCost.zerocopyCopied);
+    return SEND_DONE;
+}
+
+// the deadline payload_stream_wait() would sleep until
+void schedule_next_step(struct connection* conn, const struct timespec* now)
+{
+    if (payload_timespec_before(&conn->stream.next, now))
+        payload_stream_catch_up(&payload, &conn->stream, now);
+    struct timespec deadline = conn->stream.next;
+    if (payload.durationMs > 0)
+    {
+        struct timespec end = conn->stream.startedAt;
+        payload_timespec_add_ns(&end, payload.durationMs * 1000000LL);
+        if (payload_timespec_before(&end, &deadline))
+            deadline = end;
+    }
+    timer_wheel_add(&wheel, &conn->sendTimer, &deadline);
+}
+
+// a blocked send waits for EPOLLOUT under the write timeout
+void wait_writable(struct connection* conn, int blocked, int progress,
+                   const struct timespec* now)
+{
+    if (!blocked)
+    {
+        timer_wheel_cancel(&wheel, &conn->writeTimer);
+        watch_writable(conn, 0);
+        return;
+    }
+    // the write timeout counts from the last progress
+    if (timeouts.writeNs > 0 && (!timer_pending(&conn->writeTimer) || progress))
+    {
+        struct timespec deadline = *now;
+        payload_timespec_add_ns(&deadline, timeouts.writeNs);
+        timer_wheel_add(&wheel, &conn->writeTimer, &deadline);
+    }
+    watch_writable(conn, 1);
+}
+
+// sends what is due and decides what the connection waits for next
+void step(struct connection* conn, const struct timespec* now)
+{
+    size_t offset = conn->sndOffset;
+    int result = send_next_message(conn);
+    if (result == SEND_CLOSE)
+    {
+        close_connection(conn);
+        return;
+    }
+    wait_writable(conn, result == SEND_BLOCKED, conn->sndOffset != offset, now);
+    if (result == SEND_DONE)
+        schedule_next_step(conn, now);
+}
+
+/**
+ *  Broadcast mode: sends what the subscriber has queued, up to its
+ *  message limit, as iovecs pointing into the shared messages.
+ */
+int send_queued_messages(struct connection* conn)
+{
+    int clientPort = (int)ntohs(conn->addr.sin_port);
+    while (conn->sub.at != NULL)
+    {
+        int count = BROADCAST_MAX_IOV;
+        if (payload.messageCount > 0 && payload.messageCount - conn->stream.sent < count)
+            count = payload.messageCount - conn->stream.sent;
+        if (count <= 0)
+            break;
+        struct iovec iov[BROADCAST_MAX_IOV];
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = broadcast_iov(&conn->sub, iov, count);
+        ssize_t sent = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SEND_BLOCKED;
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE || errno == ECONNRESET)
+            {
+                metrics_add(&counters->epipeCloses, 1);
+                log_debug("outgoing connection closed: %s:%d\n", connection_peer(conn), clientPort);
+            }
+            else
+                fprintf(stderr, "sendmsg(%s:%d) : %s\n", connection_peer(conn), clientPort,
+                        strerror(errno));
+            return SEND_CLOSE;
+        }
+        int completed = broadcast_sent(&channel, &conn->sub, (size_t)sent);
+        conn->stream.sent += completed;
+        metrics_batch_sent(counters, completed, sent, 1);
+        log_trace("sent %d messages to %s:%d\n", completed, connection_peer(conn), clientPort);
+    }
+    return SEND_DONE;
+}
+
+// step() of a subscriber; done once it got its share or the channel ran dry
+void broadcast_step(struct connection* conn, const struct timespec* now)
+{
+    int sent = conn->stream.sent;
+    size_t offset = conn->sub.offset;
+    int result = send_queued_messages(conn);
+    if (result == SEND_CLOSE || !payload_stream_more(&payload, &conn->stream)
+        || (channel.ended && conn->sub.at == NULL))
+    {
+        close_connection(conn);
+        return;
+    }
+    wait_writable(conn, result == SEND_BLOCKED,
+                  conn->stream.sent != sent || conn->sub.offset != offset, now);
+}
+
+// EPOLLOUT on a connection
+void on_writable(struct connection* conn, const struct timespec* now)
+{
+    if (channel.source != BROADCAST_OFF)
+        broadcast_step(conn, now);
+    else
+        step(conn, now);
+}
+
+void on_send_timer(struct timer* t)
+{
+    struct connection* conn = timer_owner(t, struct connection, sendTimer);
+    if (!payload_stream_more(&payload, &conn->stream))
+        close_connection(conn);
+    else
+        step(conn, &wheel.advancedTo);
+}
+
+void on_connection_timeout(struct connection* conn, const char* what)
+{
+    metrics_add(&counters->timeoutCloses, 1);
+    log_debug("%s passed: %s:%d\n", what, connection_peer(conn), (int)ntohs(conn->addr.sin_port));
+    close_connection(conn);
+}
+
+void on_write_timer(struct timer* t)
+{
+    on_connection_timeout(timer_owner(t, struct connection, writeTimer), "write timeout");
+}
+
+void on_life_timer(struct timer* t)
+{
+    on_connection_timeout(timer_owner(t, struct connection, lifeTimer), "lifetime");
+}
+
+void accept_connections(int masterSocket, const struct timespec* now)
+{
+    while (1)
+    {
+        struct sockaddr_in clientInAddr;
+        socklen_t clientInAddrLen = sizeof(clientInAddr);
+        int slaveSocket = accept4(masterSocket, (struct sockaddr *)(&clientInAddr),
+                                  &clientInAddrLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (slaveSocket == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            metrics_add(&counters->acceptErrors, 1);
+            if (errno == ECONNABORTED)
+                continue;
+            // out of descriptors or memory: leave the rest in the backlog
+            fprintf(stderr, "accept4() : %s\n", strerror(errno));
+            return;
+        }
+
+        struct connection* conn = connpool_get(&pool);
+        if (conn == NULL)
+        {
+            metrics_add(&counters->refused, 1);
+            log_debug("connection limit reached, refusing a client\n");
+            close(slaveSocket);
+            continue;
+        }
+        conn->sockfd = slaveSocket;
+        conn->sendTimer.expired = on_send_timer;
+        conn->writeTimer.expired = on_write_timer;
+        conn->lifeTimer.expired = on_life_timer;
+        connection_list_add(&connections, conn);
+        payload_stream_start(&payload, &conn->stream, slaveSocket);
+        metrics_add(&counters->accepts, 1);
+        metrics_gauge(&counters->active, 1);
+        conn->addr = clientInAddr;
+        conn->ipStr[0] = '\0';
+        transport_skip_greeting(slaveSocket);
+        log_debug("accepted request from %s:%d\n", connection_peer(conn),
+                  (int)ntohs(clientInAddr.sin_port));
+
+        if (timeouts.lifetimeNs > 0)
+        {
+            struct timespec deadline = *now;
+            payload_timespec_add_ns(&deadline, timeouts.lifetimeNs);
+            timer_wheel_add(&wheel, &conn->lifeTimer, &deadline);
+        }
+        if (channel.source == BROADCAST_OFF)
+            step(conn, now);
+        else if (channel.ended)
+            close_connection(conn);
+        else
+        {
+            broadcast_subscribe(&channel, &conn->sub);
+            // the send timer closes an idle subscriber when its duration ends
+            if (payload.durationMs > 0)
+            {
+                struct timespec end = conn->stream.startedAt;
+                payload_timespec_add_ns(&end, payload.durationMs * 1000000LL);
+                timer_wheel_add(&wheel, &conn->sendTimer, &end);
+            }
+        }
+    }
+}
+
+/**
+ *  The broadcast source. The generator and a file publish one message
+ *  per payload interval from the publish timer; stdin publishes every
+ *  line as soon as it arrives. With BROADCAST_SLOW=lag the source pauses
+ *  while the slowest subscriber is maxLag messages behind - the timer
+ *  just skips its turn, stdin leaves the epoll set and the timer checks
+ *  again every tick.
+ */
+static struct timer publishTimer;
+static struct timespec publishNext;
+static FILE* sourceFile;
+static int sourceWatched;
+static char sourceLine[BROADCAST_MAX_MESSAGE];
+static size_t sourceLineLen;
+
+// queues the message and lets every subscriber that is not blocked send it
+void publish(const char* data, size_t size, const struct timespec* now)
+{
+    broadcast_publish(&channel, data, size);
+    struct subscriber* sub = channel.subscribers;
+    while (sub != NULL)
+    {
+        // a send may close the connection and unsubscribe it
+        struct subscriber* next = sub->next;
+        struct connection* conn = subscriber_owner(sub, struct connection, sub);
+        if (sub->evicted)
+            on_connection_timeout(conn, "slow subscriber");
+        else if (!conn->watched)
+            broadcast_step(conn, now);
+        sub = next;
+    }
+}
+
+int source_lagging()
+{
+    return channel.policy == BROADCAST_LAG && broadcast_slowest(&channel) >= channel.maxLag;
+}
+
+// no more messages: subscribers close as soon as they sent what is queued
+void end_broadcast(const struct timespec* now)
+{
+    channel.ended = 1;
+    timer_wheel_cancel(&wheel, &publishTimer);
+    printf("broadcast: the source ended after %lu messages\n", channel.published);
+    struct subscriber* sub = channel.subscribers;
+    while (sub != NULL)
+    {
+        struct subscriber* next = sub->next;
+        struct connection* conn = subscriber_owner(sub, struct connection, sub);
+        if (!conn->watched)
+            broadcast_step(conn, now);
+        sub = next;
+    }
+}
+
+// out of the epoll set, not just EPOLLIN off: a closed pipe reports EPOLLHUP anyway
+void watch_source(int on)
+{
+    if (sourceWatched == on)
+        return;
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &sourceEvent;
+    if (epoll_ctl(epollFd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, STDIN_FILENO, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(stdin) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sourceWatched = on;
+}
+
+// publishes the complete lines buffered from stdin; 0 when it had to pause
+int publish_lines(const struct timespec* now)
+{
+    char* start = sourceLine;
+    char* end = sourceLine + sourceLineLen;
+    char* eol;
+    while ((eol = memchr(start, '\n', end - start)) != NULL)
+    {
+        if (source_lagging())
+            break;
+        publish(start, eol + 1 - start, now);
+        start = eol + 1;
+    }
+    sourceLineLen = end - start;
+    memmove(sourceLine, start, sourceLineLen);
+    if (eol != NULL)
+        return 0;
+    // a line longer than the buffer goes out in pieces
+    if (sourceLineLen == sizeof(sourceLine))
+    {
+        publish(sourceLine, sourceLineLen, now);
+        sourceLineLen = 0;
+    }
+    return 1;
+}
+
+void pause_source(const struct timespec* now)
+{
+    watch_source(0);
+    struct timespec retry = *now;
+    payload_timespec_add_ns(&retry, wheel.tickNs);
+    timer_wheel_add(&wheel, &publishTimer, &retry);
+}
+
+void on_stdin_readable(const struct timespec* now)
+{
+    ssize_t n = read(STDIN_FILENO, sourceLine + sourceLineLen, sizeof(sourceLine) - sourceLineLen);
+    if (n == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return;
+        fprintf(stderr, "read(stdin) : %s\n", strerror(errno));
+        n = 0;
+    }
+    if (n == 0)
+    {
+        if (sourceLineLen > 0)
+            publish(sourceLine, sourceLineLen, now);
+        watch_source(0);
+        end_broadcast(now);
+        return;
+    }
+    sourceLineLen += n;
+    if (!publish_lines(now))
+        pause_source(now);
+}
+
+void on_publish_timer(struct timer* t)
+{
+    const struct timespec* now = &wheel.advancedTo;
+    if (channel.source == BROADCAST_STDIN && sourceFile == NULL)
+    {
+        // stdin paused for a lagging subscriber
+        if (!publish_lines(now))
+            pause_source(now);
+        else
+            watch_source(1);
+        return;
+    }
+
+    if (!source_lagging())
+    {
+        if (channel.source == BROADCAST_GENERATOR)
+            publish(payload.message, payload.messageSize, now);
+        else if (fgets(sourceLine, sizeof(sourceLine), sourceFile) != NULL)
+            publish(sourceLine, strlen(sourceLine), now);
+        else
+        {
+            end_broadcast(now);
+            return;
+        }
+    }
+    payload_timespec_add_ns(&publishNext, payload.intervalNs);
+    // like payload_stream_wait(): a publisher that fell behind does not burst
+    if (payload_timespec_before(&publishNext, now))
+        publishNext = *now;
+    timer_wheel_add(&wheel, t, &publishNext);
+}
+
+void start_broadcast(const struct timespec* now)
+{
+    publishTimer.expired = on_publish_timer;
+    publishNext = *now;
+    if (channel.source == BROADCAST_STDIN)
+    {
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sourceEvent;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0)
+        {
+            sourceWatched = 1;
+            return;
+        }
+        if (errno != EPERM)
+        {
+            fprintf(stderr, "epoll_ctl(stdin) : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // a regular file cannot be polled: read it line by line like a path
+        sourceFile = stdin;
+    }
+    else if (channel.source == BROADCAST_FILE)
+    {
+        sourceFile = fopen(channel.path, "r");
+        if (sourceFile == NULL)
+        {
+            fprintf(stderr, "fopen(%s) : %s\n", channel.path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (payload.intervalNs == 0)
+    {
+        fprintf(stderr, "BROADCAST=%s needs a payload interval\n", getenv("BROADCAST"));
+        exit(EXIT_FAILURE);
+    }
+    payload_timespec_add_ns(&publishNext, payload.intervalNs);
+    timer_wheel_add(&wheel, &publishTimer, &publishNext);
+}
+
+/**
+ *  A SIGHUP starts the new binary without stopping the loop: its ready
+ *  pipe joins the epoll set, and a timer fires at its deadline. Either
+ *  sets upgradeDue, and the loop asks upgrade_check() how far it got.
+ */
+static struct timer upgradeTimer;
+static int upgradeReady = -1;
+static int upgradeDue = 0;
+
+void on_upgrade_timer(struct timer* t)
+{
+    (void)t;
+    upgradeDue = 1;
+}
+
+void start_upgrade(int masterSocket)
+{
+    upgradeReady = upgrade_begin(masterSocket, metrics.listenFd);
+    if (upgradeReady == -1)
+        return;
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &upgradeEvent;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, upgradeReady, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(upgrade) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    upgradeTimer.expired = on_upgrade_timer;
+    timer_wheel_add(&wheel, &upgradeTimer, &upgradeDeadline);
+}
+
+// 1 once the new process accepts; closing the pipe took it out of the epoll set
+int upgrade_accepted()
+{
+    upgradeDue = 0;
+    int state = upgrade_check();
+    if (state == -1)
+        return 0;
+    timer_wheel_cancel(&wheel, &upgradeTimer);
+    upgradeReady = -1;
+    return state;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2)
+    {
+        int cmpRes = strcmp(argv[1], "--help");
+        if (cmpRes == 0)
+        {
+            printf("usage: epollserver [serverPort|unix:path|seqpacket:path]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    transport_print(&transport);
+    logger_init();
+    upgrade_init(argv);
+    broadcast_init(&channel);
+    // a subscriber without a message limit or duration listens until the source ends
+    payload_init(&payload, channel.source != BROADCAST_OFF);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    metrics_init(&metrics, 1, upgrade_metrics_listener());
+    counters = metrics_slot(&metrics, 0);
+    timeouts_init(&timeouts);
+    // a tick no longer than the payload interval keeps short intervals exact
+    long long tickNs = MAX_TICK_NS;
+    if (payload.intervalNs > 0 && payload.intervalNs < tickNs)
+        tickNs = payload.intervalNs > MIN_TICK_NS ? payload.intervalNs : MIN_TICK_NS;
+    timer_wheel_init(&wheel, tickNs);
+    connpool_init(&pool, sizeof(struct connection));
+
+    set_sigint_handler();
+    raise_nofile_limit();
+
+    // after an upgrade the old process's socket is already bound, listening
+    // and non-blocking (O_NONBLOCK belongs to the open file both share)
+    int masterSocket = upgrade_listener();
+    if (masterSocket == -1)
+    {
+        masterSocket = create_server_socket(&transport);
+        if (transport.family == AF_INET)
+            set_reuse_addr_opt(masterSocket);
+        bind_server_socket(masterSocket, &transport);
+    }
+    tuning_listener(&tuning, masterSocket, &transport);
+    listen_server_socket(masterSocket);
+    transport_defer_accept(masterSocket, &transport);
+
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd == -1)
+    {
+        fprintf(stderr, "timerfd_create() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1)
+    {
+        fprintf(stderr, "epoll_create1() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listenerEvent;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, masterSocket, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(masterSocket) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ev.data.ptr = &timerEvent;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev) == -1)
+    {
+        fprintf(stderr, "epoll_ctl(timerFd) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (channel.source != BROADCAST_OFF)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        start_broadcast(&now);
+        arm_timer(timerFd, &wheel);
+    }
+
+    printf("ready to accept client connections...\n");
+    upgrade_ready();
+    struct epoll_event events[MAX_EVENTS];
+    int draining = 0;
+    while (!needToFinish && !(draining && connections.size == 0))
+    {
+        // after a handover the open connections run to their end, nothing new comes in
+        if (upgradeRequested && !draining && upgradeReady == -1)
+        {
+            start_upgrade(masterSocket);
+            arm_timer(timerFd, &wheel);
+        }
+        if (upgradeDue && upgrade_accepted())
+        {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, masterSocket, NULL);
+            close(masterSocket);
+            masterSocket = -1;
+            draining = 1;
+            printf("stop accepting, draining %zu connections\n", connections.size);
+            continue;
+        }
+
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // stdin and the timers go last: they may close connections further
+        // down the list
+        int sourceReadable = 0;
+        int timerExpired = 0;
+        int i = 0;
+        for (; i < ready; ++i)
+        {
+            if (events[i].data.ptr == &listenerEvent)
+            {
+                accept_connections(masterSocket, &now);
+            }
+            else if (events[i].data.ptr == &timerEvent)
+            {
+                uint64_t expirations = 0;
+                read(timerFd, &expirations, sizeof(expirations));
+                timerExpired = 1;
+            }
+            else if (events[i].data.ptr == &sourceEvent)
+            {
+                sourceReadable = 1;
+            }
+            else if (events[i].data.ptr == &upgradeEvent)
+            {
+                upgradeDue = 1;
+            }
+            else
+            {
+                on_writable((struct connection*)events[i].data.ptr, &now);
+            }
+        }
+        if (sourceReadable)
+            on_stdin_readable(&now);
+        if (timerExpired)
+            timer_wheel_advance(&wheel, &now);
+
+        arm_timer(timerFd, &wheel);
+    }
+
+    printf("stop working, closing %zu connections\n", connections.size);
+    upgrade_cancel();
+    while (connections.head != NULL)
+        close_connection(connections.head);
+    if (channel.source != BROADCAST_OFF)
+        broadcast_report(&channel);
+    connpool_report(&pool);
+    connpool_destroy(&pool);
+
+    close(epollFd);
+    close(timerFd);
+    if (masterSocket != -1)
+        close(masterSocket);
+    metrics_shutdown(&metrics, upgrade_handed_over());
+    if (!upgrade_handed_over())
+        transport_shutdown(&transport);
+    exit(EXIT_SUCCESS);
+}
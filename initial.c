@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,8 +9,20 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <signal.h>
 
-static const char* messageToClient = "Hi there\n";
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "timerwheel.h"
+#include "tuning.h"
+#include "upgrade.h"
+
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct timeouts timeouts;
+static struct metrics metrics;
 
 int main(int argc, char** argv)
 {
@@ -18,115 +31,156 @@ int main(int argc, char** argv)
         int cmpRes = strcmp(argv[1], "--help");
         if (cmpRes == 0)
         {
-            printf("usage: initial [serverPort]\n");
+            printf("usage: initial [serverPort|unix:path|seqpacket:path]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
             exit(EXIT_SUCCESS);
         }    
     }
 
-    uint16_t port = 6666;
-    if (argc >= 2)
-        port = (uint16_t)atoi(argv[1]);
-    printf("server port = %d\n", port);
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    transport_print(&transport);
+    logger_init();
+    upgrade_init(argv);
+    payload_init(&payload, 0);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    timeouts_init(&timeouts);
+    metrics_init(&metrics, 1, upgrade_metrics_listener());
+    struct worker_metrics* counters = metrics_slot(&metrics, 0);
     
-    int masterSocket = socket(AF_INET, SOCK_STREAM, 0);
+    // after an upgrade the old process's socket is already bound and listening
+    int masterSocket = upgrade_listener();
     if (masterSocket == -1)
     {
-        fprintf(stderr, "socket() : %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+        masterSocket = transport_socket(&transport, 0);
+        if (masterSocket == -1)
+        {
+            fprintf(stderr, "socket() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
 
-    int enable = 1;
-    int setOptRes = setsockopt(masterSocket, SOL_SOCKET, SO_REUSEADDR,
-                               &enable, sizeof(int));
-    if (setOptRes == -1)
-    {
-        fprintf(stderr, "setsockopt() : %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+        int enable = 1;
+        int setOptRes = transport.family != AF_INET ? 0
+            : setsockopt(masterSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+        if (setOptRes == -1)
+        {
+            fprintf(stderr, "setsockopt() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
 
-    struct sockaddr_in inaddr;
-    bzero(&inaddr, sizeof(inaddr));
-    inaddr.sin_family = AF_INET;
-    inaddr.sin_port = htons(port);
-    inaddr.sin_addr.s_addr = INADDR_ANY;
-    int binded = bind(masterSocket, (const struct sockaddr *)&inaddr,
-                      sizeof(inaddr));
-    if (binded == -1)
-    {
-        fprintf(stderr, "bind() : %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        int binded = transport_bind(masterSocket, &transport);
+        if (binded == -1)
+        {
+            fprintf(stderr, "bind() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
     }
 
-    int listened = listen(masterSocket, SOMAXCONN);
+    tuning_listener(&tuning, masterSocket, &transport);
+    int listened = listen(masterSocket, tuning.backlog);
     if (listened == -1)
     {
         fprintf(stderr, "listen() : %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
+    transport_defer_accept(masterSocket, &transport);
 
     printf("ready to accept client connections...\n");
+    upgrade_ready();
     while (1)
     {
+        // one client at a time: the upgrade waits for the current one
+        if (upgradeRequested && upgrade_start(masterSocket, metrics.listenFd))
+            break;
+
         struct sockaddr_in clientInAddr;
         socklen_t clientInAddrLen = sizeof(clientInAddr);
-        bzero(&clientInAddr, sizeof(struct sockaddr_in));
-        printf("waiting for client...\n");
-        int slaveSocket = accept(masterSocket, (struct sockaddr *)(&clientInAddr),
-                                 &clientInAddrLen);
+        log_trace("waiting for client...\n");
+        int slaveSocket = accept4(masterSocket, (struct sockaddr *)(&clientInAddr),
+                                  &clientInAddrLen, SOCK_CLOEXEC);
         if (slaveSocket == -1)
         {
-            if (slaveSocket == EINTR)
+            if (errno == EINTR)
             {
-                printf("signal occured... continue accepting...");
+                log_debug("signal occured... continue accepting...\n");
                 continue;
             }
             else
             {
-                fprintf(stderr, "accept() : %s\n", strerror(errno));
+                metrics_add(&counters->acceptErrors, 1);
+                fprintf(stderr, "accept4() : %s\n", strerror(errno));
                 exit(EXIT_FAILURE);
             }
         }
 
-        char buffer[INET_ADDRSTRLEN];
-        const char* clientIpStr = inet_ntop(AF_INET, &clientInAddr.sin_addr, buffer, INET_ADDRSTRLEN);
+        transport_skip_greeting(slaveSocket);
+        // only the debug and trace lines print the peer
+        char buffer[INET_ADDRSTRLEN] = "-";
+        const char* clientIpStr = buffer;
         int clientPort = (int)clientInAddr.sin_port;
+        if (log_enabled(LEVEL_DEBUG))
+            clientIpStr = transport_peer(&clientInAddr, buffer);
         if (clientIpStr == NULL)
         {
             fprintf(stderr, "inet_ntop() : %s\n", strerror(errno));
             exit(EXIT_FAILURE);
         }
-        printf("accepted request from %s:%d\n", clientIpStr, clientPort);
+        log_debug("accepted request from %s:%d\n", clientIpStr, clientPort);
+        metrics_add(&counters->accepts, 1);
+        metrics_gauge(&counters->active, 1);
 
+        struct payload_stream stream;
+        timeouts_apply(&timeouts, slaveSocket);
+        payload_stream_start(&payload, &stream, slaveSocket);
         int sndCount = 0;
-        int messageSize = strlen(messageToClient);
-        for (; sndCount < 5; ++sndCount)
+        for (; payload_stream_more(&payload, &stream); sndCount = stream.sent)
         {
-            printf("sending packet number %d to %s:%d\n", sndCount + 1,
-                   clientIpStr, clientPort);
-            int sent = sendto(slaveSocket, messageToClient, messageSize, MSG_NOSIGNAL,
-                              (struct sockaddr *)(&clientInAddr), sizeof(clientInAddr));
+            int due = payload_stream_due(&payload, &stream);
+            struct payload_sent acct;
+            log_trace("sending packet number %d to %s:%d\n", sndCount + 1,
+                      clientIpStr, clientPort);
+            ssize_t sent = payload_send_messages(&payload, &stream, slaveSocket, due, &acct);
             if (sent == -1)
             {
-                if (errno = EPIPE)
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    metrics_add(&counters->timeoutCloses, 1);
+                    log_debug("write timeout: %s:%d\n", clientIpStr, clientPort);
+                    break;
+                }
+                if (errno == EPIPE || errno == ECONNRESET)
                 {
-                    printf("outgoing connection closed: %s:%d\n", clientIpStr, clientPort);
+                    metrics_add(&counters->epipeCloses, 1);
+                    log_debug("outgoing connection closed: %s:%d\n", clientIpStr, clientPort);
                     break;
                 }
                 else
                 {
-                    fprintf(stderr, "sendto() : %s\n", strerror(errno));
+                    fprintf(stderr, "send() : %s\n", strerror(errno));
                     exit(EXIT_FAILURE);
                 }
             }
 
-            sleep(1);
+            metrics_batch_sent(counters, due, sent, acct.syscalls);
+            metrics_zerocopy(counters, acct.zerocopyBytes, acct.zerocopyCopied);
+            payload_stream_sent(&payload, &stream, due);
+
+            payload_stream_wait(&payload, &stream);
         }
 
-        printf("closing connection: %s:%d\n", clientIpStr, clientPort);
+        log_debug("closing connection: %s:%d\n", clientIpStr, clientPort);
         close(slaveSocket);
+        metrics_gauge(&counters->active, -1);
     }
 
+    printf("stop working\n");
     close(masterSocket);
+    metrics_shutdown(&metrics, upgrade_handed_over());
+    if (!upgrade_handed_over())
+        transport_shutdown(&transport);
     exit(EXIT_SUCCESS);
 }
 
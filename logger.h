@@ -0,0 +1,488 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+/**
+ *  Leveled logging, LOG_LEVEL=error|warn|info|debug|trace in the
+ *  environment (default info):
+ *
+ *      info    startup, shutdown, pool changes
+ *      debug   one line per connection event (accepted, closed, ...)
+ *      trace   one line per message and per wait
+ *
+ *  A disabled level costs one compare. At info and below nothing is on
+ *  the hot path, so records are formatted and written right away; error
+ *  goes to stderr, everything else to stdout.
+ *
+ *  From debug on, a record is not formatted where it is made: the caller
+ *  copies the format pointer and the raw arguments (strings by value)
+ *  into a 128-byte cell of a per-process bounded MPSC ring and returns.
+ *  A background thread formats drained cells into one buffer and writes
+ *  it with a single write(), so lines of different processes sharing
+ *  stdout never interleave within a line. A full ring drops the record
+ *  and counts it; the caller never waits. After fork() the child gets an
+ *  empty ring and its own flusher thread; exit() drains what is left.
+ *
+ *  Format strings must be literals: the flusher reads them later.
+ *  Supported conversions: d i u x X o c with h hh l ll z j t, f e g, s, p.
+ */
+
+enum log_level
+{
+    LEVEL_ERROR = 0,
+    LEVEL_WARN,
+    LEVEL_INFO,
+    LEVEL_DEBUG,
+    LEVEL_TRACE
+};
+
+static const char* logLevelNames[] = { "error", "warn", "info", "debug", "trace" };
+
+#define LOG_RING_CELLS 4096
+#define LOG_ARGS_SIZE 104
+#define LOG_FLUSH_BUFFER (64 * 1024)
+
+struct log_cell
+{
+    _Alignas(64) atomic_size_t sequence;
+    const char* format;
+    unsigned char level;
+    unsigned char argsSize;
+    char args[LOG_ARGS_SIZE];
+};
+
+struct log_ring
+{
+    struct log_cell* cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) size_t dequeuePos;
+    atomic_ulong dropped;
+    atomic_int flusherIdle;
+    sem_t wakeup;
+    pthread_mutex_t drainLock;  // the flusher and an exiting thread
+    pthread_t flusher;
+};
+
+static enum log_level logLevel = LEVEL_INFO;
+static struct log_ring* logRing = NULL;
+
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+#define log_trace(...) log_at(LEVEL_TRACE, __VA_ARGS__)
+#define log_enabled(level) ((level) <= logLevel)
+#define log_at(level, ...) \
+    do { if (log_enabled(level)) logger_write((level), __VA_ARGS__); } while (0)
+
+// steps over one conversion spec; returns a pointer past it
+static const char* logger_parse_spec(const char* p, int* longness, char* conversion)
+{
+    while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+        ++p;
+    while (*p >= '0' && *p <= '9')
+        ++p;
+    if (*p == '.')
+    {
+        ++p;
+        while (*p >= '0' && *p <= '9')
+            ++p;
+    }
+    // 0: int, 1: long and friends, 2: long long, -1: shorter than int
+    *longness = 0;
+    if (*p == 'h')
+    {
+        *longness = -1;
+        p += p[1] == 'h' ? 2 : 1;
+    }
+    else if (*p == 'l')
+    {
+        *longness = p[1] == 'l' ? 2 : 1;
+        p += *longness;
+    }
+    else if (*p == 'z' || *p == 'j' || *p == 't')
+    {
+        *longness = 1;
+        ++p;
+    }
+    *conversion = *p;
+    return *p != '\0' ? p + 1 : p;
+}
+
+// returns the bytes used; arguments that do not fit are left out
+static int logger_encode(char* args, const char* format, va_list ap)
+{
+    int used = 0;
+    const char* p = format;
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        ++p;
+        if (*p == '%')
+        {
+            ++p;
+            continue;
+        }
+        int longness = 0;
+        char conversion = '\0';
+        p = logger_parse_spec(p, &longness, &conversion);
+
+        if (conversion == 's')
+        {
+            const char* str = va_arg(ap, const char*);
+            if (str == NULL)
+                str = "(null)";
+            int room = LOG_ARGS_SIZE - used - 1;
+            if (room <= 0)
+                return used;
+            int len = (int)strnlen(str, room);
+            memcpy(args + used, str, len);
+            args[used + len] = '\0';
+            used += len + 1;
+            continue;
+        }
+
+        if (conversion == '\0' || used + 8 > LOG_ARGS_SIZE)
+            return used;
+        if (strchr("fFeEgG", conversion) != NULL)
+        {
+            double value = va_arg(ap, double);
+            memcpy(args + used, &value, 8);
+        }
+        else if (conversion == 'p')
+        {
+            uint64_t value = (uint64_t)(uintptr_t)va_arg(ap, void*);
+            memcpy(args + used, &value, 8);
+        }
+        else if (strchr("di", conversion) != NULL)
+        {
+            int64_t value = longness == 2 ? va_arg(ap, long long)
+                          : longness == 1 ? va_arg(ap, long)
+                          : va_arg(ap, int);
+            memcpy(args + used, &value, 8);
+        }
+        else
+        {
+            uint64_t value = longness == 2 ? va_arg(ap, unsigned long long)
+                           : longness == 1 ? va_arg(ap, unsigned long)
+                           : va_arg(ap, unsigned int);
+            memcpy(args + used, &value, 8);
+        }
+        used += 8;
+    }
+    return used;
+}
+
+// formats one cell at out; returns the number of bytes written
+static size_t logger_decode(char* out, size_t room, const char* format, const char* args,
+                            int argsSize)
+{
+    size_t len = 0;
+    int used = 0;
+    const char* p = format;
+    while (*p != '\0' && len + 1 < room)
+    {
+        if (*p != '%' || p[1] == '%')
+        {
+            out[len++] = *p;
+            p += *p == '%' ? 2 : 1;
+            continue;
+        }
+
+        const char* specStart = p;
+        int longness = 0;
+        char conversion = '\0';
+        p = logger_parse_spec(p + 1, &longness, &conversion);
+
+        // rebuild the spec with "ll" so every integer can be passed as 64 bit
+        char spec[32];
+        size_t specLen = (size_t)(p - specStart);
+        if (specLen + 2 >= sizeof(spec) || (conversion != 's' && used + 8 > argsSize)
+            || (conversion == 's' && used >= argsSize))
+        {
+            len += snprintf(out + len, room - len, "...");
+            break;
+        }
+        const char* modifiers = specStart + 1;
+        size_t flagsLen = 0;
+        while (modifiers + flagsLen < p - 1
+               && strchr("hljzt", modifiers[flagsLen]) == NULL)
+            ++flagsLen;
+        memcpy(spec, specStart, 1 + flagsLen);
+        size_t n = 1 + flagsLen;
+
+        int written = 0;
+        if (conversion == 's')
+        {
+            spec[n++] = 's';
+            spec[n] = '\0';
+            written = snprintf(out + len, room - len, spec, args + used);
+            used += (int)strlen(args + used) + 1;
+        }
+        else
+        {
+            uint64_t raw = 0;
+            memcpy(&raw, args + used, 8);
+            used += 8;
+            if (strchr("fFeEgG", conversion) != NULL)
+            {
+                double value = 0;
+                memcpy(&value, &raw, 8);
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                written = snprintf(out + len, room - len, spec, value);
+            }
+            else if (conversion == 'p')
+            {
+                spec[n++] = 'p';
+                spec[n] = '\0';
+                written = snprintf(out + len, room - len, spec, (void*)(uintptr_t)raw);
+            }
+            else if (conversion == 'c')
+            {
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                written = snprintf(out + len, room - len, spec, (int)raw);
+            }
+            else
+            {
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conversion;
+                spec[n] = '\0';
+                written = snprintf(out + len, room - len, spec, (long long)raw);
+            }
+        }
+        if (written < 0)
+            break;
+        len += (size_t)written < room - len ? (size_t)written : room - len - 1;
+    }
+    return len;
+}
+
+static void logger_write_all(int fd, const char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = write(fd, buffer, size);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buffer += written;
+        size -= (size_t)written;
+    }
+}
+
+// formats every record in the ring; returns how many there were
+static size_t logger_drain(struct log_ring* ring)
+{
+    static char buffer[LOG_FLUSH_BUFFER];
+    size_t drained = 0;
+    size_t len = 0;
+
+    pthread_mutex_lock(&ring->drainLock);
+    unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped)
+        len += snprintf(buffer, sizeof(buffer), "logger: %lu records dropped\n", dropped);
+    while (1)
+    {
+        struct log_cell* cell = &ring->cells[ring->dequeuePos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (seq != ring->dequeuePos + 1)
+            break;
+
+        if (sizeof(buffer) - len < 1024)
+        {
+            logger_write_all(STDOUT_FILENO, buffer, len);
+            len = 0;
+        }
+        len += logger_decode(buffer + len, sizeof(buffer) - len, cell->format, cell->args,
+                             cell->argsSize);
+
+        atomic_store_explicit(&cell->sequence, ring->dequeuePos + ring->mask + 1,
+                              memory_order_release);
+        ++ring->dequeuePos;
+        ++drained;
+    }
+    if (len > 0)
+        logger_write_all(STDOUT_FILENO, buffer, len);
+    pthread_mutex_unlock(&ring->drainLock);
+    return drained;
+}
+
+static void* logger_flush_loop(void* arg)
+{
+    struct log_ring* ring = (struct log_ring*)arg;
+    while (1)
+    {
+        if (logger_drain(ring) > 0)
+            continue;
+        // a producer that sees the flag set clears it and posts
+        atomic_store(&ring->flusherIdle, 1);
+        struct log_cell* next = &ring->cells[ring->dequeuePos & ring->mask];
+        if (atomic_load(&next->sequence) == ring->dequeuePos + 1)
+        {
+            atomic_store(&ring->flusherIdle, 0);
+            continue;
+        }
+        while (sem_wait(&ring->wakeup) == -1 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void logger_start_flusher(struct log_ring* ring)
+{
+    size_t i = 0;
+    for (; i <= ring->mask; ++i)
+        atomic_store_explicit(&ring->cells[i].sequence, i, memory_order_relaxed);
+    atomic_store(&ring->enqueuePos, 0);
+    ring->dequeuePos = 0;
+    atomic_store(&ring->dropped, 0);
+    atomic_store(&ring->flusherIdle, 0);
+    sem_init(&ring->wakeup, 0, 0);
+    pthread_mutex_init(&ring->drainLock, NULL);
+
+    // signals belong to the threads that serve clients
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int created = pthread_create(&ring->flusher, NULL, logger_flush_loop, ring);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (created != 0)
+    {
+        fprintf(stderr, "logger: pthread_create() : %s\n", strerror(created));
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(ring->flusher);
+}
+
+static void logger_at_fork_child()
+{
+    // the parent's records and its flusher stay with the parent
+    logger_start_flusher(logRing);
+}
+
+static void logger_flush()
+{
+    if (logRing != NULL)
+        logger_drain(logRing);
+}
+
+static void logger_write(enum log_level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void logger_write(enum log_level level, const char* format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    struct log_ring* ring = logRing;
+    if (ring == NULL || level == LEVEL_ERROR)
+    {
+        char line[1024];
+        int len = vsnprintf(line, sizeof(line), format, ap);
+        va_end(ap);
+        if (len < 0)
+            return;
+        if ((size_t)len >= sizeof(line))
+            len = sizeof(line) - 1;
+        // keep the order with whatever stdio still holds
+        fflush(stdout);
+        logger_write_all(level == LEVEL_ERROR ? STDERR_FILENO : STDOUT_FILENO, line, len);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+    struct log_cell* cell = NULL;
+    while (1)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            va_end(ap);
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->enqueuePos, memory_order_relaxed);
+        }
+    }
+
+    cell->format = format;
+    cell->level = (unsigned char)level;
+    int argsSize = logger_encode(cell->args, format, ap);
+    va_end(ap);
+    cell->argsSize = (unsigned char)argsSize;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    if (atomic_load(&ring->flusherIdle) && atomic_exchange(&ring->flusherIdle, 0))
+        sem_post(&ring->wakeup);
+}
+
+/**
+ *  Reads LOG_LEVEL; from debug on sets up the ring and its flusher.
+ *  Call it once, early in main() and before any fork().
+ */
+static void logger_init()
+{
+    const char* name = getenv("LOG_LEVEL");
+    if (name != NULL && *name != '\0')
+    {
+        int i = 0;
+        for (; i <= LEVEL_TRACE; ++i)
+        {
+            if (strcmp(name, logLevelNames[i]) == 0)
+                break;
+        }
+        if (i > LEVEL_TRACE)
+        {
+            fprintf(stderr, "bad LOG_LEVEL: %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+        logLevel = (enum log_level)i;
+    }
+    // what stdio still prints must not trail behind the ring
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (logLevel < LEVEL_DEBUG)
+        return;
+
+    struct log_ring* ring = calloc(1, sizeof(struct log_ring));
+    if (ring == NULL
+        || posix_memalign((void**)&ring->cells, 64,
+                          LOG_RING_CELLS * sizeof(struct log_cell)) != 0)
+    {
+        fprintf(stderr, "logger: cannot allocate the ring\n");
+        exit(EXIT_FAILURE);
+    }
+    ring->mask = LOG_RING_CELLS - 1;
+    logRing = ring;
+    logger_start_flusher(ring);
+    pthread_atfork(NULL, NULL, logger_at_fork_child);
+    atexit(logger_flush);
+}
+
+#endif
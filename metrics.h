@@ -0,0 +1,423 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/**
+ *  Live counters of a server: one cache line per worker slot in a
+ *  MAP_SHARED mapping made before the first fork, so every process and
+ *  thread of the server writes its own slot with relaxed atomics and
+ *  nobody takes a lock. A reader sums the slots; the sum is not a
+ *  consistent cut across workers, which is good enough to watch a server
+ *  under load.
+ *
+ *  With METRICS_PORT=<port> (bound to 127.0.0.1) or METRICS_SOCKET=<path>
+ *  in the environment, a thread of the process that called metrics_init()
+ *  answers every connection with a text snapshot and closes it:
+ *
+ *      total accepts=12 active=3 bytes_sent=108 messages_sent=12 epipe_closes=0 accept_errors=0
+ *            syscalls_saved=0 zerocopy_bytes=0 zerocopy_copied=0 timeout_closes=0 refused=0
+ *            rate_limited=0
+ *      slot 0 pid=4242 accepts=12 active=3 ...
+ *
+ *  syscalls_saved counts messages that shared a send call with another
+ *  one; zerocopy_copied counts MSG_ZEROCOPY sends the kernel reported as
+ *  copied after all, as far as their completions have been read.
+ *  timeout_closes counts connections closed by the write timeout or the
+ *  lifetime (timerwheel.h), refused the connections closed right after
+ *  accept() because the server was at its connection limit, rate_limited
+ *  the ones whose client address was over its rate (admission.h).
+ *
+ *  A second table counts per CPU, wherever the worker happened to run:
+ *  messages and bytes sent, and in the servers that pin workers
+ *  (affinity.h) the connections served and how many of them had their
+ *  packets arrive on the same CPU. The snapshot ends with one line per CPU
+ *  that did anything; load is its share of the messages:
+ *
+ *      cpu 2 accepts=6 local_accepts=6 messages_sent=30 bytes_sent=270 load=50.0%
+ *
+ *  After a binary upgrade (upgrade.h) the new process passes the endpoint
+ *  it inherited to metrics_init(); until the old one has drained, either
+ *  may answer a snapshot.
+ */
+struct worker_metrics
+{
+    _Alignas(64) atomic_ulong accepts;
+    atomic_long active;             // connections being served right now
+    atomic_ulong bytesSent;
+    atomic_ulong messagesSent;
+    atomic_ulong epipeCloses;       // the client went away mid-stream
+    atomic_ulong acceptErrors;
+    atomic_ulong syscallsSaved;
+    atomic_ulong zerocopyBytes;
+    atomic_ulong zerocopyCopied;
+    atomic_ulong timeoutCloses;     // reaped: stopped reading or lived too long
+    atomic_ulong refused;
+    atomic_ulong rateLimited;       // over the per-address connection rate
+    atomic_int pid;                 // last process that used the slot
+};
+
+struct cpu_metrics
+{
+    _Alignas(64) atomic_ulong accepts;
+    atomic_ulong localAccepts;      // the connection's packets came in on this CPU
+    atomic_ulong messagesSent;
+    atomic_ulong bytesSent;
+};
+
+// like the slots mapped before the first fork, indexed by sched_getcpu()
+static struct cpu_metrics* metricsCpus = NULL;
+static int metricsCpuCount = 0;
+
+struct metrics
+{
+    struct worker_metrics* slots;
+    int slotCount;
+    int listenFd;                   // -1: no endpoint
+    struct sockaddr_un unixAddr;    // sun_path[0] == '\0': TCP endpoint
+    pthread_t thread;
+};
+
+static inline void metrics_add(atomic_ulong* counter, unsigned long n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline void metrics_gauge(atomic_long* gauge, long delta)
+{
+    atomic_fetch_add_explicit(gauge, delta, memory_order_relaxed);
+}
+
+static inline struct cpu_metrics* metrics_this_cpu()
+{
+    int cpu = sched_getcpu();
+    if (metricsCpus == NULL || cpu < 0 || cpu >= metricsCpuCount)
+        return NULL;
+    return &metricsCpus[cpu];
+}
+
+static inline void metrics_cpu_sent(unsigned long messages, unsigned long bytes)
+{
+    struct cpu_metrics* cpu = metrics_this_cpu();
+    if (cpu == NULL)
+        return;
+    metrics_add(&cpu->messagesSent, messages);
+    metrics_add(&cpu->bytesSent, bytes);
+}
+
+// the verdict of admission.h was no: counted, the socket is closed by the caller
+static inline void metrics_rejected(struct worker_metrics* slot, int rateLimited)
+{
+    metrics_add(rateLimited ? &slot->rateLimited : &slot->refused, 1);
+}
+
+// a connection served on this CPU; local if SO_INCOMING_CPU says its packets arrive here
+static inline void metrics_cpu_accept(int sockfd)
+{
+    int cpu = sched_getcpu();
+    if (metricsCpus == NULL || cpu < 0 || cpu >= metricsCpuCount)
+        return;
+    metrics_add(&metricsCpus[cpu].accepts, 1);
+    int incoming = -1;
+    socklen_t len = sizeof(incoming);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) == 0 && incoming == cpu)
+        metrics_add(&metricsCpus[cpu].localAccepts, 1);
+}
+
+// messages that went out in fewer send calls; the difference is syscalls_saved
+static inline void metrics_batch_sent(struct worker_metrics* slot, unsigned long messages,
+                                      unsigned long bytes, unsigned long calls)
+{
+    metrics_add(&slot->messagesSent, messages);
+    metrics_add(&slot->bytesSent, bytes);
+    if (messages > calls)
+        metrics_add(&slot->syscallsSaved, messages - calls);
+    metrics_cpu_sent(messages, bytes);
+}
+
+static inline void metrics_zerocopy(struct worker_metrics* slot, unsigned long bytes,
+                                    unsigned long copied)
+{
+    if (bytes)
+        metrics_add(&slot->zerocopyBytes, bytes);
+    if (copied)
+        metrics_add(&slot->zerocopyCopied, copied);
+}
+
+static unsigned long metrics_load(atomic_ulong* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// one line per CPU that served or sent anything
+static void metrics_write_cpus(FILE* out)
+{
+    unsigned long total = 0;
+    int i = 0;
+    for (; i < metricsCpuCount; ++i)
+        total += metrics_load(&metricsCpus[i].messagesSent);
+    for (i = 0; i < metricsCpuCount; ++i)
+    {
+        struct cpu_metrics* cpu = &metricsCpus[i];
+        unsigned long accepts = metrics_load(&cpu->accepts);
+        unsigned long messages = metrics_load(&cpu->messagesSent);
+        if (accepts == 0 && messages == 0)
+            continue;
+        fprintf(out, "cpu %d accepts=%lu local_accepts=%lu messages_sent=%lu bytes_sent=%lu "
+                "load=%.1f%%\n", i, accepts, metrics_load(&cpu->localAccepts), messages,
+                metrics_load(&cpu->bytesSent), total ? 100.0 * messages / total : 0.0);
+    }
+}
+
+static void metrics_write_snapshot(struct metrics* m, FILE* out)
+{
+    unsigned long accepts = 0, bytes = 0, messages = 0, epipe = 0, errors = 0;
+    unsigned long saved = 0, zerocopy = 0, copied = 0, timeouts = 0, refused = 0, limited = 0;
+    long active = 0;
+    int i = 0;
+    for (; i < m->slotCount; ++i)
+    {
+        struct worker_metrics* slot = &m->slots[i];
+        accepts += metrics_load(&slot->accepts);
+        active += atomic_load_explicit(&slot->active, memory_order_relaxed);
+        bytes += metrics_load(&slot->bytesSent);
+        messages += metrics_load(&slot->messagesSent);
+        epipe += metrics_load(&slot->epipeCloses);
+        errors += metrics_load(&slot->acceptErrors);
+        saved += metrics_load(&slot->syscallsSaved);
+        zerocopy += metrics_load(&slot->zerocopyBytes);
+        copied += metrics_load(&slot->zerocopyCopied);
+        timeouts += metrics_load(&slot->timeoutCloses);
+        refused += metrics_load(&slot->refused);
+        limited += metrics_load(&slot->rateLimited);
+    }
+    fprintf(out, "total accepts=%lu active=%ld bytes_sent=%lu messages_sent=%lu "
+            "epipe_closes=%lu accept_errors=%lu syscalls_saved=%lu zerocopy_bytes=%lu "
+            "zerocopy_copied=%lu timeout_closes=%lu refused=%lu rate_limited=%lu\n",
+            accepts, active, bytes, messages, epipe, errors, saved, zerocopy, copied, timeouts,
+            refused, limited);
+
+    for (i = 0; i < m->slotCount; ++i)
+    {
+        struct worker_metrics* slot = &m->slots[i];
+        int pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
+        if (pid == 0)
+            continue;
+        fprintf(out, "slot %d pid=%d accepts=%lu active=%ld bytes_sent=%lu messages_sent=%lu "
+                "epipe_closes=%lu accept_errors=%lu syscalls_saved=%lu zerocopy_bytes=%lu "
+                "zerocopy_copied=%lu timeout_closes=%lu refused=%lu rate_limited=%lu\n", i, pid,
+                metrics_load(&slot->accepts),
+                atomic_load_explicit(&slot->active, memory_order_relaxed),
+                metrics_load(&slot->bytesSent), metrics_load(&slot->messagesSent),
+                metrics_load(&slot->epipeCloses), metrics_load(&slot->acceptErrors),
+                metrics_load(&slot->syscallsSaved), metrics_load(&slot->zerocopyBytes),
+                metrics_load(&slot->zerocopyCopied), metrics_load(&slot->timeoutCloses),
+                metrics_load(&slot->refused), metrics_load(&slot->rateLimited));
+    }
+    metrics_write_cpus(out);
+}
+
+static void* metrics_serve(void* arg)
+{
+    struct metrics* m = (struct metrics*)arg;
+    while (1)
+    {
+        int client = accept(m->listenFd, NULL, NULL);
+        if (client == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "metrics: accept() : %s\n", strerror(errno));
+            return NULL;
+        }
+
+        char* text = NULL;
+        size_t textLen = 0;
+        FILE* out = open_memstream(&text, &textLen);
+        if (out != NULL)
+        {
+            metrics_write_snapshot(m, out);
+            fclose(out);
+            size_t written = 0;
+            while (written < textLen)
+            {
+                ssize_t n = send(client, text + written, textLen - written, MSG_NOSIGNAL);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+            free(text);
+        }
+        close(client);
+    }
+}
+
+static int metrics_listen(struct metrics* m, int inheritedFd)
+{
+    const char* path = getenv("METRICS_SOCKET");
+    const char* port = getenv("METRICS_PORT");
+    int sockfd = inheritedFd;
+    if (sockfd != -1)
+    {
+        // the socket file now belongs to this process
+        if (path != NULL && *path != '\0' && strlen(path) < sizeof(m->unixAddr.sun_path))
+        {
+            m->unixAddr.sun_family = AF_UNIX;
+            strcpy(m->unixAddr.sun_path, path);
+        }
+        printf("metrics: endpoint taken over\n");
+        return sockfd;
+    }
+    if (path != NULL && *path != '\0')
+    {
+        if (strlen(path) >= sizeof(m->unixAddr.sun_path))
+        {
+            fprintf(stderr, "metrics: socket path is too long: %s\n", path);
+            return -1;
+        }
+        m->unixAddr.sun_family = AF_UNIX;
+        strcpy(m->unixAddr.sun_path, path);
+        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(path);
+        if (sockfd == -1
+            || bind(sockfd, (const struct sockaddr *)&m->unixAddr, sizeof(m->unixAddr)) == -1)
+        {
+            fprintf(stderr, "metrics: bind(%s) : %s\n", path, strerror(errno));
+            m->unixAddr.sun_path[0] = '\0';
+            goto failed;
+        }
+        printf("metrics: unix socket %s\n", path);
+    }
+    else if (port != NULL && *port != '\0')
+    {
+        struct sockaddr_in inaddr;
+        bzero(&inaddr, sizeof(inaddr));
+        inaddr.sin_family = AF_INET;
+        inaddr.sin_port = htons((uint16_t)atoi(port));
+        inaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int enable = 1;
+        sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd == -1
+            || setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == -1
+            || bind(sockfd, (const struct sockaddr *)&inaddr, sizeof(inaddr)) == -1)
+        {
+            fprintf(stderr, "metrics: bind(127.0.0.1:%s) : %s\n", port, strerror(errno));
+            goto failed;
+        }
+        printf("metrics: port %s\n", port);
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (listen(sockfd, SOMAXCONN) == -1)
+    {
+        fprintf(stderr, "metrics: listen() : %s\n", strerror(errno));
+        goto failed;
+    }
+    return sockfd;
+
+failed:
+    if (sockfd != -1)
+        close(sockfd);
+    return -1;
+}
+
+/**
+ *  Maps slotCount zeroed slots and starts the snapshot endpoint if one is
+ *  configured: inheritedFd if it is not -1, a listener of the old process
+ *  after an upgrade, a new one otherwise. Call it before forking workers;
+ *  a child that must not keep the endpoint alive calls metrics_after_fork().
+ */
+static void metrics_init(struct metrics* m, int slotCount, int inheritedFd)
+{
+    bzero(m, sizeof(struct metrics));
+    m->slotCount = slotCount;
+    m->slots = mmap(NULL, slotCount * sizeof(struct worker_metrics),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m->slots == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    metricsCpuCount = cpus > 0 ? (int)cpus : 1;
+    metricsCpus = mmap(NULL, metricsCpuCount * sizeof(struct cpu_metrics),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (metricsCpus == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    m->listenFd = metrics_listen(m, inheritedFd);
+    if (m->listenFd == -1)
+        return;
+
+    // signals are for the threads that serve clients, not for this one
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    int created = pthread_create(&m->thread, NULL, metrics_serve, m);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (created != 0)
+    {
+        fprintf(stderr, "metrics: pthread_create() : %s\n", strerror(created));
+        close(m->listenFd);
+        m->listenFd = -1;
+    }
+    else
+    {
+        pthread_detach(m->thread);
+    }
+}
+
+// a worker without a slot of its own would silently share another one's
+static inline struct worker_metrics* metrics_slot(struct metrics* m, int index)
+{
+    if (index < 0 || index >= m->slotCount)
+    {
+        fprintf(stderr, "metrics: slot %d out of %d\n", index, m->slotCount);
+        exit(EXIT_FAILURE);
+    }
+    struct worker_metrics* slot = &m->slots[index];
+    atomic_store_explicit(&slot->pid, (int)getpid(), memory_order_relaxed);
+    return slot;
+}
+
+// the endpoint thread does not survive fork(); its socket must not either
+static inline void metrics_after_fork(struct metrics* m)
+{
+    if (m->listenFd != -1)
+        close(m->listenFd);
+    m->listenFd = -1;
+    m->unixAddr.sun_path[0] = '\0';
+}
+
+// handedOver: after an upgrade the socket file belongs to the new process
+static inline void metrics_shutdown(struct metrics* m, int handedOver)
+{
+    if (m->unixAddr.sun_path[0] != '\0' && !handedOver)
+        unlink(m->unixAddr.sun_path);
+}
+
+#endif
@@ -0,0 +1,511 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+/**
+ *  What every server sends to a client: messageCount messages of
+ *  messageSize bytes, intervalNs apart. The defaults are the original
+ *  five "Hi there\n" one second apart. The benchmark harness changes the
+ *  workload through the environment, so every server model runs the same
+ *  one without growing its own set of options:
+ *
+ *      PAYLOAD_MESSAGES      messages per connection, 0 for as many as
+ *                            PAYLOAD_DURATION_MS allows
+ *      PAYLOAD_INTERVAL_MS   pause between two messages, 0 for none
+ *      PAYLOAD_RATE          messages per second per connection; replaces
+ *                            PAYLOAD_INTERVAL_MS
+ *      PAYLOAD_BYTE_RATE     bytes per second per connection, enforced by
+ *                            the kernel through SO_MAX_PACING_RATE; without
+ *                            PAYLOAD_RATE or PAYLOAD_INTERVAL_MS messages
+ *                            go out back to back and the kernel paces them
+ *      PAYLOAD_DURATION_MS   stop streaming to a connection after this long
+ *      PAYLOAD_SIZE          bytes per message; "Hi there " repeated,
+ *                            the last byte is always '\n'
+ *      PAYLOAD_FILE          send this file as every message instead;
+ *                            PAYLOAD_SIZE is ignored
+ *      PAYLOAD_BATCH         at most this many due messages go out in one
+ *                            sendmsg(); default 1
+ *      PAYLOAD_ZEROCOPY      1: send messages of PAYLOAD_ZEROCOPY_MIN bytes
+ *                            or more with MSG_ZEROCOPY
+ *
+ *  A payload file is opened and mapped once, before any fork, so every
+ *  process of a server shares one descriptor and the page cache pages
+ *  behind it. payload_send() hands it to sendfile(), which moves page
+ *  cache pages to the socket without copying them through user space;
+ *  the read-only mapping serves code that needs a plain buffer (io_uring
+ *  SENDMSG). sendfile() has no MSG_NOSIGNAL, so file mode ignores SIGPIPE.
+ *
+ *  A server that blocks in send() walks a connection through a struct
+ *  payload_stream: payload_stream_more() says whether another message is
+ *  due, payload_stream_wait() sleeps until its absolute deadline. The
+ *  deadlines are start + n * interval, so the time spent sending does not
+ *  stretch the interval. A sender that fell behind keeps at most a batch
+ *  of missed deadlines (payload_stream_catch_up()); the older ones are
+ *  dropped instead of sent in a burst.
+ *
+ *  Messages that are due together - every one with a zero interval, the
+ *  ones a late sender missed otherwise - are coalesced into one sendmsg()
+ *  whose iovec points PAYLOAD_BATCH times at the same buffer. A payload
+ *  file still goes out one sendfile() per message.
+ *
+ *  MSG_ZEROCOPY pins the message pages instead of copying them and later
+ *  reports on the socket error queue that the kernel let go of them. The
+ *  message buffer never changes, so nothing has to wait for that; the
+ *  notifications are only read to keep them from piling up (ENOBUFS) and
+ *  to count the sends the kernel copied after all - every one on
+ *  loopback. Zero-copy only pays off for large sends, hence the minimum.
+ */
+
+#define PAYLOAD_MAX_BATCH 64
+#define PAYLOAD_ZEROCOPY_MIN 16384
+#define PAYLOAD_ZEROCOPY_REAP 32    // read completions after this many sends
+
+static const char* defaultMessage = "Hi there\n";
+
+struct payload
+{
+    char* message;
+    size_t messageSize;
+    int messageCount;           // 0: until durationMs has passed
+    long long intervalNs;
+    long durationMs;            // 0: no time limit
+    unsigned long pacingRate;   // bytes/s for SO_MAX_PACING_RATE, 0: none
+    int batch;
+    int zerocopy;
+    int fileFd;                 // -1: message is the generated text
+};
+
+struct payload_stream
+{
+    int sent;
+    struct timespec startedAt;
+    struct timespec next;       // when the next message is due
+    int zerocopy;               // SO_ZEROCOPY is on for this socket
+    unsigned zerocopyPending;   // MSG_ZEROCOPY sends without a completion yet
+};
+
+// what one or more payload_send() calls cost
+struct payload_sent
+{
+    unsigned long syscalls;
+    unsigned long zerocopyBytes;
+    unsigned long zerocopyCopied;   // completions the kernel copied after all
+};
+
+static long payload_env(const char* name, long defaultValue, long minValue)
+{
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return defaultValue;
+
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed < minValue)
+    {
+        fprintf(stderr, "bad %s: %s\n", name, value);
+        exit(EXIT_FAILURE);
+    }
+    return parsed;
+}
+
+static void payload_map_file(struct payload* payload, const char* path)
+{
+    payload->fileFd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (payload->fileFd == -1 || fstat(payload->fileFd, &st) == -1)
+    {
+        fprintf(stderr, "open(%s) : %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        fprintf(stderr, "%s is not a regular non-empty file\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    payload->messageSize = (size_t)st.st_size;
+    payload->message = mmap(NULL, payload->messageSize, PROT_READ, MAP_SHARED,
+                            payload->fileFd, 0);
+    if (payload->message == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap(%s) : %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    madvise(payload->message, payload->messageSize, MADV_WILLNEED);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void payload_generate(struct payload* payload)
+{
+    payload->messageSize = (size_t)payload_env("PAYLOAD_SIZE", (long)strlen(defaultMessage), 1);
+    payload->message = malloc(payload->messageSize);
+    if (payload->message == NULL)
+    {
+        fprintf(stderr, "malloc() : cannot allocate %zu byte message\n", payload->messageSize);
+        exit(EXIT_FAILURE);
+    }
+    size_t textLen = strlen(defaultMessage) - 1;
+    size_t i = 0;
+    for (; i < payload->messageSize - 1; ++i)
+        payload->message[i] = i % (textLen + 1) == textLen ? ' ' : defaultMessage[i % (textLen + 1)];
+    payload->message[payload->messageSize - 1] = '\n';
+}
+
+/**
+ *  openEnded: the caller ends every stream itself (a broadcast source),
+ *  so PAYLOAD_MESSAGES=0 needs no PAYLOAD_DURATION_MS.
+ */
+static void payload_init(struct payload* payload, int openEnded)
+{
+    payload->messageCount = (int)payload_env("PAYLOAD_MESSAGES", 5, 0);
+    payload->durationMs = payload_env("PAYLOAD_DURATION_MS", 0, 0);
+    payload->pacingRate = (unsigned long)payload_env("PAYLOAD_BYTE_RATE", 0, 0);
+    payload->batch = (int)payload_env("PAYLOAD_BATCH", 1, 1);
+    if (payload->batch > PAYLOAD_MAX_BATCH)
+        payload->batch = PAYLOAD_MAX_BATCH;
+    payload->zerocopy = (int)payload_env("PAYLOAD_ZEROCOPY", 0, 0) != 0;
+    payload->fileFd = -1;
+    if (payload->messageCount == 0 && payload->durationMs == 0 && !openEnded)
+    {
+        fprintf(stderr, "PAYLOAD_MESSAGES=0 needs PAYLOAD_DURATION_MS\n");
+        exit(EXIT_FAILURE);
+    }
+
+    long rate = payload_env("PAYLOAD_RATE", 0, 0);
+    const char* intervalMs = getenv("PAYLOAD_INTERVAL_MS");
+    if (rate > 0)
+        payload->intervalNs = 1000000000LL / rate;
+    else if (payload->pacingRate > 0 && (intervalMs == NULL || *intervalMs == '\0'))
+        payload->intervalNs = 0;
+    else
+        payload->intervalNs = payload_env("PAYLOAD_INTERVAL_MS", 1000, 0) * 1000000LL;
+
+    const char* path = getenv("PAYLOAD_FILE");
+    if (path != NULL && *path != '\0')
+    {
+        payload_map_file(payload, path);
+        printf("payload: %d x %s (%zu bytes) every %.3f ms\n", payload->messageCount,
+               path, payload->messageSize, payload->intervalNs / 1e6);
+    }
+    else
+    {
+        payload_generate(payload);
+        printf("payload: %d x %zu bytes every %.3f ms\n", payload->messageCount,
+               payload->messageSize, payload->intervalNs / 1e6);
+    }
+    if (payload->durationMs > 0)
+        printf("payload: streaming for at most %ld ms\n", payload->durationMs);
+    if (payload->pacingRate > 0)
+        printf("payload: paced by the kernel at %lu bytes/s\n", payload->pacingRate);
+    if (payload->batch > 1)
+        printf("payload: up to %d due messages per send\n", payload->batch);
+    if (payload->zerocopy && payload->fileFd != -1)
+        payload->zerocopy = 0;  // sendfile() does not copy to begin with
+    if (payload->zerocopy)
+        printf("payload: MSG_ZEROCOPY for sends of %d bytes or more\n", PAYLOAD_ZEROCOPY_MIN);
+}
+
+// reads the zero-copy completions that are there, without waiting
+static inline void payload_zerocopy_reap(struct payload_stream* stream, int sockfd,
+                                         struct payload_sent* acct)
+{
+    while (stream->zerocopyPending > 0)
+    {
+        char control[128];
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL)
+            continue;
+        const struct sock_extended_err* err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+        // one notification covers the sends numbered ee_info..ee_data
+        unsigned completed = err->ee_data - err->ee_info + 1;
+        stream->zerocopyPending -= completed < stream->zerocopyPending
+            ? completed : stream->zerocopyPending;
+        if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            acct->zerocopyCopied += completed;
+    }
+}
+
+/**
+ *  One send call for what is left of count consecutive messages after
+ *  offset bytes; send() semantics. A payload file goes out one message
+ *  per call, so a caller loops until count messages are done.
+ */
+static inline ssize_t payload_send(const struct payload* payload, struct payload_stream* stream,
+                                   int sockfd, int count, size_t offset, struct payload_sent* acct)
+{
+    size_t first = offset / payload->messageSize;
+    size_t skip = offset % payload->messageSize;
+    ++acct->syscalls;
+    if (payload->fileFd != -1)
+    {
+        // the offset argument leaves the shared file position alone
+        off_t fileOffset = (off_t)skip;
+        return sendfile(sockfd, payload->fileFd, &fileOffset, payload->messageSize - skip);
+    }
+
+    struct iovec iov[PAYLOAD_MAX_BATCH];
+    int n = 0;
+    size_t i = first;
+    for (; i < (size_t)count && n < PAYLOAD_MAX_BATCH; ++i, ++n)
+    {
+        iov[n].iov_base = payload->message + skip;
+        iov[n].iov_len = payload->messageSize - skip;
+        skip = 0;
+    }
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    int flags = MSG_NOSIGNAL;
+    if (stream->zerocopy && payload->messageSize * count - offset >= PAYLOAD_ZEROCOPY_MIN)
+        flags |= MSG_ZEROCOPY;
+    ssize_t sent = sendmsg(sockfd, &msg, flags);
+    if (sent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+    {
+        // too many completions unread: collect them and copy this time
+        payload_zerocopy_reap(stream, sockfd, acct);
+        ++acct->syscalls;
+        return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    }
+    if (sent > 0 && (flags & MSG_ZEROCOPY))
+    {
+        acct->zerocopyBytes += (unsigned long)sent;
+        if (++stream->zerocopyPending >= PAYLOAD_ZEROCOPY_REAP)
+            payload_zerocopy_reap(stream, sockfd, acct);
+    }
+    return sent;
+}
+
+// count whole messages on a blocking socket: their size, or -1 and errno
+static inline ssize_t payload_send_messages(const struct payload* payload,
+                                            struct payload_stream* stream, int sockfd,
+                                            int count, struct payload_sent* acct)
+{
+    bzero(acct, sizeof(struct payload_sent));
+    size_t total = payload->messageSize * count;
+    size_t sent = 0;
+    while (sent < total)
+    {
+        ssize_t n = payload_send(payload, stream, sockfd, count, sent, acct);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    return (ssize_t)sent;
+}
+
+static inline struct timespec payload_interval(const struct payload* payload)
+{
+    struct timespec interval;
+    interval.tv_sec = payload->intervalNs / 1000000000LL;
+    interval.tv_nsec = payload->intervalNs % 1000000000LL;
+    return interval;
+}
+
+static inline void payload_timespec_add_ns(struct timespec* t, long long ns)
+{
+    t->tv_sec += ns / 1000000000LL;
+    t->tv_nsec += ns % 1000000000LL;
+    if (t->tv_nsec >= 1000000000L)
+    {
+        t->tv_sec += 1;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+static inline int payload_timespec_before(const struct timespec* a, const struct timespec* b)
+{
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec < b->tv_sec;
+    return a->tv_nsec < b->tv_nsec;
+}
+
+// starts the clock of a new connection and asks the kernel to pace it
+static inline void payload_stream_start(const struct payload* payload,
+                                        struct payload_stream* stream, int sockfd)
+{
+    stream->sent = 0;
+    clock_gettime(CLOCK_MONOTONIC, &stream->startedAt);
+    stream->next = stream->startedAt;
+    stream->zerocopyPending = 0;
+    int enable = 1;
+    stream->zerocopy = payload->zerocopy
+        && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == 0;
+    if (payload->zerocopy && !stream->zerocopy)
+        fprintf(stderr, "setsockopt(SO_ZEROCOPY) : %s\n", strerror(errno));
+    if (payload->pacingRate == 0)
+        return;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                   &payload->pacingRate, sizeof(payload->pacingRate)) == -1)
+        fprintf(stderr, "setsockopt(SO_MAX_PACING_RATE) : %s\n", strerror(errno));
+    // keep about 100 ms of unsent data queued, not a whole send buffer that
+    // would drain for seconds after the stream's duration is over
+    unsigned long queued = payload->pacingRate / 10;
+    int lowat = (int)(queued > payload->messageSize ? queued : payload->messageSize);
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) == -1)
+        fprintf(stderr, "setsockopt(TCP_NOTSENT_LOWAT) : %s\n", strerror(errno));
+}
+
+/**
+ *  For a server on a unix socket, which has neither SO_MAX_PACING_RATE
+ *  nor MSG_ZEROCOPY: a byte rate becomes the interval that sends one
+ *  message at that rate, unless the interval was set explicitly.
+ */
+static void payload_unix_socket(struct payload* payload)
+{
+    if (payload->zerocopy)
+        printf("payload: no zero-copy on unix sockets\n");
+    payload->zerocopy = 0;
+    if (payload->pacingRate == 0)
+        return;
+    if (payload->intervalNs == 0)
+    {
+        payload->intervalNs = (long long)(payload->messageSize * 1000000000.0 / payload->pacingRate);
+        printf("payload: paced by sleeping %.3f ms between messages\n", payload->intervalNs / 1e6);
+    }
+    payload->pacingRate = 0;
+}
+
+static inline int payload_stream_more(const struct payload* payload,
+                                      const struct payload_stream* stream)
+{
+    if (payload->messageCount > 0 && stream->sent >= payload->messageCount)
+        return 0;
+    if (payload->durationMs == 0)
+        return 1;
+    struct timespec now, end = stream->startedAt;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    payload_timespec_add_ns(&end, payload->durationMs * 1000000LL);
+    return payload_timespec_before(&now, &end);
+}
+
+/**
+ *  How many messages to send now: the one that is due plus, up to the
+ *  batch size, the ones whose deadlines have passed as well.
+ */
+static inline int payload_stream_due(const struct payload* payload,
+                                     const struct payload_stream* stream)
+{
+    int due = 1;
+    if (payload->batch > 1)
+    {
+        if (payload->intervalNs == 0)
+            due = payload->batch;
+        else
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long late = (now.tv_sec - stream->next.tv_sec) * 1000000000LL
+                + (now.tv_nsec - stream->next.tv_nsec);
+            if (late > 0)
+                due += late / payload->intervalNs < payload->batch
+                    ? (int)(late / payload->intervalNs) : payload->batch;
+            if (due > payload->batch)
+                due = payload->batch;
+        }
+    }
+    if (payload->messageCount > 0 && due > payload->messageCount - stream->sent)
+        due = payload->messageCount - stream->sent;
+    return due;
+}
+
+/**
+ *  Called once the next deadline has passed: the messages missed since
+ *  stay due, so payload_stream_due() sends them with the late one, up to
+ *  PAYLOAD_BATCH in all. Further behind, the schedule starts over a batch
+ *  before now. With PAYLOAD_BATCH=1 that is now.
+ */
+static inline void payload_stream_catch_up(const struct payload* payload,
+                                           struct payload_stream* stream,
+                                           const struct timespec* now)
+{
+    long long keep = payload->intervalNs * (payload->batch - 1);
+    long long behind = (now->tv_sec - stream->next.tv_sec) * 1000000000LL
+        + (now->tv_nsec - stream->next.tv_nsec);
+    if (behind <= keep)
+        return;
+    stream->next = *now;
+    stream->next.tv_sec -= keep / 1000000000LL;
+    stream->next.tv_nsec -= keep % 1000000000LL;
+    if (stream->next.tv_nsec < 0)
+    {
+        stream->next.tv_sec -= 1;
+        stream->next.tv_nsec += 1000000000L;
+    }
+}
+
+static inline void payload_stream_sent(const struct payload* payload,
+                                       struct payload_stream* stream, int count)
+{
+    stream->sent += count;
+    payload_timespec_add_ns(&stream->next, payload->intervalNs * count);
+}
+
+/**
+ *  Sleeps until the next message is due; not at all after the last one.
+ *  Returns 0, or -1 with errno EINTR when a signal cut the sleep short:
+ *  calling it again sleeps for what is left, since the deadline is
+ *  absolute. Never sleeps past the end of the stream's duration.
+ */
+static inline int payload_stream_wait(const struct payload* payload,
+                                      struct payload_stream* stream)
+{
+    if (payload->intervalNs == 0 || !payload_stream_more(payload, stream))
+        return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (payload_timespec_before(&stream->next, &now))
+    {
+        payload_stream_catch_up(payload, stream, &now);
+        return 0;
+    }
+    struct timespec deadline = stream->next;
+    if (payload->durationMs > 0)
+    {
+        struct timespec end = stream->startedAt;
+        payload_timespec_add_ns(&end, payload->durationMs * 1000000LL);
+        if (payload_timespec_before(&end, &deadline))
+            deadline = end;
+    }
+    int slept = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    if (slept != 0)
+    {
+        errno = slept;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
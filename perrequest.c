@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,11 +14,28 @@
 #include <signal.h>
 #include <assert.h>
 
-static const char* messageToClient = "Hi there\n";
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "timerwheel.h"
+#include "admission.h"
+#include "tuning.h"
+#include "upgrade.h"
 
-int create_tcp_socket()
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct timeouts timeouts;
+// every child is one admitted connection until it is reaped
+static struct admission admission;
+
+// slot 0 is the accepting process; request children share the rest
+#define CHILD_METRICS_SLOTS 64
+static struct metrics metrics;
+
+int create_server_socket(const struct transport* transport)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = transport_socket(transport, 0);
     if (sockfd == -1)
     {
         fprintf(stderr, "socket() : %s\n", strerror(errno));
@@ -38,15 +56,9 @@ void set_reuse_addr_opt(int sockfd)
     }
 }
 
-void bind_server_socket(int sockfd, uint16_t port)
+void bind_server_socket(int sockfd, const struct transport* transport)
 {
-    struct sockaddr_in inaddr;
-    bzero(&inaddr, sizeof(inaddr));
-    inaddr.sin_family = AF_INET;
-    inaddr.sin_port = htons(port);
-    inaddr.sin_addr.s_addr = INADDR_ANY;
-    int binded = bind(sockfd, (const struct sockaddr *)&inaddr,
-                      sizeof(inaddr));
+    int binded = transport_bind(sockfd, transport);
     if (binded == -1)
     {
         fprintf(stderr, "bind() : %s\n", strerror(errno));
@@ -54,9 +66,9 @@ void bind_server_socket(int sockfd, uint16_t port)
     }
 }
 
-void listen_tcp_socket(int sockfd)
+void listen_server_socket(int sockfd)
 {
-    int listened = listen(sockfd, SOMAXCONN);
+    int listened = listen(sockfd, tuning.backlog);
     if (listened == -1)
     {
         fprintf(stderr, "listen() : %s\n", strerror(errno));
@@ -65,10 +77,12 @@ void listen_tcp_socket(int sockfd)
 }
 
 static int childrenStarted = 0;
-static int childrenFinished = 0;
+// counted only by sig_chld, which reaps
+static volatile sig_atomic_t childrenFinished = 0;
 
 void sig_chld(int signo)
 {
+    (void)signo;
     pid_t pid = -1;
     int stat = 0;
 
@@ -76,10 +90,17 @@ void sig_chld(int signo)
     {
         printf("child %d terminated\n", (int)pid);
         ++childrenFinished;
+        admission_leave(&admission);
     }
     return;
 }
 
+// only ends sigsuspend() once a second
+void sig_alrm(int signo)
+{
+    (void)signo;
+}
+
 typedef void (*sighandler_t)(int);
 void set_signal_handler(int sigNumber, const char* sigPresentation,
                         sighandler_t handler)
@@ -119,37 +140,65 @@ int main(int argc, char** argv)
         int cmpRes = strcmp(argv[1], "--help");
         if (cmpRes == 0)
         {
-            printf("usage: perrequest [serverPort]\n");
+            printf("usage: perrequest [serverPort|unix:path|seqpacket:path]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
             exit(EXIT_SUCCESS);
         }
     }
 
-    uint16_t port = 6666;
-    if (argc >= 2)
-        port = (uint16_t)atoi(argv[1]);
-    printf("server port = %d\n", port);
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    transport_print(&transport);
+    logger_init();
+    upgrade_init(argv);
+    payload_init(&payload, 0);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    timeouts_init(&timeouts);
+    admission_init(&admission);
+    metrics_init(&metrics, 1 + CHILD_METRICS_SLOTS, upgrade_metrics_listener());
 
     set_sigchld_handler();
     set_sigint_handler();
 
-    int masterSocket = create_tcp_socket();
-    set_reuse_addr_opt(masterSocket);
-    bind_server_socket(masterSocket, port);
-    listen_tcp_socket(masterSocket);
+    // after an upgrade the old process's socket is already bound and listening
+    int masterSocket = upgrade_listener();
+    if (masterSocket == -1)
+    {
+        masterSocket = create_server_socket(&transport);
+        if (transport.family == AF_INET)
+            set_reuse_addr_opt(masterSocket);
+        bind_server_socket(masterSocket, &transport);
+    }
+    tuning_listener(&tuning, masterSocket, &transport);
+    listen_server_socket(masterSocket);
+    transport_defer_accept(masterSocket, &transport);
 
     pid_t mainPid = getpid();
     pid_t myPid = mainPid;
 
     printf("main server process: pid = %d\n", (int)(myPid));
-    
+    struct worker_metrics* acceptCounters = metrics_slot(&metrics, 0);
+    upgrade_ready();
+
     while (1)
     {
+        // the children of the old binary serve their clients to the end
+        if (upgradeRequested && upgrade_start(masterSocket, metrics.listenFd))
+        {
+            printf("%d: stop accepting, %d clients still served\n", (int)myPid,
+                   childrenStarted - childrenFinished);
+            break;
+        }
+
         struct sockaddr_in clientInAddr;
         socklen_t clientInAddrLen = sizeof(clientInAddr);
-        bzero(&clientInAddr, sizeof(struct sockaddr_in));
-        printf("%d: waiting for client...\n", (int)myPid);
-        int slaveSocket = accept(masterSocket, (struct sockaddr *)(&clientInAddr),
-                                 &clientInAddrLen);
+        log_trace("%d: waiting for client...\n", (int)myPid);
+        // CLOEXEC: a child that ever execs must not keep other clients open
+        int slaveSocket = accept4(masterSocket, (struct sockaddr *)(&clientInAddr),
+                                  &clientInAddrLen, SOCK_CLOEXEC);
         if (slaveSocket == -1)
         {
             if (errno == EINTR)
@@ -161,26 +210,43 @@ int main(int argc, char** argv)
                 }
                 else
                 {
-                    printf("%d: signal occured... continue accepting...\n", (int)myPid);
+                    log_debug("%d: signal occured... continue accepting...\n", (int)myPid);
                     continue;
                 }
             }
             else
             {
-                fprintf(stderr, "%d: accept() : %s\n", (int)myPid, strerror(errno));
+                metrics_add(&acceptCounters->acceptErrors, 1);
+                fprintf(stderr, "%d: accept4() : %s\n", (int)myPid, strerror(errno));
                 exit(EXIT_FAILURE);
             }
         }
 
-        char buffer[INET_ADDRSTRLEN];
-        const char* clientIpStr = inet_ntop(AF_INET, &clientInAddr.sin_addr, buffer, INET_ADDRSTRLEN);
+        // turned away before a process is forked for it
+        enum admission_verdict verdict = admission_check(&admission, &clientInAddr);
+        if (verdict != ADMISSION_ADMIT)
+        {
+            admission_reject(slaveSocket);
+            metrics_rejected(acceptCounters, verdict == ADMISSION_RATE_LIMITED);
+            log_debug("%d: rejected a client: %s\n", (int)myPid,
+                      verdict == ADMISSION_FULL ? "too many connections" : "rate limited");
+            continue;
+        }
+
+        transport_skip_greeting(slaveSocket);
+        // only the debug and trace lines print the peer
+        char buffer[INET_ADDRSTRLEN] = "-";
+        const char* clientIpStr = buffer;
         int clientPort = (int)clientInAddr.sin_port;
+        if (log_enabled(LEVEL_DEBUG))
+            clientIpStr = transport_peer(&clientInAddr, buffer);
         if (clientIpStr == NULL)
         {
             fprintf(stderr, "%d: inet_ntop() : %s\n", (int)myPid, strerror(errno));
             exit(EXIT_FAILURE);
         }
-        printf("%d: accepted request from %s:%d\n", (int)myPid, clientIpStr, clientPort);
+        log_debug("%d: accepted request from %s:%d\n", (int)myPid, clientIpStr, clientPort);
+        metrics_add(&acceptCounters->accepts, 1);
 
         pid_t pid = fork();
         if (pid == -1)
@@ -191,42 +257,62 @@ int main(int argc, char** argv)
         else if (pid == 0)
         { // this is a child process
             myPid = getpid();
-            printf("additional server process: pid = %d\n", (int)(myPid));
+            log_debug("additional server process: pid = %d\n", (int)(myPid));
             close(masterSocket);
+            metrics_after_fork(&metrics);
+            upgrade_after_fork();
+            struct worker_metrics* counters =
+                metrics_slot(&metrics, 1 + childrenStarted % CHILD_METRICS_SLOTS);
+            metrics_gauge(&counters->active, 1);
 
+            struct payload_stream stream;
+            timeouts_apply(&timeouts, slaveSocket);
+            payload_stream_start(&payload, &stream, slaveSocket);
             int sndCount = 0;
-            int messageSize = strlen(messageToClient);
-            for (; sndCount < 5; ++sndCount)
+            for (; payload_stream_more(&payload, &stream); sndCount = stream.sent)
             {
-                printf("%d: sending packet number %d to %s:%d\n",
-                       (int)myPid,sndCount + 1, clientIpStr, clientPort);
-                int sent = sendto(slaveSocket, messageToClient, messageSize, MSG_NOSIGNAL,
-                                  (struct sockaddr *)(&clientInAddr), sizeof(clientInAddr));
+                int due = payload_stream_due(&payload, &stream);
+                struct payload_sent acct;
+                log_trace("%d: sending packet number %d to %s:%d\n",
+                          (int)myPid,sndCount + 1, clientIpStr, clientPort);
+                ssize_t sent = payload_send_messages(&payload, &stream, slaveSocket, due, &acct);
                 if (sent == -1)
                 {
-                    if (errno = EPIPE)
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        metrics_add(&counters->timeoutCloses, 1);
+                        log_debug("%d: write timeout: %s:%d\n", (int)myPid, clientIpStr, clientPort);
+                        break;
+                    }
+                    if (errno == EPIPE || errno == ECONNRESET)
                     {
-                        printf("%d: outgoing connection closed: %s:%d\n",
-                               (int)myPid, clientIpStr, clientPort);
+                        metrics_add(&counters->epipeCloses, 1);
+                        log_debug("%d: outgoing connection closed: %s:%d\n",
+                                  (int)myPid, clientIpStr, clientPort);
                         break;
                     }
                     else
                     {
-                        fprintf(stderr, "%d: sendto() : %s\n", (int)myPid, strerror(errno));
+                        fprintf(stderr, "%d: send() : %s\n", (int)myPid, strerror(errno));
                         exit(EXIT_FAILURE);
                     }
                 }
 
+                metrics_batch_sent(counters, due, sent, acct.syscalls);
+                metrics_zerocopy(counters, acct.zerocopyBytes, acct.zerocopyCopied);
+                payload_stream_sent(&payload, &stream, due);
+
                 if (needToFinish)
                 {
-                    printf("%d: stop working\n", (int)myPid);
+                    log_debug("%d: stop working\n", (int)myPid);
                     break;
                 }
 
-                sleep(1);
+                payload_stream_wait(&payload, &stream);
             }
 
             close(slaveSocket);
+            metrics_gauge(&counters->active, -1);
             exit(EXIT_SUCCESS);
         }
         else
@@ -239,23 +325,32 @@ int main(int argc, char** argv)
     // this is the main process
     assert(mainPid == myPid);
 
+    // SIGCHLD stays blocked outside sigsuspend(): none is lost between the
+    // check and the wait
+    sigset_t blocked, saved;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGALRM);
+    sigprocmask(SIG_BLOCK, &blocked, &saved);
+    set_signal_handler(SIGALRM, "SIGALRM", sig_alrm);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     int seconds = 0;
     while (childrenFinished < childrenStarted
         && seconds < 60)
     {
-        pid_t pid = -1;
-        int stat = 0;
-
-        while((pid = waitpid(-1, &stat, WNOHANG)) > 0)
-        {
-            printf("child %d terminated\n", (int)pid);
-            ++childrenFinished;
-        }
-
-        if (childrenFinished < childrenStarted)
-            sleep(1);
+        alarm(1);
+        sigsuspend(&saved);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (int)(now.tv_sec - start.tv_sec);
     }
+    alarm(0);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
     
     close(masterSocket);
+    admission_report(&admission);
+    metrics_shutdown(&metrics, upgrade_handed_over());
+    if (!upgrade_handed_over())
+        transport_shutdown(&transport);
     exit(EXIT_SUCCESS);
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,8 +12,33 @@
 
 #include <sys/wait.h>
 #include <signal.h>
+#include <poll.h>
 
-static const char* messageToClient = "Hi there\n";
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "admission.h"
+#include "tuning.h"
+#include "upgrade.h"
+
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct timeouts timeouts;
+static struct cpu_placement placement;
+// shared by all processes: made before the first fork
+static struct admission admission;
+
+// metrics slot i belongs to the same process as scoreboard slot i
+static struct metrics metrics;
 
 /**
  *  while (needed)
@@ -23,9 +49,9 @@ static const char* messageToClient = "Hi there\n";
  *  }
  */
 
-int create_tcp_socket()
+int create_server_socket(const struct transport* transport)
 {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = transport_socket(transport, 0);
     if (sockfd == -1)
     {
         fprintf(stderr, "socket() : %s\n", strerror(errno));
@@ -46,15 +72,9 @@ void set_reuse_addr_opt(int sockfd)
     }
 }
 
-void bind_server_socket(int sockfd, uint16_t port)
+void bind_server_socket(int sockfd, const struct transport* transport)
 {
-    struct sockaddr_in inaddr;
-    bzero(&inaddr, sizeof(inaddr));
-    inaddr.sin_family = AF_INET;
-    inaddr.sin_port = htons(port);
-    inaddr.sin_addr.s_addr = INADDR_ANY;
-    int binded = bind(sockfd, (const struct sockaddr *)&inaddr,
-                      sizeof(inaddr));
+    int binded = transport_bind(sockfd, transport);
     if (binded == -1)
     {
         fprintf(stderr, "bind() : %s\n", strerror(errno));
@@ -62,9 +82,9 @@ void bind_server_socket(int sockfd, uint16_t port)
     }
 }
 
-void listen_tcp_socket(int sockfd)
+void listen_server_socket(int sockfd)
 {
-    int listened = listen(sockfd, SOMAXCONN);
+    int listened = listen(sockfd, tuning.backlog);
     if (listened == -1)
     {
         fprintf(stderr, "listen() : %s\n", strerror(errno));
@@ -72,22 +92,366 @@ void listen_tcp_socket(int sockfd)
     }
 }
 
-static pid_t children[100];
+void set_reuse_port_opt(int sockfd)
+{
+    int enable = 1;
+    int setOptRes = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+                               &enable, sizeof(int));
+    if (setOptRes == -1)
+    {
+        fprintf(stderr, "setsockopt(SO_REUSEPORT) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+int open_listener(const struct transport* transport, int reusePort)
+{
+    // after an upgrade the old process's socket is already bound and listening
+    int sockfd = reusePort ? -1 : upgrade_listener();
+    if (sockfd == -1)
+    {
+        sockfd = create_server_socket(transport);
+        if (transport->family == AF_INET)
+            set_reuse_addr_opt(sockfd);
+        if (reusePort)
+            set_reuse_port_opt(sockfd);
+        bind_server_socket(sockfd, transport);
+    }
+    tuning_listener(&tuning, sockfd, transport);
+    listen_server_socket(sockfd);
+    transport_defer_accept(sockfd, transport);
+    return sockfd;
+}
+
+int open_datagram_socket(const struct transport* transport, int reusePort)
+{
+    int sockfd = reusePort ? -1 : upgrade_listener();
+    if (sockfd != -1)
+    {
+        tuning_apply(&tuning, sockfd, 0);
+        return sockfd;
+    }
+    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    set_reuse_addr_opt(sockfd);
+    if (reusePort)
+        set_reuse_port_opt(sockfd);
+    tuning_apply(&tuning, sockfd, 0);
+    bind_server_socket(sockfd, transport);
+    return sockfd;
+}
+
+/**
+ *  SO_REUSEPORT with SERVER_CPUS: the main process opens the listeners of
+ *  all processes up front and in process order, so listener i is member i
+ *  of the reuseport group and the steering program (affinity.h) can send
+ *  a connection to the process pinned to the CPU it arrived on. After
+ *  fork every process keeps its own and closes the others.
+ */
+int* open_steered_listeners(const struct transport* transport, int datagrams,
+                            int processCount, int threadsPerProcess)
+{
+    int* listeners = calloc(processCount, sizeof(int));
+    int* cpus = calloc(processCount, sizeof(int));
+    if (listeners == NULL || cpus == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int i = 0;
+    for (; i < processCount; ++i)
+    {
+        listeners[i] = datagrams ? open_datagram_socket(transport, 1) : open_listener(transport, 1);
+        cpus[i] = affinity_cpu(&placement, i * threadsPerProcess);
+        affinity_incoming_cpu(listeners[i], cpus[i]);
+    }
+    if (affinity_steer_reuseport(listeners[0], cpus, processCount))
+        printf("reuseport: connections go to the process on the CPU they arrive on\n");
+    free(cpus);
+    return listeners;
+}
+
+// anonymous shared mapping: visible to every process forked after it
+void* create_shared_memory(size_t size)
+{
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+/**
+ *  How server processes share incoming connections:
+ *   shared    - everybody blocks in accept() on the same socket
+ *               (the kernel may wake several of them for one client)
+ *   mutex     - accept() is serialized by a process-shared mutex
+ *   fcntl     - accept() is serialized by an fcntl() record lock
+ *   reuseport - every process has its own SO_REUSEPORT listener and
+ *               the kernel hashes connections between them
+ *   pass      - only the main process accepts; it hands every socket
+ *               (SCM_RIGHTS over a socketpair) to the child with the
+ *               fewest active connections
+ */
+enum accept_strategy
+{
+    ACCEPT_SHARED,
+    ACCEPT_MUTEX,
+    ACCEPT_FCNTL,
+    ACCEPT_REUSEPORT,
+    ACCEPT_PASS
+};
+
+static const char* acceptStrategyNames[] = { "shared", "mutex", "fcntl", "reuseport", "pass" };
+
+int parse_accept_strategy(const char* name, enum accept_strategy* strategy)
+{
+    int i = 0;
+    for (; i < (int)(sizeof(acceptStrategyNames) / sizeof(acceptStrategyNames[0])); ++i)
+    {
+        if (strcmp(name, acceptStrategyNames[i]) == 0)
+        {
+            *strategy = (enum accept_strategy)i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static volatile sig_atomic_t needToFinish = 0;
+static volatile sig_atomic_t needToRetire = 0;
+
+// upgradeRequested: the main process stops serving to start the new binary
+int should_stop_accepting()
+{
+    return needToFinish || needToRetire || upgradeRequested;
+}
+
+// SIGUSR2 only knocks threads out of blocking calls
+void sig_wakeup(int signo)
+{
+    (void)signo;
+}
+
+struct accept_lock
+{
+    enum accept_strategy strategy;
+    pthread_mutex_t* mutex;         // lives in shared memory
+    int lockFd;
+    pthread_mutex_t threadMutex;    // fcntl locks belong to the whole process
+};
+
+void accept_lock_init(struct accept_lock* lock, enum accept_strategy strategy)
+{
+    bzero(lock, sizeof(struct accept_lock));
+    lock->strategy = strategy;
+    lock->lockFd = -1;
+
+    if (strategy == ACCEPT_MUTEX)
+    {
+        lock->mutex = create_shared_memory(sizeof(pthread_mutex_t));
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        // a process killed inside accept() must not block the others forever
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        int initRes = pthread_mutex_init(lock->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (initRes != 0)
+        {
+            fprintf(stderr, "pthread_mutex_init() : %s\n", strerror(initRes));
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (strategy == ACCEPT_FCNTL)
+    {
+        char path[] = "/tmp/prefork.lock.XXXXXX";
+        lock->lockFd = mkstemp(path);
+        if (lock->lockFd == -1)
+        {
+            fprintf(stderr, "mkstemp() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        unlink(path);
+        pthread_mutex_init(&lock->threadMutex, NULL);
+    }
+}
+
+// returns 0 on success, the pthread error otherwise; gives up on shutdown
+int timed_lock_until_stop(pthread_mutex_t* mutex)
+{
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        int lockRes = pthread_mutex_timedlock(mutex, &deadline);
+        if (lockRes != ETIMEDOUT && lockRes != EINTR)
+            return lockRes;
+        if (should_stop_accepting())
+            return ETIMEDOUT;
+    }
+}
+
+void accept_lock_release(struct accept_lock* lock);
+
+/**
+ *  Returns 1 when the caller may call accept(), 0 when the process has
+ *  to stop. Waiting never outlives a SIGINT for more than a second.
+ */
+int accept_lock_acquire(struct accept_lock* lock)
+{
+    if (lock->strategy == ACCEPT_MUTEX)
+    {
+        int lockRes = timed_lock_until_stop(lock->mutex);
+        if (lockRes == ETIMEDOUT)
+            return 0;
+        // a process killed inside accept() left the mutex behind
+        if (lockRes == EOWNERDEAD)
+            pthread_mutex_consistent(lock->mutex);
+        else if (lockRes != 0)
+        {
+            fprintf(stderr, "pthread_mutex_timedlock() : %s\n", strerror(lockRes));
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (lock->strategy == ACCEPT_FCNTL)
+    {
+        if (timed_lock_until_stop(&lock->threadMutex) != 0)
+            return 0;
+
+        struct flock fl;
+        bzero(&fl, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        while (fcntl(lock->lockFd, F_SETLKW, &fl) == -1)
+        {
+            if (errno != EINTR)
+            {
+                fprintf(stderr, "fcntl(F_SETLKW) : %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (should_stop_accepting())
+            {
+                pthread_mutex_unlock(&lock->threadMutex);
+                return 0;
+            }
+        }
+    }
+
+    // a signal may have come while we were being handed the lock
+    if (should_stop_accepting())
+    {
+        accept_lock_release(lock);
+        return 0;
+    }
+    return 1;
+}
+
+void accept_lock_release(struct accept_lock* lock)
+{
+    if (lock->strategy == ACCEPT_MUTEX)
+    {
+        pthread_mutex_unlock(lock->mutex);
+    }
+    else if (lock->strategy == ACCEPT_FCNTL)
+    {
+        struct flock fl;
+        bzero(&fl, sizeof(fl));
+        fl.l_type = F_UNLCK;
+        fl.l_whence = SEEK_SET;
+        fcntl(lock->lockFd, F_SETLK, &fl);
+        pthread_mutex_unlock(&lock->threadMutex);
+    }
+}
+
+/**
+ *  Scoreboard: one cache line per process slot, so the state of
+ *  different processes never shares one. The supervisor reads it to
+ *  decide whether the pool needs more or fewer workers. Traffic
+ *  counters live in the metrics segment under the same slot index.
+ */
+enum worker_state
+{
+    WORKER_FREE = 0,    // slot unused
+    WORKER_ACTIVE       // owned by a running process
+};
+
+struct process_stats
+{
+    _Alignas(64) atomic_int state;
+    atomic_int busyThreads;     // threads serving a client right now
+    atomic_int admitted;        // connections it admitted itself and has not finished
+    int threads;
+    pid_t pid;
+};
+
+int idle_threads(struct process_stats* slot)
+{
+    return slot->threads - atomic_load_explicit(&slot->busyThreads, memory_order_relaxed);
+}
+
+void print_accept_distribution(struct process_stats* stats, int processCount)
+{
+    unsigned long total = 0;
+    int i = 0;
+    for (; i < processCount; ++i)
+        total += metrics_load(&metrics.slots[i].accepts);
+
+    printf("accepts per process (total %lu):\n", total);
+    for (i = 0; i < processCount; ++i)
+    {
+        if (stats[i].pid == 0)
+            continue;
+        unsigned long accepts = metrics_load(&metrics.slots[i].accepts);
+        double share = total ? 100.0 * accepts / total : 0.0;
+        printf("  #%d pid %d: %lu (%.1f%%)\n", i, (int)stats[i].pid, accepts, share);
+    }
+}
+
+// the child table grows on demand; pid == 0 marks a finished child
+struct child_entry
+{
+    pid_t pid;
+    int slot;       // scoreboard index
+    int retiring;   // SIGUSR1 already sent
+};
+
+static struct child_entry* children = NULL;
 static size_t childCount = 0;
+static size_t childCapacity = 0;
+static struct process_stats* scoreboard = NULL;
+
+// a worker that crashed or was killed never left for the clients it served
+void release_admitted(struct process_stats* slot)
+{
+    int held = atomic_exchange_explicit(&slot->admitted, 0, memory_order_relaxed);
+    admission_release(&admission, held);
+}
+
 void sig_chld(int signo)
 {
+    (void)signo;
     pid_t pid = -1;
     int stat = 0;
 
     while((pid = waitpid(-1, &stat, WNOHANG)) > 0)
     {
         printf("child %d terminated\n", (int)pid);
-        int i = 0;
+        size_t i = 0;
         for (; i < childCount; ++i)
         {
-            if (children[i] == pid)
+            if (children[i].pid == pid)
             {
-                children[i] = 0;
+                release_admitted(&scoreboard[children[i].slot]);
+                children[i].pid = 0;
                 break;
             }
         }
@@ -95,6 +459,53 @@ void sig_chld(int signo)
     return;
 }
 
+// supervisor mode reaps children itself; SIGCHLD only has to wake it up
+void sig_chld_wakeup(int signo)
+{
+    (void)signo;
+}
+
+void add_child(pid_t pid, int slot)
+{
+    // sig_chld walks the table: keep it away while the table moves
+    sigset_t blocked, saved;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &saved);
+
+    if (childCount == childCapacity)
+    {
+        size_t newCapacity = childCapacity ? childCapacity * 2 : 16;
+        struct child_entry* grown = realloc(children, newCapacity * sizeof(struct child_entry));
+        if (grown == NULL)
+        {
+            fprintf(stderr, "realloc() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        children = grown;
+        childCapacity = newCapacity;
+    }
+    children[childCount].pid = pid;
+    children[childCount].slot = slot;
+    children[childCount].retiring = 0;
+    ++childCount;
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+// drops finished entries; only called with SIGCHLD not touching the table
+void compact_children()
+{
+    size_t kept = 0;
+    size_t i = 0;
+    for (; i < childCount; ++i)
+    {
+        if (children[i].pid != 0)
+            children[kept++] = children[i];
+    }
+    childCount = kept;
+}
+
 typedef void (*sighandler_t)(int);
 void set_signal_handler(int sigNumber, const char* sigPresentation,
                         sighandler_t handler)
@@ -120,7 +531,6 @@ void unset_sigchld_handler()
     set_signal_handler(SIGCHLD, "SIGCHLD", SIG_DFL);
 }
 
-static int needToFinish = 0;
 void sig_int()
 {
     needToFinish = 1;
@@ -132,11 +542,23 @@ void set_sigint_handler()
     set_signal_handler(SIGINT, "SIGINT", sig_int);
 }
 
-int fork_children(int processCount, int* myPid, pid_t* children)
+// SIGUSR1: finish the current client, then exit (used to shrink the pool)
+void sig_usr1()
+{
+    needToRetire = 1;
+}
+
+void set_sigusr1_handler()
 {
-    int childCount = 0;
+    set_signal_handler(SIGUSR1, "SIGUSR1", sig_usr1);
+}
+
+int fork_children(int processCount, int* myPid, int* myIndex)
+{
+    int forked = 0;
 
     *myPid = getpid();
+    *myIndex = 0;
     printf("main server process: pid = %d\n", (int)(*myPid));
     if (processCount > 1)
         printf("%d: Starting additional server processes:\n", (int)(*myPid));
@@ -144,41 +566,45 @@ int fork_children(int processCount, int* myPid, pid_t* children)
     int processIndex = 1;
     for (; processIndex < processCount; ++processIndex)
     {
+        // otherwise buffered output is printed once more by every child
+        fflush(stdout);
         pid_t pid = fork();
         if (pid == -1)
         {
             printf("not all server process have been created... continuing...\n");
-            return childCount;
+            return forked;
         }
         else if (pid == 0)
         { // this is a child process
             *myPid = getpid();
+            *myIndex = processIndex;
             printf("additional server process: pid = %d\n", (int)(*myPid));
             return 0;
         }
         else
         { // this is the main process. Continue cycling
-            children[childCount] = pid;
-            ++childCount;
+            add_child(pid, processIndex);
+            ++forked;
             continue;
         }
-    }    
+    }
+    return forked;
 }
 
-void wait_for_remaining_children(pid_t* children, int childCount, int myPid)
+void wait_for_remaining_children(int myPid)
 {
     unset_sigchld_handler();
 
     size_t childIndex = 0;
     for (; childIndex < childCount; ++childIndex)
     {
-        pid_t cpid = children[childIndex];
+        pid_t cpid = children[childIndex].pid;
         if (cpid == 0)
             continue;
 
         kill(cpid, SIGINT);
 
-        children[childIndex] = 0;
+        children[childIndex].pid = 0;
         int status = 0;
         pid_t waitRes = waitpid(cpid, &status, 0);
         if (waitRes == -1)
@@ -198,124 +624,1227 @@ void wait_for_remaining_children(pid_t* children, int childCount, int myPid)
     }
 }
 
-int main(int argc, char** argv)
+/**
+ *  After a handover to a new binary (upgrade.h) SIGUSR1 lets every child
+ *  finish the clients it serves and exit, as when the supervisor retires
+ *  one. SIGINT ends the wait; wait_for_remaining_children() then stops
+ *  the rest.
+ */
+void drain_children(pid_t myPid)
 {
-    if (argc >= 2)
+    sigset_t blocked, saved;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &saved);
+    // reaped here: the handler only has to end sigsuspend()
+    set_signal_handler(SIGCHLD, "SIGCHLD", sig_chld_wakeup);
+
+    size_t i = 0;
+    for (; i < childCount; ++i)
     {
-        int cmpRes = strcmp(argv[1], "--help");
-        if (cmpRes == 0)
-        {
-            printf("usage: prefork [serverPort] [processCount]\n");
-            exit(EXIT_SUCCESS);
-        }    
+        if (children[i].pid != 0)
+            kill(children[i].pid, SIGUSR1);
+    }
+    while (!needToFinish)
+    {
+        sig_chld(SIGCHLD);
+        size_t alive = 0;
+        for (i = 0; i < childCount; ++i)
+            alive += children[i].pid != 0;
+        if (alive == 0)
+            break;
+        printf("%d: draining, %zu children left\n", (int)myPid, alive);
+        sigsuspend(&saved);
     }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
 
-    uint16_t port = 6666;
-    if (argc >= 2)
-        port = (uint16_t)atoi(argv[1]);
-    printf("server port = %d\n", port);
+// the main process stopped serving for SIGHUP: serve on if the new binary failed
+int serve_on_after_upgrade(int listenFd)
+{
+    return upgradeRequested && !needToFinish && !upgrade_start(listenFd, metrics.listenFd);
+}
 
-    int processCount = 2;
-    if (argc >= 3)
-        processCount = atoi(argv[2]);
-    printf("process count = %d\n", processCount);
-    
-    set_sigchld_handler();
-    set_sigint_handler();
+/**
+ *  Descriptor passing. The client address travels as the message
+ *  payload, the socket itself as SCM_RIGHTS ancillary data.
+ */
+int send_descriptor(int channel, int sockfd, const struct sockaddr_in* clientInAddr)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)clientInAddr;
+    iov.iov_len = sizeof(struct sockaddr_in);
 
-    int masterSocket = create_tcp_socket();
-    set_reuse_addr_opt(masterSocket);
-    bind_server_socket(masterSocket, port);
-    listen_tcp_socket(masterSocket);
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    bzero(&control, sizeof(control));
 
-    pid_t mainPid = getpid();
-    pid_t myPid = 0;
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+// returns the received socket, -1 on error (errno is set, 0 on EOF)
+int receive_descriptor(int channel, struct sockaddr_in* clientInAddr)
+{
+    struct iovec iov;
+    iov.iov_base = clientInAddr;
+    iov.iov_len = sizeof(struct sockaddr_in);
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t received = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    if (received <= 0)
+    {
+        if (received == 0)
+            errno = 0;
+        return -1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    int sockfd = -1;
+    memcpy(&sockfd, CMSG_DATA(cmsg), sizeof(int));
+    return sockfd;
+}
 
-    // not zero only for the main process:
-    bzero(children, sizeof(children));
-    childCount = fork_children(processCount, &myPid, children);
+// where a server process takes its next client from
+struct client_source
+{
+    enum accept_strategy strategy;
+    int masterSocket;
+    struct accept_lock* lock;
+    int channel; // pass mode: socketpair end shared with the main process
+};
 
+/**
+ *  Returns the next client socket or -1 when the process has to stop.
+ *  Admission control rejects connections here, except in pass mode where
+ *  the dispatcher has done it before handing them over.
+ */
+int wait_for_client(struct client_source* source, struct sockaddr_in* clientInAddr,
+                    struct worker_metrics* counters, pid_t myPid)
+{
     while (1)
     {
-        struct sockaddr_in clientInAddr;
-        socklen_t clientInAddrLen = sizeof(clientInAddr);
-        bzero(&clientInAddr, sizeof(struct sockaddr_in));
-        printf("%d: waiting for client...\n", (int)myPid);
-        int slaveSocket = accept(masterSocket, (struct sockaddr *)(&clientInAddr),
-                                 &clientInAddrLen);
-        if (slaveSocket == -1)
+        socklen_t clientInAddrLen = sizeof(struct sockaddr_in);
+        log_trace("%d: waiting for client...\n", (int)myPid);
+
+        int slaveSocket = -1;
+        if (source->strategy == ACCEPT_PASS)
         {
-            if (errno == EINTR)
-            {
-                if (needToFinish)
-                {
-                    printf("%d: stop working\n", (int)myPid);
-                    break;
-                }
-                else
-                {
-                    printf("%d: signal occured... continue accepting...", (int)myPid);
-                    continue;
-gdb                }
-            }
-            else
+            if (should_stop_accepting())
+                return -1;
+            slaveSocket = receive_descriptor(source->channel, clientInAddr);
+            if (slaveSocket == -1 && errno == 0)
             {
-                fprintf(stderr, "%d: accept() : %s\n", (int)myPid, strerror(errno));
-                exit(EXIT_FAILURE);
+                printf("%d: main process has closed the channel\n", (int)myPid);
+                return -1;
             }
         }
-
-        char buffer[INET_ADDRSTRLEN];
-        const char* clientIpStr = inet_ntop(AF_INET, &clientInAddr.sin_addr, buffer, INET_ADDRSTRLEN);
-        int clientPort = (int)clientInAddr.sin_port;
-        if (clientIpStr == NULL)
+        else
         {
-            fprintf(stderr, "%d: inet_ntop() : %s\n", (int)myPid, strerror(errno));
-            exit(EXIT_FAILURE);
+            if (should_stop_accepting() || !accept_lock_acquire(source->lock))
+                return -1;
+            slaveSocket = accept4(source->masterSocket, (struct sockaddr *)clientInAddr,
+                                  &clientInAddrLen, SOCK_CLOEXEC);
+            int acceptErrno = errno;
+            accept_lock_release(source->lock);
+            errno = acceptErrno;
         }
-        printf("%d: accepted request from %s:%d\n", (int)myPid, clientIpStr, clientPort);
 
-        int sndCount = 0;
-        int messageSize = strlen(messageToClient);
-        for (; sndCount < 5; ++sndCount)
+        if (slaveSocket != -1 && source->strategy != ACCEPT_PASS)
         {
-            printf("%d: sending packet number %d to %s:%d\n",
-                   (int)myPid,sndCount + 1, clientIpStr, clientPort);
-            int sent = sendto(slaveSocket, messageToClient, messageSize, MSG_NOSIGNAL,
-                              (struct sockaddr *)(&clientInAddr), sizeof(clientInAddr));
-            if (sent == -1)
-            {
-                if (errno = EPIPE)
-                {
-                    printf("%d: outgoing connection closed: %s:%d\n",
-                           (int)myPid, clientIpStr, clientPort);
-                    break;
-                }
-                else
-                {
-                    fprintf(stderr, "%d: sendto() : %s\n", (int)myPid, strerror(errno));
-                    exit(EXIT_FAILURE);
-                }
-            }
-
-            if (needToFinish)
+            enum admission_verdict verdict = admission_check(&admission, clientInAddr);
+            if (verdict != ADMISSION_ADMIT)
             {
-                printf("%d: stop working\n", (int)myPid);
-                break;
+                admission_reject(slaveSocket);
+                metrics_rejected(counters, verdict == ADMISSION_RATE_LIMITED);
+                log_debug("%d: rejected a client: %s\n", (int)myPid,
+                          verdict == ADMISSION_FULL ? "too many connections" : "rate limited");
+                continue;
             }
+        }
+        if (slaveSocket != -1)
+            return slaveSocket;
 
-            sleep(1);
+        if (errno == EINTR)
+        {
+            if (should_stop_accepting())
+                return -1;
+            log_debug("%d: signal occured... continue accepting...\n", (int)myPid);
+            continue;
         }
+        metrics_add(&counters->acceptErrors, 1);
+        fprintf(stderr, "%d: accept() : %s\n", (int)myPid, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// a wake-up signal must not shorten the pause a client is waiting for
+void pause_between_messages(struct payload_stream* stream)
+{
+    while (payload_stream_wait(&payload, stream) == -1 && errno == EINTR && !needToFinish)
+        ;
+}
 
-        printf("%d: closing connection: %s:%d\n", (int)myPid, clientIpStr, clientPort);
-        close(slaveSocket);
+void serve_client(int slaveSocket, const struct sockaddr_in* clientInAddr,
+                  struct worker_metrics* counters, pid_t myPid)
+{
+    transport_skip_greeting(slaveSocket);
+    // only the debug and trace lines print the peer
+    char buffer[INET_ADDRSTRLEN] = "-";
+    const char* clientIpStr = buffer;
+    int clientPort = (int)clientInAddr->sin_port;
+    if (log_enabled(LEVEL_DEBUG))
+        clientIpStr = transport_peer(clientInAddr, buffer);
+    if (clientIpStr == NULL)
+    {
+        fprintf(stderr, "%d: inet_ntop() : %s\n", (int)myPid, strerror(errno));
+        exit(EXIT_FAILURE);
     }
+    log_debug("%d: accepted request from %s:%d\n", (int)myPid, clientIpStr, clientPort);
 
-    close(masterSocket);
+    struct payload_stream stream;
+    timeouts_apply(&timeouts, slaveSocket);
+    payload_stream_start(&payload, &stream, slaveSocket);
+    int sndCount = 0;
+    for (; payload_stream_more(&payload, &stream); sndCount = stream.sent)
+    {
+        int due = payload_stream_due(&payload, &stream);
+        struct payload_sent acct;
+        log_trace("%d: sending packet number %d to %s:%d\n",
+                  (int)myPid,sndCount + 1, clientIpStr, clientPort);
+        ssize_t sent = payload_send_messages(&payload, &stream, slaveSocket, due, &acct);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                metrics_add(&counters->timeoutCloses, 1);
+                log_debug("%d: write timeout: %s:%d\n", (int)myPid, clientIpStr, clientPort);
+                break;
+            }
+            if (errno == EPIPE || errno == ECONNRESET)
+            {
+                metrics_add(&counters->epipeCloses, 1);
+                log_debug("%d: outgoing connection closed: %s:%d\n",
+                          (int)myPid, clientIpStr, clientPort);
+                break;
+            }
+            else
+            {
+                fprintf(stderr, "%d: send() : %s\n", (int)myPid, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+        metrics_batch_sent(counters, due, sent, acct.syscalls);
+        metrics_zerocopy(counters, acct.zerocopyBytes, acct.zerocopyCopied);
+        payload_stream_sent(&payload, &stream, due);
+
+        if (needToFinish)
+        {
+            log_debug("%d: stop working\n", (int)myPid);
+            break;
+        }
+
+        pause_between_messages(&stream);
+    }
+
+    log_debug("%d: closing connection: %s:%d\n", (int)myPid, clientIpStr, clientPort);
+    close(slaveSocket);
+}
+
+/**
+ *  Datagram mode (-u): every request datagram is answered with one
+ *  payload message. A worker takes up to DATAGRAM_BATCH requests with one
+ *  recvmmsg() and answers all of them with one sendmmsg(). With -a
+ *  reuseport every process binds its own socket and the kernel hashes
+ *  client addresses over them; with -a shared all of them wait on one.
+ *  The request count shows up as "accepts" in the metrics.
+ */
+#define DATAGRAM_BATCH 64
+#define DATAGRAM_REQUEST_SIZE 512
+#define DATAGRAM_MAX_PAYLOAD 65507
+
+void serve_datagrams(int sockfd, struct worker_metrics* counters, pid_t myPid)
+{
+    static char requests[DATAGRAM_BATCH][DATAGRAM_REQUEST_SIZE];
+    struct sockaddr_in peers[DATAGRAM_BATCH];
+    struct iovec requestIov[DATAGRAM_BATCH];
+    struct mmsghdr in[DATAGRAM_BATCH];
+    struct mmsghdr out[DATAGRAM_BATCH];
+    struct iovec replyIov;
+    replyIov.iov_base = payload.message;
+    replyIov.iov_len = payload.messageSize;
+
+    bzero(in, sizeof(in));
+    bzero(out, sizeof(out));
+    int i = 0;
+    for (; i < DATAGRAM_BATCH; ++i)
+    {
+        requestIov[i].iov_base = requests[i];
+        requestIov[i].iov_len = DATAGRAM_REQUEST_SIZE;
+        in[i].msg_hdr.msg_iov = &requestIov[i];
+        in[i].msg_hdr.msg_iovlen = 1;
+        in[i].msg_hdr.msg_name = &peers[i];
+        out[i].msg_hdr.msg_iov = &replyIov;
+        out[i].msg_hdr.msg_iovlen = 1;
+        out[i].msg_hdr.msg_name = &peers[i];
+    }
+
+    while (!should_stop_accepting())
+    {
+        for (i = 0; i < DATAGRAM_BATCH; ++i)
+            in[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        // blocks for the first datagram only, then takes what is queued
+        int received = recvmmsg(sockfd, in, DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            metrics_add(&counters->acceptErrors, 1);
+            fprintf(stderr, "%d: recvmmsg() : %s\n", (int)myPid, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        metrics_add(&counters->accepts, received);
+        log_trace("%d: %d requests\n", (int)myPid, received);
+
+        for (i = 0; i < received; ++i)
+            out[i].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+        // metrics_batch_sent() counts what sendmmsg() saves, this is the receive side
+        metrics_add(&counters->syscallsSaved, received - 1);
+        int answered = 0;
+        while (answered < received)
+        {
+            int sent = sendmmsg(sockfd, out + answered, received - answered, 0);
+            if (sent == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                // a datagram may be dropped: skip the one that failed
+                log_debug("%d: sendmmsg() : %s\n", (int)myPid, strerror(errno));
+                ++answered;
+                continue;
+            }
+            answered += sent;
+            metrics_batch_sent(counters, sent, sent * payload.messageSize, 1);
+        }
+    }
+}
+
+/**
+ *  Pass mode, main process: accept and dispatch.
+ *  Every child gets at most maxActive connections at a time; when all
+ *  children are full the listener is not polled and new clients wait
+ *  in the kernel backlog. A child writes one byte to its channel each
+ *  time it finishes a connection.
+ */
+struct dispatch_slot
+{
+    int channel;
+    int active;     // -1: the child has gone
+    unsigned long handed;
+};
+
+int pick_least_loaded(struct dispatch_slot* slots, int slotCount, int maxActive)
+{
+    int best = -1;
+    int i = 0;
+    for (; i < slotCount; ++i)
+    {
+        if (slots[i].active < 0 || slots[i].active >= maxActive)
+            continue;
+        if (best == -1 || slots[i].active < slots[best].active)
+            best = i;
+    }
+    return best;
+}
+
+void collect_child_reports(struct dispatch_slot* slot, pid_t myPid)
+{
+    char reports[64];
+    while (1)
+    {
+        ssize_t received = recv(slot->channel, reports, sizeof(reports), MSG_DONTWAIT);
+        if (received > 0)
+        {
+            slot->active -= (int)received;
+            if (slot->active < 0)
+                slot->active = 0;
+            continue;
+        }
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        printf("%d: child channel %d closed\n", (int)myPid, slot->channel);
+        close(slot->channel);
+        // connections it did not report as finished died with it
+        admission_release(&admission, slot->active);
+        slot->active = -1;
+        return;
+    }
+}
+
+// hands an accepted connection to the least loaded child and closes our copy
+void dispatch_connection(int slaveSocket, const struct sockaddr_in* clientInAddr,
+                         struct dispatch_slot* slots, int slotCount, int maxActive,
+                         struct worker_metrics* counters, pid_t myPid)
+{
+    // a rejected connection is never handed to a child
+    enum admission_verdict verdict = admission_check(&admission, clientInAddr);
+    if (verdict != ADMISSION_ADMIT)
+    {
+        admission_reject(slaveSocket);
+        metrics_rejected(counters, verdict == ADMISSION_RATE_LIMITED);
+        return;
+    }
+
+    // the picked child may have gone while we were accepting
+    int target = pick_least_loaded(slots, slotCount, maxActive);
+    while (target != -1 && send_descriptor(slots[target].channel, slaveSocket,
+                                           clientInAddr) == -1)
+    {
+        fprintf(stderr, "%d: sendmsg() : %s\n", (int)myPid, strerror(errno));
+        close(slots[target].channel);
+        admission_release(&admission, slots[target].active);
+        slots[target].active = -1;
+        target = pick_least_loaded(slots, slotCount, maxActive);
+    }
+    if (target != -1)
+    {
+        ++slots[target].active;
+        ++slots[target].handed;
+    }
+    else
+        admission_leave(&admission);
+    close(slaveSocket);
+}
+
+// connections taken from the backlog per poll() wakeup of the dispatcher
+#define ACCEPT_BATCH 64
+
+void run_dispatcher(int masterSocket, struct dispatch_slot* slots, int slotCount,
+                    int maxActive, struct worker_metrics* counters, pid_t myPid)
+{
+    // only the dispatcher accepts: it drains the backlog until EAGAIN
+    int flags = fcntl(masterSocket, F_GETFL);
+    if (flags == -1 || fcntl(masterSocket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        fprintf(stderr, "fcntl(O_NONBLOCK) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct pollfd* pfds = calloc(slotCount + 1, sizeof(struct pollfd));
+    if (pfds == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long accepted = 0;
+    printf("%d: dispatching connections to %d children\n", (int)myPid, slotCount);
+    while (!needToFinish)
+    {
+        // closing the channels below lets the children run out their clients
+        if (upgradeRequested && upgrade_start(masterSocket, metrics.listenFd))
+            break;
+
+        int target = pick_least_loaded(slots, slotCount, maxActive);
+        pfds[0].fd = masterSocket;
+        pfds[0].events = target == -1 ? 0 : POLLIN;
+        int alive = 0;
+        int i = 0;
+        for (; i < slotCount; ++i)
+        {
+            pfds[i + 1].fd = slots[i].active < 0 ? -1 : slots[i].channel;
+            pfds[i + 1].events = POLLIN;
+            if (slots[i].active >= 0)
+                ++alive;
+        }
+        if (alive == 0)
+        {
+            fprintf(stderr, "%d: no children left\n", (int)myPid);
+            break;
+        }
+
+        int ready = poll(pfds, slotCount + 1, -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%d: poll() : %s\n", (int)myPid, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < slotCount; ++i)
+        {
+            if (pfds[i + 1].revents != 0)
+                collect_child_reports(&slots[i], myPid);
+        }
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
+        // take what the backlog holds, as long as some child has room
+        int batch = 0;
+        for (; batch < ACCEPT_BATCH && pick_least_loaded(slots, slotCount, maxActive) != -1;
+             ++batch)
+        {
+            struct sockaddr_in clientInAddr;
+            socklen_t clientInAddrLen = sizeof(clientInAddr);
+            int slaveSocket = accept4(masterSocket, (struct sockaddr *)(&clientInAddr),
+                                      &clientInAddrLen, SOCK_CLOEXEC);
+            if (slaveSocket == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                metrics_add(&counters->acceptErrors, 1);
+                if (errno == ECONNABORTED)
+                    continue;
+                fprintf(stderr, "%d: accept4() : %s\n", (int)myPid, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            ++accepted;
+            dispatch_connection(slaveSocket, &clientInAddr, slots, slotCount, maxActive,
+                                counters, myPid);
+        }
+    }
+
+    printf("%d: stop working, accepted %lu connections\n", (int)myPid, accepted);
+    int i = 0;
+    for (; i < slotCount; ++i)
+    {
+        printf("%d: child #%d was handed %lu connections\n", (int)myPid, i + 1,
+               slots[i].handed);
+        if (slots[i].active >= 0)
+            close(slots[i].channel);
+    }
+    free(pfds);
+}
+
+unsigned long long monotonic_nanos()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// one accept/serve loop; a process runs one or threadsPerProcess of them
+struct serving_thread
+{
+    pthread_t thread;
+    struct client_source* source;
+    struct process_stats* self;
+    struct worker_metrics* counters;
+    pid_t myPid;
+    int worker;             // SERVER_CPUS index
+    unsigned long long busyNanos;
+};
+
+void* serve_clients(void* arg)
+{
+    struct serving_thread* st = (struct serving_thread*)arg;
+    affinity_pin(&placement, st->worker);
+    while (1)
+    {
+        struct sockaddr_in clientInAddr;
+        int slaveSocket = wait_for_client(st->source, &clientInAddr, st->counters, st->myPid);
+        if (slaveSocket == -1)
+            break;
+        atomic_fetch_add_explicit(&st->self->busyThreads, 1, memory_order_relaxed);
+        // with -a pass the dispatcher admitted it and keeps count itself
+        int admittedHere = st->source->strategy != ACCEPT_PASS;
+        if (admittedHere)
+            atomic_fetch_add_explicit(&st->self->admitted, 1, memory_order_relaxed);
+        metrics_add(&st->counters->accepts, 1);
+        metrics_cpu_accept(slaveSocket);
+        metrics_gauge(&st->counters->active, 1);
+        unsigned long long startedAt = monotonic_nanos();
+
+        serve_client(slaveSocket, &clientInAddr, st->counters, st->myPid);
+        metrics_gauge(&st->counters->active, -1);
+        if (admittedHere)
+            atomic_fetch_sub_explicit(&st->self->admitted, 1, memory_order_relaxed);
+        admission_leave(&admission);
+
+        st->busyNanos += monotonic_nanos() - startedAt;
+        // tell the dispatcher we are free again
+        if (st->source->channel != -1)
+            send(st->source->channel, "", 1, MSG_NOSIGNAL);
+        atomic_fetch_sub_explicit(&st->self->busyThreads, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/**
+ *  Serving threads keep SIGINT, SIGUSR1 and SIGHUP blocked: the process main
+ *  thread takes them in sigsuspend() and then knocks every serving
+ *  thread out of accept() with SIGUSR2 until it exits.
+ */
+void run_serving_threads(struct serving_thread* pool, int threads, pid_t myPid)
+{
+    set_signal_handler(SIGUSR2, "SIGUSR2", sig_wakeup);
+
+    sigset_t stopSignals, saved;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGUSR1);
+    sigaddset(&stopSignals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &saved);
+
+    int started = 0;
+    for (; started < threads; ++started)
+    {
+        int created = pthread_create(&pool[started].thread, NULL, serve_clients,
+                                     &pool[started]);
+        if (created != 0)
+        {
+            fprintf(stderr, "%d: pthread_create() : %s\n", (int)myPid, strerror(created));
+            printf("%d: not all server threads have been created... continuing...\n",
+                   (int)myPid);
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        serve_clients(&pool[0]);
+        return;
+    }
+
+    sigset_t waitMask = saved;
+    sigdelset(&waitMask, SIGINT);
+    sigdelset(&waitMask, SIGUSR1);
+    sigdelset(&waitMask, SIGHUP);
+    while (!should_stop_accepting())
+        sigsuspend(&waitMask);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    int i = 0;
+    for (; i < started; ++i)
+    {
+        while (1)
+        {
+            pthread_kill(pool[i].thread, SIGUSR2);
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 200 * 1000 * 1000;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_timedjoin_np(pool[i].thread, NULL, &deadline) == 0)
+                break;
+        }
+    }
+}
+
+// worker is the SERVER_CPUS index of the first thread
+void run_worker(struct client_source* source, struct process_stats* self,
+                struct worker_metrics* counters, int threads, int worker, pid_t myPid)
+{
+    self->threads = threads;
+    atomic_store_explicit(&self->state, WORKER_ACTIVE, memory_order_relaxed);
+
+    struct serving_thread* pool = calloc(threads, sizeof(struct serving_thread));
+    if (pool == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int i = 0;
+    for (; i < threads; ++i)
+    {
+        pool[i].source = source;
+        pool[i].self = self;
+        pool[i].counters = counters;
+        pool[i].myPid = myPid;
+        pool[i].worker = worker + i;
+    }
+
+    unsigned long long startedAt = monotonic_nanos();
+    if (threads == 1)
+        serve_clients(&pool[0]);
+    else
+        run_serving_threads(pool, threads, myPid);
+    unsigned long long lifetime = monotonic_nanos() - startedAt;
+
+    printf("%d: stop working\n", (int)myPid);
+    printf("%d: accepted %lu connections\n", (int)myPid,
+           metrics_load(&counters->accepts));
+
+    unsigned long long busy = 0;
+    for (i = 0; i < threads; ++i)
+        busy += pool[i].busyNanos;
+    double utilisation = lifetime ? 100.0 * busy / ((double)lifetime * threads) : 0.0;
+    printf("%d: thread utilisation %.1f%% (%d threads, %.1f busy thread-seconds in %.1f s)\n",
+           (int)myPid, utilisation, threads, busy / 1e9, lifetime / 1e9);
+    free(pool);
+}
+
+/**
+ *  Supervisor mode (Apache prefork style): the main process does not
+ *  serve. Once a second, or whenever a child exits, it
+ *   - reaps finished children and notes crashes,
+ *   - forks workers while fewer than minSpare threads are idle,
+ *   - retires one fully idle worker (SIGUSR1) while more than maxSpare
+ *     threads are idle.
+ *  With one thread per process "threads" and "workers" are the same.
+ *  A crash delays the next fork with exponential backoff, so a worker
+ *  dying right after start cannot turn the supervisor into a fork loop.
+ */
+struct pool_config
+{
+    int threadsPerProcess;
+    int startWorkers;
+    int minSpare;
+    int maxSpare;
+    int maxWorkers;
+};
+
+#define MAX_CRASH_BACKOFF_SEC 32
+#define CRASH_FORGET_SEC 60
+
+int parse_spare_range(const char* arg, int* minSpare, int* maxSpare)
+{
+    if (sscanf(arg, "%d:%d", minSpare, maxSpare) != 2)
+        return 0;
+    return *minSpare >= 1 && *maxSpare >= *minSpare;
+}
+
+time_t monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+int find_free_slot(struct process_stats* stats, int maxWorkers)
+{
+    int slot = 1;
+    for (; slot <= maxWorkers; ++slot)
+    {
+        if (atomic_load_explicit(&stats[slot].state, memory_order_relaxed) == WORKER_FREE)
+            return slot;
+    }
+    return -1;
+}
+
+// returns in the supervisor only; the child serves and exits
+pid_t spawn_worker(int slot, struct client_source* source, const struct transport* transport,
+                   struct process_stats* stats, int threads)
+{
+    // counted as idle right away so the next tick does not fork it twice
+    stats[slot].threads = threads;
+    atomic_store_explicit(&stats[slot].busyThreads, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats[slot].state, WORKER_ACTIVE, memory_order_relaxed);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        fprintf(stderr, "fork() : %s\n", strerror(errno));
+        atomic_store_explicit(&stats[slot].state, WORKER_FREE, memory_order_relaxed);
+        return -1;
+    }
+    else if (pid == 0)
+    { // this is a child process
+        pid_t myPid = getpid();
+        stats[slot].pid = myPid;
+        metrics_after_fork(&metrics);
+        upgrade_after_fork();
+        unset_sigchld_handler();
+        printf("additional server process: pid = %d\n", (int)myPid);
+        // slots come and go: no steering, but the listener still says where it runs
+        int cpu = affinity_pin(&placement, (slot - 1) * threads);
+        if (source->strategy == ACCEPT_REUSEPORT)
+        {
+            source->masterSocket = open_listener(transport, 1);
+            affinity_incoming_cpu(source->masterSocket, cpu);
+        }
+        run_worker(source, &stats[slot], metrics_slot(&metrics, slot), threads,
+                   (slot - 1) * threads, myPid);
+        exit(EXIT_SUCCESS);
+    }
+
+    stats[slot].pid = pid;
+    add_child(pid, slot);
+    return pid;
+}
+
+void reap_workers(struct process_stats* stats, int* crashBackoff, time_t* nextSpawn,
+                  time_t* lastCrash, pid_t myPid)
+{
+    pid_t pid = -1;
+    int status = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        size_t i = 0;
+        for (; i < childCount; ++i)
+        {
+            if (children[i].pid != pid)
+                continue;
+
+            release_admitted(&stats[children[i].slot]);
+            atomic_store_explicit(&stats[children[i].slot].state, WORKER_FREE,
+                                  memory_order_relaxed);
+            int crashed = WIFSIGNALED(status)
+                       || (WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS);
+            if (crashed && !children[i].retiring)
+            {
+                time_t now = monotonic_seconds();
+                *crashBackoff = *crashBackoff ? *crashBackoff * 2 : 1;
+                if (*crashBackoff > MAX_CRASH_BACKOFF_SEC)
+                    *crashBackoff = MAX_CRASH_BACKOFF_SEC;
+                *nextSpawn = now + *crashBackoff;
+                *lastCrash = now;
+                printf("%d: worker %d crashed, next fork in %d s\n",
+                       (int)myPid, (int)pid, *crashBackoff);
+            }
+            else
+            {
+                printf("%d: worker %d finished\n", (int)myPid, (int)pid);
+            }
+            children[i].pid = 0;
+            break;
+        }
+    }
+    compact_children();
+}
+
+void run_supervisor(const struct pool_config* pool, struct client_source* source,
+                    const struct transport* transport, struct process_stats* stats,
+                    pid_t myPid)
+{
+    set_signal_handler(SIGCHLD, "SIGCHLD", sig_chld_wakeup);
+
+    printf("%d: supervising %d..%d spare threads, at most %d workers x %d threads\n",
+           (int)myPid, pool->minSpare, pool->maxSpare, pool->maxWorkers,
+           pool->threadsPerProcess);
+    int started = 0;
+    for (; started < pool->startWorkers; ++started)
+        spawn_worker(find_free_slot(stats, pool->maxWorkers), source, transport, stats,
+                     pool->threadsPerProcess);
+    upgrade_ready();
+
+    int crashBackoff = 0;
+    time_t nextSpawn = 0;
+    time_t lastCrash = 0;
+    int lastIdle = -1;
+    size_t lastTotal = 0;
+    while (!needToFinish)
+    {
+        if (upgradeRequested && upgrade_start(source->masterSocket, metrics.listenFd))
+            break;
+        reap_workers(stats, &crashBackoff, &nextSpawn, &lastCrash, myPid);
+
+        time_t now = monotonic_seconds();
+        if (crashBackoff && now - lastCrash > CRASH_FORGET_SEC)
+            crashBackoff = 0;
+
+        int idle = 0;
+        size_t i = 0;
+        for (; i < childCount; ++i)
+        {
+            if (!children[i].retiring)
+                idle += idle_threads(&stats[children[i].slot]);
+        }
+        if (idle != lastIdle || childCount != lastTotal)
+        {
+            printf("%d: pool: %zu workers, %d idle threads\n", (int)myPid, childCount, idle);
+            lastIdle = idle;
+            lastTotal = childCount;
+        }
+
+        int threads = pool->threadsPerProcess;
+        if (idle < pool->minSpare && now >= nextSpawn)
+        {
+            int toSpawn = (pool->minSpare - idle + threads - 1) / threads;
+            while (toSpawn-- > 0 && (int)childCount < pool->maxWorkers)
+            {
+                int slot = find_free_slot(stats, pool->maxWorkers);
+                if (slot == -1 || spawn_worker(slot, source, transport, stats, threads) == -1)
+                    break;
+            }
+        }
+        else if (idle > pool->maxSpare && idle - threads >= pool->minSpare)
+        {
+            for (i = 0; i < childCount; ++i)
+            {
+                struct process_stats* slot = &stats[children[i].slot];
+                if (!children[i].retiring && idle_threads(slot) == slot->threads)
+                {
+                    printf("%d: retiring worker %d\n", (int)myPid, (int)children[i].pid);
+                    children[i].retiring = 1;
+                    kill(children[i].pid, SIGUSR1);
+                    break;
+                }
+            }
+        }
+
+        // SIGCHLD and SIGINT cut the nap short
+        sleep(1);
+    }
+    printf("%d: stop supervising\n", (int)myPid);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2)
+    {
+        int cmpRes = strcmp(argv[1], "--help");
+        if (cmpRes == 0)
+        {
+            printf("usage: prefork [-a shared|mutex|fcntl|reuseport|pass] [-l maxActivePerChild] "
+                   "[-s minSpare:maxSpare] [-m maxWorkers] [-t threadsPerProcess] [-u] "
+                   "[serverPort|unix:path|seqpacket:path] [processCount]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
+            exit(EXIT_SUCCESS);
+        }    
+    }
+
+    // before getopt() shifts argv: the new binary gets the same arguments
+    upgrade_init(argv);
+
+    enum accept_strategy strategy = ACCEPT_SHARED;
+    int strategyGiven = 0;
+    int datagrams = 0;
+    int maxActivePerChild = 0;
+    int supervise = 0;
+    struct pool_config pool;
+    pool.threadsPerProcess = 1;
+    pool.minSpare = 1;
+    pool.maxSpare = 1;
+    pool.maxWorkers = 64;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "a:l:s:m:t:u")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            if (!parse_accept_strategy(optarg, &strategy))
+            {
+                fprintf(stderr, "unknown accept strategy: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            strategyGiven = 1;
+            break;
+        case 'u':
+            datagrams = 1;
+            break;
+        case 'l':
+            maxActivePerChild = atoi(optarg);
+            if (maxActivePerChild < 1)
+                maxActivePerChild = 1;
+            break;
+        case 's':
+            if (!parse_spare_range(optarg, &pool.minSpare, &pool.maxSpare))
+            {
+                fprintf(stderr, "bad spare range: %s (expected min:max, 1 <= min <= max)\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            supervise = 1;
+            break;
+        case 't':
+            pool.threadsPerProcess = atoi(optarg);
+            if (pool.threadsPerProcess < 1)
+                pool.threadsPerProcess = 1;
+            break;
+        case 'm':
+            pool.maxWorkers = atoi(optarg);
+            if (pool.maxWorkers < 1)
+                pool.maxWorkers = 1;
+            supervise = 1;
+            break;
+        default:
+            fprintf(stderr, "try prefork --help\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (supervise && strategy == ACCEPT_PASS)
+    {
+        fprintf(stderr, "a supervised pool (-s/-m) cannot be combined with -a pass\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (datagrams)
+    {
+        if (!strategyGiven)
+            strategy = ACCEPT_REUSEPORT;
+        if (strategy != ACCEPT_SHARED && strategy != ACCEPT_REUSEPORT)
+        {
+            fprintf(stderr, "datagram mode (-u) works with -a shared or -a reuseport only\n");
+            exit(EXIT_FAILURE);
+        }
+        if (supervise || pool.threadsPerProcess != 1)
+        {
+            fprintf(stderr, "datagram mode (-u) cannot be combined with -s, -m or -t\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    if (transport.family != AF_INET && (datagrams || strategy == ACCEPT_REUSEPORT))
+    {
+        fprintf(stderr, "a unix socket path cannot be combined with -u or -a reuseport\n");
+        exit(EXIT_FAILURE);
+    }
+    transport_print(&transport);
+    if (datagrams)
+        printf("datagram mode (udp)\n");
+    logger_init();
+    payload_init(&payload, 0);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    timeouts_init(&timeouts);
+    affinity_init(&placement);
+    if (!datagrams)
+        admission_init(&admission);
+    if (datagrams && payload.messageSize > DATAGRAM_MAX_PAYLOAD)
+    {
+        fprintf(stderr, "a %zu byte message does not fit into a datagram\n", payload.messageSize);
+        exit(EXIT_FAILURE);
+    }
+
+    int processCount = 2;
+    if (argc >= 3)
+        processCount = atoi(argv[2]);
+    if (processCount < 1)
+        processCount = 1;
+    if (supervise && processCount > pool.maxWorkers)
+        processCount = pool.maxWorkers;
+    int threadsPerProcess = pool.threadsPerProcess;
+    printf("process count = %d\n", processCount);
+    printf("threads per process = %d\n", threadsPerProcess);
+    printf("accept strategy = %s\n", acceptStrategyNames[strategy]);
+
+    // in pass and supervisor modes the main process does not serve itself
+    int totalProcesses = processCount;
+    if (strategy == ACCEPT_PASS)
+    {
+        totalProcesses = processCount + 1;
+        // by default a child gets as many connections as it has threads
+        if (maxActivePerChild == 0)
+            maxActivePerChild = threadsPerProcess;
+        printf("max active connections per child = %d\n", maxActivePerChild);
+    }
+    if (supervise)
+    {
+        pool.startWorkers = processCount;
+        totalProcesses = pool.maxWorkers + 1;
+    }
+    
+    set_sigchld_handler();
+    set_sigint_handler();
+    set_sigusr1_handler();
+
+    struct accept_lock acceptLock;
+    accept_lock_init(&acceptLock, strategy);
+
+    struct process_stats* stats =
+        create_shared_memory(totalProcesses * sizeof(struct process_stats));
+    scoreboard = stats;
+    metrics_init(&metrics, totalProcesses, upgrade_metrics_listener());
+
+    // with SO_REUSEPORT every process opens its own listener after fork,
+    // unless the listeners have to be steered to pinned processes
+    int masterSocket = -1;
+    int* steeredListeners = NULL;
+    if (strategy != ACCEPT_REUSEPORT)
+        masterSocket = datagrams ? open_datagram_socket(&transport, 0) : open_listener(&transport, 0);
+    else if (placement.count > 0 && !supervise)
+        steeredListeners = open_steered_listeners(&transport, datagrams, totalProcesses,
+                                                  threadsPerProcess);
+
+    // channels[i] connects the main process ([0]) with child #i+1 ([1])
+    int (*channels)[2] = NULL;
+    if (strategy == ACCEPT_PASS)
+    {
+        channels = calloc(processCount, sizeof(int[2]));
+        if (channels == NULL)
+        {
+            fprintf(stderr, "calloc() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        int i = 0;
+        for (; i < processCount; ++i)
+        {
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channels[i]) == -1)
+            {
+                fprintf(stderr, "socketpair() : %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    struct client_source source;
+    bzero(&source, sizeof(source));
+    source.strategy = strategy;
+    source.masterSocket = masterSocket;
+    source.lock = &acceptLock;
+    source.channel = -1;
+
+    pid_t mainPid = getpid();
+    pid_t myPid = mainPid;
+    int myIndex = 0;
+
+    if (supervise)
+    {
+        printf("main server process: pid = %d\n", (int)myPid);
+        stats[0].pid = myPid;
+        run_supervisor(&pool, &source, &transport, stats, myPid);
+    }
+    else
+    {
+        fork_children(totalProcesses, &myPid, &myIndex);
+        stats[myIndex].pid = myPid;
+        if (myIndex != 0)
+        {
+            metrics_after_fork(&metrics);
+            upgrade_after_fork();
+        }
+        int cpu = affinity_pin(&placement, myIndex * threadsPerProcess);
+
+        if (steeredListeners != NULL)
+        {
+            int i = 0;
+            for (; i < totalProcesses; ++i)
+            {
+                if (i != myIndex)
+                    close(steeredListeners[i]);
+            }
+            source.masterSocket = masterSocket = steeredListeners[myIndex];
+        }
+        else if (strategy == ACCEPT_REUSEPORT)
+        {
+            source.masterSocket = masterSocket =
+                datagrams ? open_datagram_socket(&transport, 1) : open_listener(&transport, 1);
+            affinity_incoming_cpu(masterSocket, cpu);
+        }
+
+        if (strategy == ACCEPT_PASS)
+        {
+            // keep only our own end(s) of the channels
+            int i = 0;
+            for (; i < processCount; ++i)
+            {
+                if (myIndex == 0)
+                {
+                    close(channels[i][1]);
+                }
+                else
+                {
+                    close(channels[i][0]);
+                    if (i + 1 == myIndex)
+                        source.channel = channels[i][1];
+                    else
+                        close(channels[i][1]);
+                }
+            }
+        }
+
+        upgrade_ready();
+        // with SO_REUSEPORT the new processes open listeners of their own
+        int handoverSocket = strategy == ACCEPT_REUSEPORT ? -1 : masterSocket;
+        if (strategy == ACCEPT_PASS && myIndex == 0)
+        {
+            struct dispatch_slot* slots = calloc(processCount, sizeof(struct dispatch_slot));
+            if (slots == NULL)
+            {
+                fprintf(stderr, "calloc() : %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            int i = 0;
+            for (; i < processCount; ++i)
+            {
+                slots[i].channel = channels[i][0];
+                // children that failed to fork never report back
+                slots[i].active = i < (int)childCount ? 0 : -1;
+                if (slots[i].active < 0)
+                    close(slots[i].channel);
+            }
+            run_dispatcher(masterSocket, slots, processCount, maxActivePerChild,
+                           metrics_slot(&metrics, 0), myPid);
+            free(slots);
+        }
+        else if (datagrams)
+        {
+            do
+                serve_datagrams(masterSocket, metrics_slot(&metrics, myIndex), myPid);
+            while (serve_on_after_upgrade(handoverSocket));
+            printf("%d: stop working\n", (int)myPid);
+        }
+        else
+        {
+            if (strategy == ACCEPT_PASS)
+            {
+                close(masterSocket);
+                masterSocket = -1;
+                source.masterSocket = -1;
+            }
+            do
+                run_worker(&source, &stats[myIndex], metrics_slot(&metrics, myIndex),
+                           threadsPerProcess, myIndex * threadsPerProcess, myPid);
+            while (serve_on_after_upgrade(handoverSocket));
+        }
+    }
+
+    if (masterSocket != -1)
+        close(masterSocket);
+    free(channels);
+    free(steeredListeners);
     
     // zombies are comming=)
     if (myPid == mainPid)
-        wait_for_remaining_children(children, childCount, myPid);
+    {
+        if (upgrade_handed_over())
+            drain_children(myPid);
+        wait_for_remaining_children(myPid);
+        print_accept_distribution(stats, totalProcesses);
+        if (!datagrams)
+            admission_report(&admission);
+        printf("load per CPU:\n");
+        metrics_write_cpus(stdout);
+        metrics_shutdown(&metrics, upgrade_handed_over());
+        if (!upgrade_handed_over())
+            transport_shutdown(&transport);
+    }
 
     exit(EXIT_SUCCESS);
 }
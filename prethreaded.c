@@ -0,0 +1,496 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "tuning.h"
+#include "upgrade.h"
+
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct timeouts timeouts;
+static struct cpu_placement placement;
+
+// slot 0 is the acceptor, slot i + 1 is worker i
+static struct metrics metrics;
+
+/**
+ *  acceptor (main thread):
+ *  while (needed)
+ *  {
+ *       int sock = accept(mastersocket, ...)
+ *       if (!queue_push(sock))
+ *           close(sock)            // queue is full: shed load explicitly
+ *  }
+ *
+ *  worker (N threads):
+ *  while (sock = queue_pop())
+ *       send(sock)...close(sock)
+ */
+
+int create_server_socket(const struct transport* transport)
+{
+    int sockfd = transport_socket(transport, 0);
+    if (sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+void set_reuse_addr_opt(int sockfd)
+{
+    int enable = 1;
+    int setOptRes = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+                               &enable, sizeof(int));
+    if (setOptRes == -1)
+    {
+        fprintf(stderr, "setsockopt() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bind_server_socket(int sockfd, const struct transport* transport)
+{
+    int binded = transport_bind(sockfd, transport);
+    if (binded == -1)
+    {
+        fprintf(stderr, "bind() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void listen_server_socket(int sockfd)
+{
+    int listened = listen(sockfd, tuning.backlog);
+    if (listened == -1)
+    {
+        fprintf(stderr, "listen() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+typedef void (*sighandler_t)(int);
+void set_signal_handler(int sigNumber, const char* sigPresentation,
+                        sighandler_t handler)
+{
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(struct sigaction));
+    sigact.sa_handler = handler;
+    int sigActionSet = sigaction(sigNumber, &sigact, NULL);
+    if (sigActionSet == -1)
+    {
+        fprintf(stderr, "sigaction(%s) : %s\n", sigPresentation, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static volatile sig_atomic_t needToFinish = 0;
+void sig_int()
+{
+    needToFinish = 1;
+}
+
+void set_sigint_handler()
+{
+    set_signal_handler(SIGINT, "SIGINT", sig_int);
+}
+
+struct accepted_client
+{
+    int sockfd;
+    struct sockaddr_in addr;
+};
+
+/**
+ *  Bounded multi-producer/multi-consumer queue (D. Vyukov's algorithm):
+ *  every cell carries a sequence number telling whether it is free for
+ *  the producer at position pos (seq == pos) or holds data for the
+ *  consumer at position pos (seq == pos + 1). Producers and consumers
+ *  only contend on their own position counter with a single CAS.
+ *  The semaphore is used only to put idle workers to sleep.
+ */
+struct queue_cell
+{
+    atomic_size_t sequence;
+    struct accepted_client client;
+};
+
+struct conn_queue
+{
+    struct queue_cell* cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) atomic_size_t dequeuePos;
+    sem_t items;
+};
+
+void queue_init(struct conn_queue* queue, size_t depth)
+{
+    size_t capacity = 1;
+    while (capacity < depth)
+        capacity <<= 1;
+
+    queue->cells = calloc(capacity, sizeof(struct queue_cell));
+    if (queue->cells == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size_t i = 0;
+    for (; i < capacity; ++i)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = capacity - 1;
+    atomic_init(&queue->enqueuePos, 0);
+    atomic_init(&queue->dequeuePos, 0);
+    if (sem_init(&queue->items, 0, 0) == -1)
+    {
+        fprintf(stderr, "sem_init() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// returns 0 if the queue is full
+int queue_try_push(struct conn_queue* queue, const struct accepted_client* client)
+{
+    size_t pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+    while (1)
+    {
+        struct queue_cell* cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                cell->client = *client;
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                sem_post(&queue->items);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+        }
+    }
+}
+
+// returns 0 if the queue is empty
+int queue_try_pop(struct conn_queue* queue, struct accepted_client* client)
+{
+    size_t pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+    while (1)
+    {
+        struct queue_cell* cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeuePos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                *client = cell->client;
+                atomic_store_explicit(&cell->sequence, pos + queue->mask + 1,
+                                      memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+        }
+    }
+}
+
+// blocks until a client is available; returns 0 when woken up for shutdown
+int queue_pop(struct conn_queue* queue, struct accepted_client* client)
+{
+    while (sem_wait(&queue->items) == -1)
+    {
+        if (errno != EINTR)
+        {
+            fprintf(stderr, "sem_wait() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return queue_try_pop(queue, client);
+}
+
+struct worker
+{
+    pthread_t thread;
+    int index;
+    struct conn_queue* queue;
+    struct worker_metrics* counters;
+    size_t served;
+};
+
+void serve_client(int workerIndex, const struct accepted_client* client,
+                  struct worker_metrics* counters)
+{
+    transport_skip_greeting(client->sockfd);
+    // only the debug and trace lines print the peer
+    char buffer[INET_ADDRSTRLEN] = "-";
+    const char* clientIpStr = buffer;
+    int clientPort = (int)ntohs(client->addr.sin_port);
+    if (log_enabled(LEVEL_DEBUG))
+        clientIpStr = transport_peer(&client->addr, buffer);
+    if (clientIpStr == NULL)
+        clientIpStr = "?";
+    log_debug("worker %d: serving %s:%d\n", workerIndex, clientIpStr, clientPort);
+    metrics_add(&counters->accepts, 1);
+    metrics_cpu_accept(client->sockfd);
+    metrics_gauge(&counters->active, 1);
+
+    struct payload_stream stream;
+    timeouts_apply(&timeouts, client->sockfd);
+    payload_stream_start(&payload, &stream, client->sockfd);
+    int sndCount = 0;
+    for (; payload_stream_more(&payload, &stream); sndCount = stream.sent)
+    {
+        int due = payload_stream_due(&payload, &stream);
+        struct payload_sent acct;
+        log_trace("worker %d: sending packet number %d to %s:%d\n",
+                  workerIndex, sndCount + 1, clientIpStr, clientPort);
+        ssize_t sent = payload_send_messages(&payload, &stream, client->sockfd, due, &acct);
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                metrics_add(&counters->timeoutCloses, 1);
+                log_debug("worker %d: write timeout: %s:%d\n",
+                          workerIndex, clientIpStr, clientPort);
+            }
+            else if (errno == EPIPE || errno == ECONNRESET)
+            {
+                metrics_add(&counters->epipeCloses, 1);
+                log_debug("worker %d: outgoing connection closed: %s:%d\n",
+                          workerIndex, clientIpStr, clientPort);
+            }
+            else
+                fprintf(stderr, "worker %d: send() : %s\n", workerIndex, strerror(errno));
+            break;
+        }
+        metrics_batch_sent(counters, due, sent, acct.syscalls);
+        metrics_zerocopy(counters, acct.zerocopyBytes, acct.zerocopyCopied);
+        payload_stream_sent(&payload, &stream, due);
+
+        if (needToFinish)
+        {
+            log_debug("worker %d: stop working\n", workerIndex);
+            break;
+        }
+
+        payload_stream_wait(&payload, &stream);
+    }
+
+    log_debug("worker %d: closing connection: %s:%d\n", workerIndex, clientIpStr, clientPort);
+    close(client->sockfd);
+    metrics_gauge(&counters->active, -1);
+}
+
+void* worker_main(void* arg)
+{
+    struct worker* self = (struct worker*)arg;
+    struct accepted_client client;
+    // the acceptor is left to the scheduler
+    affinity_pin(&placement, self->index);
+    while (queue_pop(self->queue, &client))
+    {
+        if (needToFinish)
+        {
+            close(client.sockfd);
+            continue;
+        }
+        serve_client(self->index, &client, self->counters);
+        ++self->served;
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2)
+    {
+        int cmpRes = strcmp(argv[1], "--help");
+        if (cmpRes == 0)
+        {
+            printf("usage: prethreaded [serverPort|unix:path|seqpacket:path] [workerCount] [queueDepth]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    transport_print(&transport);
+    logger_init();
+    upgrade_init(argv);
+    payload_init(&payload, 0);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    timeouts_init(&timeouts);
+    affinity_init(&placement);
+
+    int workerCount = 8;
+    if (argc >= 3)
+        workerCount = atoi(argv[2]);
+    if (workerCount < 1)
+        workerCount = 1;
+    printf("worker count = %d\n", workerCount);
+    metrics_init(&metrics, 1 + workerCount, upgrade_metrics_listener());
+    struct worker_metrics* acceptCounters = metrics_slot(&metrics, 0);
+
+    int queueDepth = 64;
+    if (argc >= 4)
+        queueDepth = atoi(argv[3]);
+    if (queueDepth < 1)
+        queueDepth = 1;
+
+    struct conn_queue queue;
+    queue_init(&queue, (size_t)queueDepth);
+    printf("queue depth = %zu\n", queue.mask + 1);
+
+    // after an upgrade the old process's socket is already bound and listening
+    int masterSocket = upgrade_listener();
+    if (masterSocket == -1)
+    {
+        masterSocket = create_server_socket(&transport);
+        if (transport.family == AF_INET)
+            set_reuse_addr_opt(masterSocket);
+        bind_server_socket(masterSocket, &transport);
+    }
+    tuning_listener(&tuning, masterSocket, &transport);
+    listen_server_socket(masterSocket);
+    transport_defer_accept(masterSocket, &transport);
+
+    // workers inherit the mask, so SIGINT and SIGHUP always interrupt the acceptor
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+
+    struct worker* workers = calloc(workerCount, sizeof(struct worker));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "calloc() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    int started = 0;
+    for (; started < workerCount; ++started)
+    {
+        workers[started].index = started;
+        workers[started].queue = &queue;
+        workers[started].counters = metrics_slot(&metrics, 1 + started);
+        int created = pthread_create(&workers[started].thread, NULL, worker_main,
+                                     &workers[started]);
+        if (created != 0)
+        {
+            fprintf(stderr, "pthread_create() : %s\n", strerror(created));
+            if (started == 0)
+                exit(EXIT_FAILURE);
+            printf("not all worker threads have been created... continuing...\n");
+            break;
+        }
+    }
+
+    set_sigint_handler();
+    pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+
+    size_t accepted = 0;
+    size_t rejected = 0;
+    printf("ready to accept client connections...\n");
+    upgrade_ready();
+    while (!needToFinish)
+    {
+        // unlike after SIGINT the workers serve every queued client to the end
+        if (upgradeRequested && upgrade_start(masterSocket, metrics.listenFd))
+            break;
+
+        struct accepted_client client;
+        socklen_t clientInAddrLen = sizeof(client.addr);
+        client.sockfd = accept4(masterSocket, (struct sockaddr *)(&client.addr),
+                                &clientInAddrLen, SOCK_CLOEXEC);
+        if (client.sockfd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            metrics_add(&acceptCounters->acceptErrors, 1);
+            if (errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "accept4() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        ++accepted;
+
+        if (!queue_try_push(&queue, &client))
+        {
+            // every worker is busy and the queue is full
+            ++rejected;
+            close(client.sockfd);
+            if ((rejected & (rejected - 1)) == 0)
+                log_warn("queue is full: %zu of %zu connections rejected\n",
+                         rejected, accepted);
+        }
+    }
+
+    printf("stop working\n");
+    close(masterSocket);
+
+    // one wake-up per worker on top of the queued clients: each worker
+    // sees an empty queue exactly once
+    int i = 0;
+    for (; i < started; ++i)
+        sem_post(&queue.items);
+    for (i = 0; i < started; ++i)
+    {
+        pthread_join(workers[i].thread, NULL);
+        printf("worker %d served %zu clients\n", i, workers[i].served);
+    }
+    printf("accepted %zu, rejected %zu\n", accepted, rejected);
+    printf("load per CPU:\n");
+    metrics_write_cpus(stdout);
+
+    metrics_shutdown(&metrics, upgrade_handed_over());
+    if (!upgrade_handed_over())
+        transport_shutdown(&transport);
+    free(workers);
+    free(queue.cells);
+    sem_destroy(&queue.items);
+    exit(EXIT_SUCCESS);
+}
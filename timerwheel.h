@@ -0,0 +1,325 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ *  Hierarchical timing wheel: TIMER_LEVELS wheels of TIMER_SLOTS slots,
+ *  every slot a circular list of timers. Level 0 holds the timers due in
+ *  the next 64 ticks, one slot per tick; a slot of level n covers 64^n
+ *  ticks and is cascaded down when the lower wheel wraps around. Adding
+ *  and cancelling a timer is O(1) whatever the number of timers, so one
+ *  thread keeps the deadlines of 100k connections; advancing costs one
+ *  step per tick that has work, not per tick elapsed.
+ *
+ *  With 1 ms ticks the wheel spans 2^24 ms (4.6 hours); a timer further
+ *  out is parked in the last slot and re-filed when that slot comes up.
+ *
+ *  Deadlines are CLOCK_MONOTONIC and rounded up to the next tick: a timer
+ *  never fires early. A timer added from an expiry callback with a
+ *  deadline that already passed fires on the next advance, not the
+ *  current one, so a zero interval cannot spin the loop.
+ */
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+struct timer
+{
+    struct timer* prev;         // NULL: not pending
+    struct timer* next;
+    unsigned long long expires; // tick
+    void (*expired)(struct timer*);
+};
+
+// the struct that embeds a timer as member
+#define timer_owner(t, type, member) ((type*)((char*)(t) - offsetof(type, member)))
+
+struct timer_wheel
+{
+    struct timespec origin;     // tick 0
+    long long tickNs;
+    unsigned long long now;     // every timer up to this tick fired or is in due
+    struct timespec advancedTo; // the time of the last advance
+    size_t count;
+    struct timer due;
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+static inline void timer_list_init(struct timer* head)
+{
+    head->prev = head->next = head;
+}
+
+static inline int timer_list_empty(const struct timer* head)
+{
+    return head->next == head;
+}
+
+static inline void timer_list_push(struct timer* head, struct timer* t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline void timer_list_unlink(struct timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+// moves every timer of from to the end of to
+static inline void timer_list_splice(struct timer* from, struct timer* to)
+{
+    if (timer_list_empty(from))
+        return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    timer_list_init(from);
+}
+
+static inline void timer_wheel_init(struct timer_wheel* w, long long tickNs)
+{
+    bzero(w, sizeof(struct timer_wheel));
+    clock_gettime(CLOCK_MONOTONIC, &w->origin);
+    w->advancedTo = w->origin;
+    w->tickNs = tickNs > 0 ? tickNs : 1000000;
+    timer_list_init(&w->due);
+    int level = 0;
+    for (; level < TIMER_LEVELS; ++level)
+    {
+        int slot = 0;
+        for (; slot < TIMER_SLOTS; ++slot)
+            timer_list_init(&w->slots[level][slot]);
+    }
+}
+
+static inline int timer_pending(const struct timer* t)
+{
+    return t->next != NULL;
+}
+
+// the tick a point in time falls into; times before the origin are tick 0
+static inline unsigned long long timer_wheel_tick(const struct timer_wheel* w,
+                                                  const struct timespec* at, int roundUp)
+{
+    long long ns = (at->tv_sec - w->origin.tv_sec) * 1000000000LL
+        + (at->tv_nsec - w->origin.tv_nsec);
+    if (ns <= 0)
+        return 0;
+    return (unsigned long long)((ns + (roundUp ? w->tickNs - 1 : 0)) / w->tickNs);
+}
+
+static inline void timer_wheel_file(struct timer_wheel* w, struct timer* t)
+{
+    if (t->expires <= w->now)
+    {
+        timer_list_push(&w->due, t);
+        return;
+    }
+    unsigned long long delta = t->expires - w->now;
+    unsigned long long at = t->expires;
+    if (delta >= TIMER_SPAN)
+        at = w->now + TIMER_SPAN - 1;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >= 1ULL << ((level + 1) * TIMER_SLOT_BITS))
+        ++level;
+    timer_list_push(&w->slots[level][(at >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK], t);
+}
+
+// (re)starts t to call t->expired at the deadline
+static inline void timer_wheel_add(struct timer_wheel* w, struct timer* t,
+                                   const struct timespec* deadline)
+{
+    if (timer_pending(t))
+        timer_list_unlink(t);
+    else
+        ++w->count;
+    // a deadline that passed already is due on the next advance, not a tick later
+    if (deadline->tv_sec < w->advancedTo.tv_sec
+        || (deadline->tv_sec == w->advancedTo.tv_sec && deadline->tv_nsec <= w->advancedTo.tv_nsec))
+        t->expires = w->now;
+    else
+        t->expires = timer_wheel_tick(w, deadline, 1);
+    timer_wheel_file(w, t);
+}
+
+static inline void timer_wheel_cancel(struct timer_wheel* w, struct timer* t)
+{
+    if (!timer_pending(t))
+        return;
+    timer_list_unlink(t);
+    --w->count;
+}
+
+/**
+ *  The earliest tick after now with work in the wheels: a timer that
+ *  expires then, or a slot of a higher level that has to be cascaded
+ *  then. 0 when the wheels are empty.
+ */
+static inline unsigned long long timer_wheel_scan(const struct timer_wheel* w)
+{
+    unsigned long long best = 0;
+    int level = 0;
+    for (; level < TIMER_LEVELS; ++level)
+    {
+        int shift = level * TIMER_SLOT_BITS;
+        unsigned long long base = w->now >> shift;
+        // on level 0 the current slot is empty: its tick is now
+        unsigned long long k = 1;
+        for (; k <= TIMER_SLOTS - (level == 0); ++k)
+        {
+            if (timer_list_empty(&w->slots[level][(base + k) & TIMER_SLOT_MASK]))
+                continue;
+            unsigned long long tick = (base + k) << shift;
+            if (best == 0 || tick < best)
+                best = tick;
+            break;
+        }
+    }
+    return best;
+}
+
+// the deadline to arm a timerfd with; 0 when no timer is pending
+static inline int timer_wheel_next(const struct timer_wheel* w, struct timespec* deadline)
+{
+    if (w->count == 0)
+        return 0;
+    unsigned long long tick = timer_list_empty(&w->due) ? timer_wheel_scan(w) : w->now;
+    unsigned long long ns = tick * (unsigned long long)w->tickNs;
+    *deadline = w->origin;
+    deadline->tv_sec += ns / 1000000000ULL;
+    deadline->tv_nsec += ns % 1000000000ULL;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    return 1;
+}
+
+static inline void timer_wheel_cascade(struct timer_wheel* w, int level)
+{
+    struct timer* slot = &w->slots[level][(w->now >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+    struct timer moving;
+    timer_list_init(&moving);
+    timer_list_splice(slot, &moving);
+    while (!timer_list_empty(&moving))
+    {
+        struct timer* t = moving.next;
+        timer_list_unlink(t);
+        timer_wheel_file(w, t);
+    }
+}
+
+/**
+ *  Moves the wheel to the current time and calls the callback of every
+ *  timer that expired, earliest tick first. A callback may add or cancel
+ *  any timer, itself included, and free what embeds it.
+ */
+static inline void timer_wheel_advance(struct timer_wheel* w, const struct timespec* now)
+{
+    unsigned long long target = timer_wheel_tick(w, now, 0);
+    w->advancedTo = *now;
+    while (w->now < target)
+    {
+        unsigned long long next = timer_wheel_scan(w);
+        if (next == 0 || next > target)
+        {
+            // nothing to do in between: jump
+            w->now = target;
+            break;
+        }
+        w->now = next;
+        int level = 1;
+        for (; level < TIMER_LEVELS; ++level)
+        {
+            if ((w->now >> ((level - 1) * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK)
+                break;
+            timer_wheel_cascade(w, level);
+        }
+        timer_list_splice(&w->slots[0][w->now & TIMER_SLOT_MASK], &w->due);
+    }
+
+    struct timer firing;
+    timer_list_init(&firing);
+    timer_list_splice(&w->due, &firing);
+    while (!timer_list_empty(&firing))
+    {
+        struct timer* t = firing.next;
+        timer_list_unlink(t);
+        --w->count;
+        t->expired(t);
+    }
+}
+
+/**
+ *  Connection deadlines shared by all servers, from the environment:
+ *
+ *      SERVER_WRITE_TIMEOUT_MS  a send that cannot make progress because
+ *                               the client stopped reading is given up
+ *                               after this long (default 30000, 0: never)
+ *      SERVER_LIFETIME_MS       a connection is closed this long after
+ *                               accept() whatever it is doing (default 0:
+ *                               never); epollserver only
+ */
+struct timeouts
+{
+    long long writeNs;
+    long long lifetimeNs;
+};
+
+static long timeouts_env(const char* name, long fallback)
+{
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return fallback;
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed < 0)
+    {
+        fprintf(stderr, "%s=%s is not a number of milliseconds\n", name, value);
+        exit(EXIT_FAILURE);
+    }
+    return parsed;
+}
+
+static void timeouts_init(struct timeouts* t)
+{
+    t->writeNs = timeouts_env("SERVER_WRITE_TIMEOUT_MS", 30000) * 1000000LL;
+    t->lifetimeNs = timeouts_env("SERVER_LIFETIME_MS", 0) * 1000000LL;
+    if (t->writeNs > 0)
+        printf("timeouts: writes give up after %lld ms\n", t->writeNs / 1000000);
+    if (t->lifetimeNs > 0)
+        printf("timeouts: connections live at most %lld ms\n", t->lifetimeNs / 1000000);
+}
+
+// for a blocking socket: send() fails with EAGAIN once the write timeout passed
+static inline void timeouts_apply(const struct timeouts* t, int sockfd)
+{
+    if (t->writeNs == 0)
+        return;
+    struct timeval tv;
+    tv.tv_sec = t->writeNs / 1000000000LL;
+    tv.tv_usec = (t->writeNs % 1000000000LL) / 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+        fprintf(stderr, "setsockopt(SO_SNDTIMEO) : %s\n", strerror(errno));
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ *  Where a server listens: the port argument of every server (and the
+ *  server address of the client) is one of
+ *
+ *      6666                    TCP on every IPv4 address
+ *      unix:/tmp/hi.sock       AF_UNIX stream socket
+ *      seqpacket:/tmp/hi.sock  AF_UNIX SOCK_SEQPACKET: every send() is one
+ *                              record; a message must fit the send buffer
+ *
+ *  Clients on the same host skip the whole TCP/IP loopback path through
+ *  a unix socket. A server owns its path: it removes a stale socket file
+ *  before bind() and the file when it stops.
+ *
+ *  Peer addresses are kept in a struct sockaddr_in as before; an AF_UNIX
+ *  peer has no name, accept() fills in only its family and
+ *  transport_peer() prints it as "unix".
+ *
+ *  SERVER_DEFER_ACCEPT_S=<seconds> sets TCP_DEFER_ACCEPT on a TCP
+ *  listener: the kernel finishes the handshake but wakes no accept()
+ *  until the client has sent something or the seconds are up, so a
+ *  connection that only completes the handshake costs no worker. The
+ *  servers speak first, so this only pays off with clients that greet
+ *  (client -g); the server reads the greeting away after accept().
+ */
+struct transport
+{
+    int family;         // AF_INET or AF_UNIX
+    int type;           // SOCK_STREAM or SOCK_SEQPACKET
+    uint16_t port;
+    struct sockaddr_un unixAddr;
+};
+
+static int transport_parse(const char* spec, struct transport* t)
+{
+    bzero(t, sizeof(struct transport));
+    const char* path = NULL;
+    t->type = SOCK_STREAM;
+    if (strncmp(spec, "unix:", 5) == 0)
+        path = spec + 5;
+    else if (strncmp(spec, "seqpacket:", 10) == 0)
+    {
+        path = spec + 10;
+        t->type = SOCK_SEQPACKET;
+    }
+
+    if (path == NULL)
+    {
+        t->family = AF_INET;
+        t->port = (uint16_t)atoi(spec);
+        return 1;
+    }
+    if (*path == '\0' || strlen(path) >= sizeof(t->unixAddr.sun_path))
+    {
+        fprintf(stderr, "bad unix socket path: %s\n", path);
+        return 0;
+    }
+    t->family = AF_UNIX;
+    t->unixAddr.sun_family = AF_UNIX;
+    strcpy(t->unixAddr.sun_path, path);
+    return 1;
+}
+
+static inline const char* transport_name(const struct transport* t)
+{
+    if (t->family == AF_INET)
+        return "tcp";
+    return t->type == SOCK_SEQPACKET ? "seqpacket" : "unix";
+}
+
+// the line every server prints first
+static inline void transport_print(const struct transport* t)
+{
+    if (t->family == AF_INET)
+        printf("server port = %d\n", t->port);
+    else
+        printf("server path = %s (%s)\n", t->unixAddr.sun_path, transport_name(t));
+}
+
+static inline int transport_socket(const struct transport* t, int flags)
+{
+    return socket(t->family, t->type | flags, 0);
+}
+
+static inline int transport_bind(int sockfd, const struct transport* t)
+{
+    if (t->family == AF_UNIX)
+    {
+        unlink(t->unixAddr.sun_path);
+        return bind(sockfd, (const struct sockaddr *)&t->unixAddr, sizeof(t->unixAddr));
+    }
+    struct sockaddr_in inaddr;
+    bzero(&inaddr, sizeof(inaddr));
+    inaddr.sin_family = AF_INET;
+    inaddr.sin_port = htons(t->port);
+    inaddr.sin_addr.s_addr = INADDR_ANY;
+    return bind(sockfd, (const struct sockaddr *)&inaddr, sizeof(inaddr));
+}
+
+// clients greet: set by transport_defer_accept() and by fast open (tuning.h)
+static int transportGreeting = 0;
+
+static inline void transport_defer_accept(int sockfd, const struct transport* t)
+{
+    const char* value = getenv("SERVER_DEFER_ACCEPT_S");
+    if (value == NULL || *value == '\0' || t->family != AF_INET)
+        return;
+    char* end = NULL;
+    long seconds = strtol(value, &end, 10);
+    if (*end != '\0' || seconds < 0 || seconds > 3600)
+    {
+        fprintf(stderr, "SERVER_DEFER_ACCEPT_S=%s: expected seconds, up to 3600\n", value);
+        exit(EXIT_FAILURE);
+    }
+    if (seconds == 0)
+        return;
+    int timeout = (int)seconds;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout)) == -1)
+    {
+        fprintf(stderr, "setsockopt(TCP_DEFER_ACCEPT) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!transportGreeting)
+        printf("deferred accept: up to %d s for the client's greeting\n", timeout);
+    transportGreeting = 1;
+}
+
+// with deferred accept the greeting is already queued: one recv() that never waits
+static inline void transport_skip_greeting(int sockfd)
+{
+    if (!transportGreeting)
+        return;
+    char greeting[64];
+    recv(sockfd, greeting, sizeof(greeting), MSG_DONTWAIT);
+}
+
+static inline void transport_shutdown(const struct transport* t)
+{
+    if (t->family == AF_UNIX)
+        unlink(t->unixAddr.sun_path);
+}
+
+// inet_ntop() for a peer that may also be an unnamed unix socket
+static inline const char* transport_peer(const struct sockaddr_in* addr, char* buffer)
+{
+    if (addr->sin_family != AF_INET)
+    {
+        strcpy(buffer, "unix");
+        return buffer;
+    }
+    return inet_ntop(AF_INET, &addr->sin_addr, buffer, INET_ADDRSTRLEN);
+}
+
+#endif
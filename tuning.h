@@ -0,0 +1,174 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "transport.h"
+
+/**
+ *  Socket options shared by every server and the client. SOCKET_PROFILE
+ *  picks a preset, single settings override it:
+ *
+ *                          default     low-latency     bulk-throughput
+ *      SOCKET_NODELAY      -           1               0
+ *      SOCKET_CORK         -           0               1
+ *      SOCKET_SNDBUF       -           -               4194304
+ *      SOCKET_RCVBUF       -           -               4194304
+ *      SOCKET_FASTOPEN     -           256             -
+ *      SOCKET_BUSY_POLL_US -           50              -
+ *      SOCKET_KEEPALIVE_S  -           -               60
+ *      SOCKET_BACKLOG      SOMAXCONN   SOMAXCONN       SOMAXCONN
+ *
+ *  "-" leaves the kernel default. NODELAY turns Nagle off, CORK holds
+ *  back partial segments until a full one (or 200 ms) is queued. The
+ *  buffer sizes are in bytes; the kernel doubles them and they switch
+ *  off its autotuning. FASTOPEN is the TCP Fast Open queue length of a
+ *  listener; the client uses TCP_FASTOPEN_CONNECT, and since only data
+ *  rides in the SYN, it greets (client -g) then. BUSY_POLL_US lets a
+ *  blocking receive spin on the device queue that long before it
+ *  sleeps. KEEPALIVE_S sends keepalive probes after that many idle
+ *  seconds.
+ *
+ *  A server sets everything on its listener before listen(): accepted
+ *  sockets inherit the options, so accept() costs no extra syscall.
+ *  Unix and UDP sockets get only the buffer sizes and busy polling.
+ */
+
+struct socket_tuning
+{
+    const char* profile;
+    int nodelay;        // -1: kernel default
+    int cork;           // -1: kernel default
+    int sndbuf;         // 0: kernel default
+    int rcvbuf;
+    int fastOpen;       // listener queue length, 0: off
+    int busyPollUs;
+    int keepaliveS;
+    int backlog;
+};
+
+static int tuning_env(const char* name, int fallback, int min)
+{
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return fallback;
+    char* end = NULL;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0' || parsed < min || parsed > 1 << 30)
+    {
+        fprintf(stderr, "%s=%s is not a number of at least %d\n", name, value, min);
+        exit(EXIT_FAILURE);
+    }
+    return (int)parsed;
+}
+
+static void tuning_init(struct socket_tuning* t)
+{
+    bzero(t, sizeof(struct socket_tuning));
+    t->nodelay = -1;
+    t->cork = -1;
+    t->backlog = SOMAXCONN;
+    const char* profile = getenv("SOCKET_PROFILE");
+    if (profile == NULL || *profile == '\0')
+        profile = "default";
+    if (strcmp(profile, "low-latency") == 0)
+    {
+        t->nodelay = 1;
+        t->cork = 0;
+        t->fastOpen = 256;
+        t->busyPollUs = 50;
+    }
+    else if (strcmp(profile, "bulk-throughput") == 0)
+    {
+        t->nodelay = 0;
+        t->cork = 1;
+        t->sndbuf = 4 * 1024 * 1024;
+        t->rcvbuf = 4 * 1024 * 1024;
+        t->keepaliveS = 60;
+    }
+    else if (strcmp(profile, "default") != 0)
+    {
+        fprintf(stderr, "SOCKET_PROFILE=%s: use default, low-latency or bulk-throughput\n",
+                profile);
+        exit(EXIT_FAILURE);
+    }
+    t->profile = profile;
+
+    t->nodelay = tuning_env("SOCKET_NODELAY", t->nodelay, 0);
+    t->cork = tuning_env("SOCKET_CORK", t->cork, 0);
+    t->sndbuf = tuning_env("SOCKET_SNDBUF", t->sndbuf, 0);
+    t->rcvbuf = tuning_env("SOCKET_RCVBUF", t->rcvbuf, 0);
+    t->fastOpen = tuning_env("SOCKET_FASTOPEN", t->fastOpen, 0);
+    t->busyPollUs = tuning_env("SOCKET_BUSY_POLL_US", t->busyPollUs, 0);
+    t->keepaliveS = tuning_env("SOCKET_KEEPALIVE_S", t->keepaliveS, 0);
+    t->backlog = tuning_env("SOCKET_BACKLOG", t->backlog, 1);
+
+    printf("socket profile %s: nodelay=%d cork=%d sndbuf=%d rcvbuf=%d fastopen=%d "
+           "busy_poll_us=%d keepalive_s=%d backlog=%d\n", t->profile, t->nodelay, t->cork,
+           t->sndbuf, t->rcvbuf, t->fastOpen, t->busyPollUs, t->keepaliveS, t->backlog);
+}
+
+static inline void tuning_set(int sockfd, int level, int option, const char* name, int value)
+{
+    if (setsockopt(sockfd, level, option, &value, sizeof(value)) == -1)
+        fprintf(stderr, "setsockopt(%s) : %s\n", name, strerror(errno));
+}
+
+// what every socket gets: buffers and busy polling, then the TCP options
+static void tuning_apply(const struct socket_tuning* t, int sockfd, int tcp)
+{
+    if (t->sndbuf > 0)
+        tuning_set(sockfd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", t->sndbuf);
+    if (t->rcvbuf > 0)
+        tuning_set(sockfd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", t->rcvbuf);
+    if (t->busyPollUs > 0)
+        tuning_set(sockfd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", t->busyPollUs);
+    if (!tcp)
+        return;
+    if (t->nodelay >= 0)
+        tuning_set(sockfd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", t->nodelay != 0);
+    if (t->cork >= 0)
+        tuning_set(sockfd, IPPROTO_TCP, TCP_CORK, "TCP_CORK", t->cork != 0);
+    if (t->keepaliveS > 0)
+    {
+        tuning_set(sockfd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+        tuning_set(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", t->keepaliveS);
+    }
+}
+
+// a listening socket, between bind() and listen(tuning.backlog)
+static inline void tuning_listener(const struct socket_tuning* t, int sockfd,
+                                   const struct transport* transport)
+{
+    tuning_apply(t, sockfd, transport->family == AF_INET);
+    if (t->fastOpen <= 0 || transport->family != AF_INET)
+        return;
+    tuning_set(sockfd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", t->fastOpen);
+    // bit 2 of the sysctl lets listeners take data in the SYN
+    FILE* f = transportGreeting ? NULL : fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int enabled = 0;
+    if (f != NULL && fscanf(f, "%d", &enabled) == 1 && !(enabled & 2))
+        printf("fast open: net.ipv4.tcp_fastopen=%d, listeners need bit 2 set\n", enabled);
+    if (f != NULL)
+        fclose(f);
+    // the greeting of a fast open client is read away after accept()
+    transportGreeting = 1;
+}
+
+// a connecting socket, before connect(); fast open only pays off when we greet
+static inline void tuning_client(const struct socket_tuning* t, int sockfd, int family, int greet)
+{
+    tuning_apply(t, sockfd, family == AF_INET);
+    if (t->fastOpen > 0 && greet && family == AF_INET)
+        tuning_set(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, "TCP_FASTOPEN_CONNECT", 1);
+}
+
+#endif
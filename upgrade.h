@@ -0,0 +1,357 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <linux/close_range.h>
+
+/**
+ *  Binary upgrade without a moment in which the port is closed. SIGHUP
+ *  makes the main process of a server start the binary it was started
+ *  from once more (argv[0], looked up again, so a new build put in its
+ *  place is what runs) with the same arguments and environment, plus
+ *
+ *      UPGRADE_LISTEN_FD   the listening socket
+ *      UPGRADE_METRICS_FD  the metrics endpoint, if there is one
+ *      UPGRADE_READY_FD    a pipe the new process writes its pid to once
+ *                          its workers are started
+ *
+ *  The new process takes the inherited sockets instead of binding new
+ *  ones (bind() fails while the old process listens, and a unix socket
+ *  file would be replaced). The listening socket never closes, so the
+ *  kernel keeps queueing connections through the whole upgrade and no
+ *  client sees a refused connect. Only once the new process is ready
+ *  does the old one stop accepting: its workers finish the connections
+ *  they serve and exit, and the old main process follows the last of
+ *  them; SIGINT stops it as it would without an upgrade. A new process
+ *  that exits before it is ready, or is not ready within
+ *  SERVER_UPGRADE_TIMEOUT_S seconds (default 30), is stopped with SIGINT
+ *  and the old one serves on.
+ *
+ *  The new process is forked by a short-lived intermediate child, so it
+ *  is no child of the old one: the old main process keeps reaping only
+ *  its own workers. The intermediate writes the new pid to the same pipe
+ *  right away, which tells the old process whom to stop on a timeout.
+ *  The blocking servers wait for the outcome in upgrade_start(); the event
+ *  loops of epollserver and uringserver watch the pipe and the deadline
+ *  next to their connections (upgrade_begin(), upgrade_check()), so these
+ *  are served on while the new process starts.
+ *
+ *  With per-process SO_REUSEPORT listeners there is no single socket to
+ *  hand over: the new processes bind their own, and the connections still
+ *  queued on an old listener when it closes are only moved to the others
+ *  with net.ipv4.tcp_migrate_req=1.
+ */
+
+#define UPGRADE_DEFAULT_TIMEOUT_S 30
+
+static volatile sig_atomic_t upgradeRequested = 0;
+static pid_t upgradeOwner = -1;     // workers forked later ignore SIGHUP
+static char** upgradeArgv = NULL;
+static int upgradeTimeoutS = UPGRADE_DEFAULT_TIMEOUT_S;
+static int upgradeListenFd = -1;    // inherited and not taken yet
+static int upgradeMetricsFd = -1;
+static int upgradeReadyFd = -1;
+static int upgradeHandedOver = 0;
+static int upgradePipe = -1;        // the old process: ready pipe of a pending upgrade
+static pid_t upgradePid = -1;       // the new process, once the intermediate reported it
+static struct timespec upgradeDeadline;
+
+static void upgrade_sig_hup(int signo)
+{
+    (void)signo;
+    if (getpid() == upgradeOwner)
+        upgradeRequested = 1;
+}
+
+// the descriptor named by an UPGRADE_*_FD variable, which is removed; -1 without one
+static int upgrade_take_fd(const char* name)
+{
+    const char* value = getenv(name);
+    if (value == NULL || *value == '\0')
+        return -1;
+    char* end = NULL;
+    long fd = strtol(value, &end, 10);
+    int valid = *end == '\0' && fd >= 0;
+    unsetenv(name);
+    if (!valid || fcntl((int)fd, F_SETFD, FD_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "%s: no open descriptor\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return (int)fd;
+}
+
+// call from main() before metrics_init() and before any fork
+static void upgrade_init(char** argv)
+{
+    upgradeArgv = argv;
+    upgradeOwner = getpid();
+    const char* value = getenv("SERVER_UPGRADE_TIMEOUT_S");
+    if (value != NULL && *value != '\0')
+    {
+        char* end = NULL;
+        long seconds = strtol(value, &end, 10);
+        if (*end != '\0' || seconds < 1 || seconds > 3600)
+        {
+            fprintf(stderr, "SERVER_UPGRADE_TIMEOUT_S=%s: expected seconds, 1 to 3600\n", value);
+            exit(EXIT_FAILURE);
+        }
+        upgradeTimeoutS = (int)seconds;
+    }
+    upgradeListenFd = upgrade_take_fd("UPGRADE_LISTEN_FD");
+    upgradeMetricsFd = upgrade_take_fd("UPGRADE_METRICS_FD");
+    upgradeReadyFd = upgrade_take_fd("UPGRADE_READY_FD");
+    if (upgradeReadyFd != -1)
+        printf("upgrade: taking over from the old process\n");
+
+    // no SA_RESTART: SIGHUP has to break a blocking accept() or wait
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(struct sigaction));
+    sigact.sa_handler = upgrade_sig_hup;
+    if (sigaction(SIGHUP, &sigact, NULL) == -1)
+    {
+        fprintf(stderr, "sigaction(SIGHUP) : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// the listening socket of the old process, handed out once; -1 otherwise
+static inline int upgrade_listener()
+{
+    int sockfd = upgradeListenFd;
+    upgradeListenFd = -1;
+    return sockfd;
+}
+
+static inline int upgrade_metrics_listener()
+{
+    int sockfd = upgradeMetricsFd;
+    upgradeMetricsFd = -1;
+    return sockfd;
+}
+
+// the new process accepts: the old one may stop (a no-op in forked workers)
+static void upgrade_ready()
+{
+    if (upgradeReadyFd == -1 || getpid() != upgradeOwner)
+        return;
+    pid_t myPid = getpid();
+    if (write(upgradeReadyFd, &myPid, sizeof(myPid)) != sizeof(myPid))
+        fprintf(stderr, "upgrade: write() : %s\n", strerror(errno));
+    close(upgradeReadyFd);
+    upgradeReadyFd = -1;
+    printf("upgrade: accepting, the old process drains\n");
+}
+
+// a worker forked before upgrade_ready() must not keep the ready pipe open
+static inline void upgrade_after_fork()
+{
+    if (upgradeReadyFd != -1)
+        close(upgradeReadyFd);
+    upgradeReadyFd = -1;
+}
+
+// the old process has a successor: it must not remove the socket files
+static inline int upgrade_handed_over()
+{
+    return upgradeHandedOver;
+}
+
+static inline void upgrade_setenv_fd(const char* name, int fd)
+{
+    char value[16];
+    snprintf(value, sizeof(value), "%d", fd);
+    setenv(name, value, 1);
+}
+
+/**
+ *  The new process: only the handed over descriptors survive execvp().
+ *  Whatever else the old one has open without O_CLOEXEC (a worker's own
+ *  SO_REUSEPORT listener, the payload file) is closed, or the new binary
+ *  would keep it open without knowing.
+ */
+static void upgrade_exec(int listenFd, int metricsFd, int readyFd)
+{
+    if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) == -1)
+        fprintf(stderr, "upgrade: close_range() : %s\n", strerror(errno));
+    int fds[3] = { listenFd, metricsFd, readyFd };
+    int i = 0;
+    for (; i < 3; ++i)
+    {
+        if (fds[i] != -1)
+            fcntl(fds[i], F_SETFD, 0);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvp(upgradeArgv[0], upgradeArgv);
+    fprintf(stderr, "upgrade: execvp(%s) : %s\n", upgradeArgv[0], strerror(errno));
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ *  Called by the old main process once upgradeRequested is set: starts the
+ *  new process and returns the read end of its ready pipe, non-blocking,
+ *  or -1 when it could not be started. Whenever the pipe is readable and
+ *  once upgradeDeadline has passed, upgrade_check() says how far it got.
+ */
+static int upgrade_begin(int listenFd, int metricsFd)
+{
+    upgradeRequested = 0;
+    printf("upgrade: starting %s\n", upgradeArgv[0]);
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) == -1)
+    {
+        fprintf(stderr, "upgrade: pipe2() : %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(ready[0], F_SETFL, O_NONBLOCK);
+    if (listenFd != -1)
+        upgrade_setenv_fd("UPGRADE_LISTEN_FD", listenFd);
+    if (metricsFd != -1)
+        upgrade_setenv_fd("UPGRADE_METRICS_FD", metricsFd);
+    upgrade_setenv_fd("UPGRADE_READY_FD", ready[1]);
+    fflush(stdout);
+
+    // the intermediate child is reaped here, not by the server's SIGCHLD handler
+    sigset_t blocked, saved;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &saved);
+    pid_t intermediate = fork();
+    if (intermediate == 0)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            upgrade_exec(listenFd, metricsFd, ready[1]);
+        if (pid != -1)
+            write(ready[1], &pid, sizeof(pid));
+        _exit(pid == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+    int forkErrno = errno;
+    close(ready[1]);
+    if (intermediate != -1)
+        waitpid(intermediate, NULL, 0);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    unsetenv("UPGRADE_LISTEN_FD");
+    unsetenv("UPGRADE_METRICS_FD");
+    unsetenv("UPGRADE_READY_FD");
+    if (intermediate == -1)
+    {
+        fprintf(stderr, "upgrade: fork() : %s\n", strerror(forkErrno));
+        close(ready[0]);
+        return -1;
+    }
+
+    upgradePipe = ready[0];
+    upgradePid = -1;
+    clock_gettime(CLOCK_MONOTONIC, &upgradeDeadline);
+    upgradeDeadline.tv_sec += upgradeTimeoutS;
+    return upgradePipe;
+}
+
+/**
+ *  Reads what the ready pipe holds without waiting: first the pid the
+ *  intermediate reports, then the same pid once the new process accepts.
+ *  Returns 1 when it accepts on the handed over socket: stop accepting
+ *  and drain. Returns 0 when it failed, and closes the pipe: serve on, a
+ *  later SIGHUP tries again. Returns -1 while it is still starting.
+ */
+static int upgrade_check()
+{
+    pid_t pid = -1;
+    ssize_t got;
+    while ((got = read(upgradePipe, &pid, sizeof(pid))) == sizeof(pid))
+    {
+        if (upgradePid == -1)
+        {
+            upgradePid = pid;
+            continue;
+        }
+        close(upgradePipe);
+        upgradePipe = -1;
+        upgradeHandedOver = 1;
+        printf("upgrade: process %d accepts, draining\n", (int)pid);
+        return 1;
+    }
+    if (got == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < upgradeDeadline.tv_sec
+            || (now.tv_sec == upgradeDeadline.tv_sec && now.tv_nsec < upgradeDeadline.tv_nsec))
+            return -1;
+    }
+    close(upgradePipe);
+    upgradePipe = -1;
+    if (upgradePid == -1)
+        printf("upgrade: the new process could not be started, serving on\n");
+    else if (got != -1)
+        printf("upgrade: process %d exited before it was ready, serving on\n", (int)upgradePid);
+    else
+    {
+        printf("upgrade: process %d is not ready after %d s, stopping it and serving on\n",
+               (int)upgradePid, upgradeTimeoutS);
+        kill(upgradePid, SIGINT);
+    }
+    return 0;
+}
+
+// the old process stops while the new one is still starting: that one stops too
+static inline void upgrade_cancel()
+{
+    if (upgradePipe == -1)
+        return;
+    close(upgradePipe);
+    upgradePipe = -1;
+    if (upgradePid != -1)
+    {
+        printf("upgrade: stopping process %d, which was not ready yet\n", (int)upgradePid);
+        kill(upgradePid, SIGINT);
+    }
+}
+
+// milliseconds until upgradeDeadline, for poll()
+static inline int upgrade_wait_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long leftMs = (upgradeDeadline.tv_sec - now.tv_sec) * 1000LL
+        + (upgradeDeadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+    return leftMs > 0 ? (int)leftMs : 0;
+}
+
+/**
+ *  upgrade_begin() and upgrade_check() for a main process that has
+ *  nothing else to do meanwhile: waits for the outcome. Returns 1 when
+ *  the new process accepts on listenFd (-1: it opens its own listeners),
+ *  0 when it failed.
+ */
+static inline int upgrade_start(int listenFd, int metricsFd)
+{
+    if (upgrade_begin(listenFd, metricsFd) == -1)
+        return 0;
+    int state = -1;
+    while (state == -1)
+    {
+        struct pollfd pfd;
+        pfd.fd = upgradePipe;
+        pfd.events = POLLIN;
+        poll(&pfd, 1, upgrade_wait_ms());
+        state = upgrade_check();
+    }
+    return state;
+}
+
+#endif
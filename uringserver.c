@@ -0,0 +1,836 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+
+#include "logger.h"
+#include "payload.h"
+#include "metrics.h"
+#include "transport.h"
+#include "connpool.h"
+#include "timerwheel.h"
+#include "tuning.h"
+#include "upgrade.h"
+
+static struct payload payload;
+static struct socket_tuning tuning;
+static struct timeouts timeouts;
+static struct metrics metrics;
+static struct worker_metrics* counters;
+
+/**
+ *  One process, one io_uring, no liburing:
+ *
+ *  multishot ACCEPT             -> one CQE per new client
+ *  SEND -(link)-> TIMEOUT       -> per connection step; the timeout only
+ *                                  starts when the send has completed, so
+ *                                  it replaces the sleep between messages
+ *    +- LINK_TIMEOUT            -> SERVER_WRITE_TIMEOUT_MS: cancels a send
+ *                                  that has not completed by then, which
+ *                                  fails the rest of the chain
+ *
+ *  The send posts its CQE even when it succeeds: with CQE_SKIP_SUCCESS on
+ *  it, the kernel would not post the CQE of a TIMEOUT failed with it
+ *  either, and only that CQE releases the connection.
+ *  after the last step: CLOSE
+ *  POLL_ADD -(link)-> LINK_TIMEOUT
+ *                               -> SIGHUP: the ready pipe of the new binary
+ *                                  (upgrade.h), until its deadline
+ *  handed over                  -> ASYNC_CANCEL of the accept; the open
+ *                                  connections run to their end
+ *
+ *  All SQEs produced while reaping one batch of CQEs go to the kernel in a
+ *  single io_uring_enter(), which also waits for the next completions.
+ *
+ *  If the kernel has no io_uring (or no multishot accept) the process
+ *  execs the epollserver binary from its own directory instead.
+ */
+
+#define RING_ENTRIES 4096
+#define CQ_ENTRIES (RING_ENTRIES * 4)
+
+int create_server_socket(const struct transport* transport)
+{
+    int sockfd = transport_socket(transport, SOCK_CLOEXEC);
+    if (sockfd == -1)
+    {
+        fprintf(stderr, "socket() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return sockfd;
+}
+
+void set_reuse_addr_opt(int sockfd)
+{
+    int enable = 1;
+    int setOptRes = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+                               &enable, sizeof(int));
+    if (setOptRes == -1)
+    {
+        fprintf(stderr, "setsockopt() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bind_server_socket(int sockfd, const struct transport* transport)
+{
+    int binded = transport_bind(sockfd, transport);
+    if (binded == -1)
+    {
+        fprintf(stderr, "bind() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void listen_server_socket(int sockfd)
+{
+    int listened = listen(sockfd, tuning.backlog);
+    if (listened == -1)
+    {
+        fprintf(stderr, "listen() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+typedef void (*sighandler_t)(int);
+void set_signal_handler(int sigNumber, const char* sigPresentation,
+                        sighandler_t handler)
+{
+    struct sigaction sigact;
+    bzero(&sigact, sizeof(struct sigaction));
+    sigact.sa_handler = handler;
+    int sigActionSet = sigaction(sigNumber, &sigact, NULL);
+    if (sigActionSet == -1)
+    {
+        fprintf(stderr, "sigaction(%s) : %s\n", sigPresentation, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static volatile sig_atomic_t needToFinish = 0;
+void sig_int()
+{
+    needToFinish = 1;
+}
+
+void set_sigint_handler()
+{
+    set_signal_handler(SIGINT, "SIGINT", sig_int);
+}
+
+void raise_nofile_limit()
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+    {
+        fprintf(stderr, "getrlimit() : %s\n", strerror(errno));
+        return;
+    }
+    if (lim.rlim_cur < lim.rlim_max)
+    {
+        lim.rlim_cur = lim.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &lim) == -1)
+            fprintf(stderr, "setrlimit() : %s\n", strerror(errno));
+    }
+}
+
+// replaces this process with epollserver, keeping the arguments
+void fall_back_to_epoll(char** argv, const char* reason)
+{
+    printf("io_uring is not usable (%s), falling back to epollserver\n", reason);
+    fflush(stdout);
+    // epollserver opens its own metrics endpoint
+    metrics_shutdown(&metrics, 0);
+    logger_flush();
+
+    char self[PATH_MAX];
+    strncpy(self, argv[0], sizeof(self) - 1);
+    self[sizeof(self) - 1] = '\0';
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/epollserver", dirname(self));
+
+    argv[0] = path;
+    execv(path, argv);
+    fprintf(stderr, "execv(%s) : %s\n", path, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+struct uring
+{
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;   // SQEs prepared, not yet visible to the kernel
+    unsigned sqSubmitted;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+
+    unsigned long enterCalls;
+};
+
+int uring_setup(struct uring* ring)
+{
+    bzero(ring, sizeof(struct uring));
+
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        // older kernels do not know COOP_TASKRUN
+        bzero(&params, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    }
+    if (ring->fd == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+    char* rings = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED)
+        return -1;
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    ring->sqHead = (unsigned*)(rings + params.sq_off.head);
+    ring->sqTail = (unsigned*)(rings + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(rings + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(rings + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->sqSubmitted = ring->sqLocalTail;
+
+    ring->cqHead = (unsigned*)(rings + params.cq_off.head);
+    ring->cqTail = (unsigned*)(rings + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(rings + params.cq_off.cqes);
+    return 0;
+}
+
+int uring_supports(struct uring* ring, const int* opcodes, int count)
+{
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probeSize);
+    if (probe == NULL)
+        return 0;
+    int registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256);
+    int supported = registered == 0;
+    int i = 0;
+    for (; supported && i < count; ++i)
+    {
+        supported = opcodes[i] <= probe->last_op
+                 && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/**
+ *  Pushes prepared SQEs to the kernel and waits for at least waitFor
+ *  completions in the same system call.
+ */
+int uring_enter(struct uring* ring, unsigned waitFor)
+{
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+    unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+    ++ring->enterCalls;
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor, flags, NULL, 0);
+    if (submitted > 0)
+        ring->sqSubmitted += submitted;
+    return submitted;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* ring)
+{
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqLocalTail - head >= ring->sqEntries)
+    {
+        // SQ full: hand over what we have without waiting
+        if (uring_enter(ring, 0) == -1 && errno != EINTR && errno != EBUSY)
+        {
+            fprintf(stderr, "io_uring_enter() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (ring->sqLocalTail - head >= ring->sqEntries)
+            return NULL;
+    }
+    unsigned index = ring->sqLocalTail & *ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    ++ring->sqLocalTail;
+    return sqe;
+}
+
+/**
+ *  user_data: connection pointer with the operation in the low bits
+ *  (connections are cache-line aligned in the pool).
+ */
+enum op_kind
+{
+    OP_ACCEPT = 1,
+    OP_SEND = 2,
+    OP_TIMEOUT = 3,
+    OP_CLOSE = 4,
+    OP_CANCEL = 5,
+    OP_LINK_TIMEOUT = 6,
+    OP_UPGRADE = 7,
+    OP_UPGRADE_TIMEOUT = 8
+};
+#define OP_MASK 15ULL
+
+// lives in the connection pool; what every step touches comes first
+struct connection
+{
+    int sockfd;
+    int sndCount;                   // -1: the last send failed
+    int sndBatch;                   // messages in the send in flight
+    struct payload_stream stream;
+    struct __kernel_timespec wakeAt;    // absolute deadline of the step's TIMEOUT
+    struct connection* prev;
+    struct connection* next;
+    struct sockaddr_in addr;
+    char ipStr[INET_ADDRSTRLEN];
+};
+
+struct server
+{
+    struct uring ring;
+    int masterSocket;
+    struct connpool pool;
+    struct connection* live;
+    size_t liveCount;
+    unsigned long messagesSent;
+    int acceptArmed;
+    int upgradeReady;               // ready pipe of a starting new binary, -1: none
+    int draining;
+};
+
+static struct __kernel_timespec writeTimeout;
+static struct __kernel_timespec upgradeTimeout;
+// batchMsg[n] sends the message n times; read-only, shared by every SENDMSG
+static struct iovec batchIov[PAYLOAD_MAX_BATCH];
+static struct msghdr batchMsg[PAYLOAD_MAX_BATCH + 1];
+static int sendZerocopy;            // IORING_OP_SENDMSG_ZC for large sends
+
+uint64_t tag(void* ptr, enum op_kind op)
+{
+    return (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+}
+
+struct io_uring_sqe* must_get_sqe(struct server* srv)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&srv->ring);
+    if (sqe == NULL)
+    {
+        fprintf(stderr, "submission queue is full\n");
+        exit(EXIT_FAILURE);
+    }
+    return sqe;
+}
+
+void arm_accept(struct server* srv)
+{
+    struct io_uring_sqe* sqe = must_get_sqe(srv);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = srv->masterSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = tag(NULL, OP_ACCEPT);
+    srv->acceptArmed = 1;
+}
+
+// a chain has to reach the kernel in one piece, not split by a full SQ
+void reserve_sqes(struct server* srv, unsigned count)
+{
+    struct uring* ring = &srv->ring;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqEntries - (ring->sqLocalTail - head) >= count)
+        return;
+    if (uring_enter(ring, 0) == -1 && errno != EINTR && errno != EBUSY)
+    {
+        fprintf(stderr, "io_uring_enter() : %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// after a handover the accept must stop taking clients off the shared socket
+void cancel_accept(struct server* srv)
+{
+    struct io_uring_sqe* sqe = must_get_sqe(srv);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag(NULL, OP_ACCEPT);
+    sqe->user_data = tag(NULL, OP_CANCEL);
+}
+
+// one poll of the ready pipe, cut off at the upgrade's deadline
+void watch_upgrade(struct server* srv)
+{
+    upgradeTimeout.tv_sec = upgradeDeadline.tv_sec;
+    upgradeTimeout.tv_nsec = upgradeDeadline.tv_nsec;
+    reserve_sqes(srv, 2);
+    struct io_uring_sqe* poll = must_get_sqe(srv);
+    poll->opcode = IORING_OP_POLL_ADD;
+    poll->fd = srv->upgradeReady;
+    poll->poll32_events = POLLIN;
+    poll->flags = IOSQE_IO_LINK;
+    poll->user_data = tag(NULL, OP_UPGRADE);
+
+    struct io_uring_sqe* limit = must_get_sqe(srv);
+    limit->opcode = IORING_OP_LINK_TIMEOUT;
+    limit->fd = -1;
+    limit->addr = (uint64_t)(uintptr_t)&upgradeTimeout;
+    limit->len = 1;
+    limit->timeout_flags = IORING_TIMEOUT_ABS;
+    limit->user_data = tag(NULL, OP_UPGRADE_TIMEOUT);
+}
+
+// SIGHUP: the connections are served on while the new binary starts
+void start_upgrade(struct server* srv)
+{
+    srv->upgradeReady = upgrade_begin(srv->masterSocket, metrics.listenFd);
+    if (srv->upgradeReady != -1)
+        watch_upgrade(srv);
+}
+
+// the pipe is readable or the deadline passed (-ECANCELED)
+void on_upgrade(struct server* srv)
+{
+    int state = upgrade_check();
+    if (state == -1)
+    {
+        watch_upgrade(srv);
+        return;
+    }
+    srv->upgradeReady = -1;
+    if (state == 1)
+    {
+        cancel_accept(srv);
+        srv->draining = 1;
+        printf("stop accepting, draining %zu connections\n", srv->liveCount);
+    }
+}
+
+// the peer for log lines, asked for and formatted only when one is written
+const char* connection_peer(struct connection* conn)
+{
+    if (conn->ipStr[0] != '\0')
+        return conn->ipStr;
+    socklen_t addrLen = sizeof(conn->addr);
+    if (getpeername(conn->sockfd, (struct sockaddr*)&conn->addr, &addrLen) == -1
+        || transport_peer(&conn->addr, conn->ipStr) == NULL)
+        strcpy(conn->ipStr, "?");
+    return conn->ipStr;
+}
+
+static inline int connection_port(struct connection* conn)
+{
+    connection_peer(conn);
+    return (int)ntohs(conn->addr.sin_port);
+}
+
+/**
+ *  SENDMSG of the messages that are due, up to PAYLOAD_BATCH of them,
+ *  then a TIMEOUT until the next message is due. The deadline is
+ *  absolute, the stream's schedule, so the time each send and completion
+ *  takes does not add up over the stream.
+ */
+void queue_step(struct server* srv, struct connection* conn)
+{
+    conn->sndBatch = payload_stream_due(&payload, &conn->stream);
+    log_trace("sending packet number %d to %s:%d\n", conn->sndCount + 1,
+              connection_peer(conn), connection_port(conn));
+
+    reserve_sqes(srv, 3);
+    struct io_uring_sqe* send = must_get_sqe(srv);
+    send->opcode = IORING_OP_SENDMSG;
+    // the kernel reports a zero-copy send's buffer as released in a second CQE
+    if (sendZerocopy && payload.messageSize * conn->sndBatch >= PAYLOAD_ZEROCOPY_MIN)
+    {
+        send->opcode = IORING_OP_SENDMSG_ZC;
+        send->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    }
+    send->fd = conn->sockfd;
+    // a payload file goes out of its shared read-only mapping
+    send->addr = (uint64_t)(uintptr_t)&batchMsg[conn->sndBatch];
+    send->len = 1;
+    // a large message must not complete short and leave its tail unsent
+    send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    send->flags = IOSQE_IO_LINK;
+    send->user_data = tag(conn, OP_SEND);
+
+    if (timeouts.writeNs > 0)
+    {
+        struct io_uring_sqe* limit = must_get_sqe(srv);
+        limit->opcode = IORING_OP_LINK_TIMEOUT;
+        limit->fd = -1;
+        limit->addr = (uint64_t)(uintptr_t)&writeTimeout;
+        limit->len = 1;
+        limit->flags = IOSQE_IO_LINK;
+        // no connection: this CQE may come after the chain has released it
+        limit->user_data = tag(NULL, OP_LINK_TIMEOUT);
+    }
+
+    // counted when it is queued, like a blocking send; a failed one ends the stream
+    payload_stream_sent(&payload, &conn->stream, conn->sndBatch);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (payload_timespec_before(&conn->stream.next, &now))
+        payload_stream_catch_up(&payload, &conn->stream, &now);
+    struct timespec deadline = conn->stream.next;
+    if (payload.durationMs > 0)
+    {
+        struct timespec end = conn->stream.startedAt;
+        payload_timespec_add_ns(&end, payload.durationMs * 1000000LL);
+        if (payload_timespec_before(&end, &deadline))
+            deadline = end;
+    }
+    conn->wakeAt.tv_sec = deadline.tv_sec;
+    conn->wakeAt.tv_nsec = deadline.tv_nsec;
+
+    struct io_uring_sqe* timeout = must_get_sqe(srv);
+    timeout->opcode = IORING_OP_TIMEOUT;
+    timeout->fd = -1;
+    timeout->addr = (uint64_t)(uintptr_t)&conn->wakeAt;
+    timeout->len = 1;
+    // an expired timeout must not count as a failure of the chain
+    timeout->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+    timeout->user_data = tag(conn, OP_TIMEOUT);
+}
+
+void init_batches()
+{
+    int i = 0;
+    for (; i < PAYLOAD_MAX_BATCH; ++i)
+    {
+        batchIov[i].iov_base = payload.message;
+        batchIov[i].iov_len = payload.messageSize;
+    }
+    for (i = 0; i <= PAYLOAD_MAX_BATCH; ++i)
+    {
+        batchMsg[i].msg_iov = batchIov;
+        batchMsg[i].msg_iovlen = i;
+    }
+}
+
+void close_connection(struct server* srv, struct connection* conn)
+{
+    log_debug("closing connection: %s:%d\n", connection_peer(conn), connection_port(conn));
+
+    struct io_uring_sqe* sqe = must_get_sqe(srv);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = conn->sockfd;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = tag(NULL, OP_CLOSE);
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        srv->live = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+    --srv->liveCount;
+    connpool_put(&srv->pool, conn);
+    metrics_gauge(&counters->active, -1);
+}
+
+void on_accept(struct server* srv, struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        srv->acceptArmed = 0;
+    if (cqe->res < 0)
+    {
+        if (cqe->res == -EINTR || cqe->res == -ECANCELED)
+            return;
+        metrics_add(&counters->acceptErrors, 1);
+        if (cqe->res != -ECONNABORTED)
+            fprintf(stderr, "accept() : %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    struct connection* conn = connpool_get(&srv->pool);
+    if (conn == NULL)
+    {
+        metrics_add(&counters->refused, 1);
+        log_debug("connection limit reached, refusing a client\n");
+        close(cqe->res);
+        return;
+    }
+    conn->sockfd = cqe->res;
+    payload_stream_start(&payload, &conn->stream, conn->sockfd);
+    metrics_add(&counters->accepts, 1);
+    metrics_gauge(&counters->active, 1);
+    // multishot accept reports no address: getpeername() only for log lines
+    conn->addr.sin_port = 0;
+    conn->ipStr[0] = '\0';
+    transport_skip_greeting(conn->sockfd);
+    log_debug("accepted request from %s:%d\n", connection_peer(conn), connection_port(conn));
+
+    conn->next = srv->live;
+    if (srv->live != NULL)
+        srv->live->prev = conn;
+    srv->live = conn;
+    ++srv->liveCount;
+
+    queue_step(srv, conn);
+}
+
+void on_send(struct connection* conn, int res, unsigned flags)
+{
+    // MSG_WAITALL: anything short of the whole batch is a failure
+    if (res >= 0 && (size_t)res == payload.messageSize * conn->sndBatch)
+    {
+        // F_MORE: a zero-copy send, its notification follows
+        if (flags & IORING_CQE_F_MORE)
+            metrics_zerocopy(counters, (unsigned long)res, 0);
+        return;
+    }
+    // the TIMEOUT after it fails as well, and its CQE releases the connection;
+    // cancelled or cut short: the write timeout passed, counted by its own CQE
+    if (res >= 0 || res == -ECANCELED)
+        log_debug("send cut short: %s:%d\n", connection_peer(conn), connection_port(conn));
+    else if (res == -EPIPE || res == -ECONNRESET)
+    {
+        metrics_add(&counters->epipeCloses, 1);
+        log_debug("outgoing connection closed: %s:%d\n", connection_peer(conn),
+                  connection_port(conn));
+    }
+    else
+        fprintf(stderr, "send(%s) : %s\n", connection_peer(conn), strerror(-res));
+    conn->sndCount = -1;
+}
+
+void on_timeout(struct server* srv, struct connection* conn, int res)
+{
+    if (res == -ECANCELED || conn->sndCount < 0)
+    {
+        close_connection(srv, conn);
+        return;
+    }
+    conn->sndCount += conn->sndBatch;
+    srv->messagesSent += conn->sndBatch;
+    // MSG_WAITALL: a successful send has sent the whole batch in one call
+    metrics_batch_sent(counters, conn->sndBatch, payload.messageSize * conn->sndBatch, 1);
+    if (!payload_stream_more(&payload, &conn->stream) || needToFinish)
+        close_connection(srv, conn);
+    else
+        queue_step(srv, conn);
+}
+
+void reap_completions(struct server* srv)
+{
+    struct uring* ring = &srv->ring;
+    unsigned head = *ring->cqHead;
+    unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqMask];
+        struct connection* conn = (struct connection*)(uintptr_t)(cqe->user_data & ~OP_MASK);
+        switch (cqe->user_data & OP_MASK)
+        {
+        case OP_ACCEPT:
+            on_accept(srv, cqe);
+            break;
+        case OP_SEND:
+            // the notification may come after the connection was released
+            if (cqe->flags & IORING_CQE_F_NOTIF)
+            {
+                if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+                    metrics_zerocopy(counters, 0, 1);
+            }
+            else
+                on_send(conn, cqe->res, cqe->flags);
+            break;
+        case OP_TIMEOUT:
+            on_timeout(srv, conn, cqe->res);
+            break;
+        case OP_CLOSE:
+            if (cqe->res < 0)
+                fprintf(stderr, "close() : %s\n", strerror(-cqe->res));
+            break;
+        case OP_CANCEL:
+            if (cqe->res < 0 && cqe->res != -ENOENT)
+                fprintf(stderr, "cancel(accept) : %s\n", strerror(-cqe->res));
+            break;
+        case OP_UPGRADE:
+            on_upgrade(srv);
+            break;
+        case OP_UPGRADE_TIMEOUT:
+            break;
+        case OP_LINK_TIMEOUT:
+            // -ECANCELED when the send was in time
+            if (cqe->res == -ETIME)
+            {
+                metrics_add(&counters->timeoutCloses, 1);
+                log_debug("write timeout passed\n");
+            }
+            break;
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc >= 2)
+    {
+        int cmpRes = strcmp(argv[1], "--help");
+        if (cmpRes == 0)
+        {
+            printf("usage: uringserver [serverPort|unix:path|seqpacket:path]\n"
+                   "SIGHUP starts the binary again on the same socket, see upgrade.h\n");
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    struct transport transport;
+    if (!transport_parse(argc >= 2 ? argv[1] : "6666", &transport))
+        exit(EXIT_FAILURE);
+    transport_print(&transport);
+    logger_init();
+    payload_init(&payload, 0);
+    if (transport.family == AF_UNIX)
+        payload_unix_socket(&payload);
+    tuning_init(&tuning);
+    timeouts_init(&timeouts);
+    writeTimeout.tv_sec = timeouts.writeNs / 1000000000LL;
+    writeTimeout.tv_nsec = timeouts.writeNs % 1000000000LL;
+
+    struct server srv;
+    bzero(&srv, sizeof(srv));
+    srv.upgradeReady = -1;
+    if (uring_setup(&srv.ring) == -1)
+        fall_back_to_epoll(argv, strerror(errno));
+    int requiredOps[] = { IORING_OP_ACCEPT, IORING_OP_SENDMSG, IORING_OP_TIMEOUT, IORING_OP_CLOSE,
+                          IORING_OP_ASYNC_CANCEL, IORING_OP_LINK_TIMEOUT,
+                          IORING_OP_POLL_ADD };
+    if (!uring_supports(&srv.ring, requiredOps, sizeof(requiredOps) / sizeof(requiredOps[0])))
+        fall_back_to_epoll(argv, "missing opcodes");
+    init_batches();
+    if (payload.zerocopy)
+    {
+        int zerocopyOps[] = { IORING_OP_SENDMSG_ZC };
+        sendZerocopy = uring_supports(&srv.ring, zerocopyOps, 1);
+        if (!sendZerocopy)
+            printf("payload: no IORING_OP_SENDMSG_ZC (6.1+), sending with copies\n");
+        // SENDMSG_ZC needs no SO_ZEROCOPY and reports completions in the ring
+        payload.zerocopy = 0;
+    }
+    // after the checks: epollserver takes the handed over sockets itself
+    upgrade_init(argv);
+    metrics_init(&metrics, 1, upgrade_metrics_listener());
+    counters = metrics_slot(&metrics, 0);
+    connpool_init(&srv.pool, sizeof(struct connection));
+
+    set_sigint_handler();
+    raise_nofile_limit();
+
+    // after an upgrade the old process's socket is already bound and listening
+    srv.masterSocket = upgrade_listener();
+    if (srv.masterSocket == -1)
+    {
+        srv.masterSocket = create_server_socket(&transport);
+        if (transport.family == AF_INET)
+            set_reuse_addr_opt(srv.masterSocket);
+        bind_server_socket(srv.masterSocket, &transport);
+    }
+    tuning_listener(&tuning, srv.masterSocket, &transport);
+    listen_server_socket(srv.masterSocket);
+    transport_defer_accept(srv.masterSocket, &transport);
+
+    // multishot accept (5.19+) is the last thing to check: its first CQE
+    arm_accept(&srv);
+    printf("ready to accept client connections...\n");
+    upgrade_ready();
+    // a drain ends with the last connection and the accept's final CQE
+    while (!needToFinish && !(srv.draining && srv.liveCount == 0 && !srv.acceptArmed))
+    {
+        if (upgradeRequested && !srv.draining && srv.upgradeReady == -1)
+            start_upgrade(&srv);
+
+        int entered = uring_enter(&srv.ring, 1);
+        if (entered == -1)
+        {
+            if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+                continue;
+            fprintf(stderr, "io_uring_enter() : %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        struct io_uring_cqe* first = &srv.ring.cqes[*srv.ring.cqHead & *srv.ring.cqMask];
+        if (srv.messagesSent == 0 && srv.liveCount == 0
+            && *srv.ring.cqHead != __atomic_load_n(srv.ring.cqTail, __ATOMIC_ACQUIRE)
+            && (first->user_data & OP_MASK) == OP_ACCEPT && first->res == -EINVAL)
+        {
+            close(srv.masterSocket);
+            close(srv.ring.fd);
+            fall_back_to_epoll(argv, "no multishot accept");
+        }
+
+        reap_completions(&srv);
+        if (!srv.acceptArmed && !srv.draining)
+            arm_accept(&srv);
+    }
+
+    printf("stop working, closing %zu connections\n", srv.liveCount);
+    upgrade_cancel();
+    while (srv.live != NULL)
+    {
+        struct connection* conn = srv.live;
+        srv.live = conn->next;
+        close(conn->sockfd);
+        connpool_put(&srv.pool, conn);
+    }
+    connpool_report(&srv.pool);
+    connpool_destroy(&srv.pool);
+    printf("%lu messages sent with %lu io_uring_enter calls\n",
+           srv.messagesSent, srv.ring.enterCalls);
+    metrics_shutdown(&metrics, upgrade_handed_over());
+    if (!upgrade_handed_over())
+        transport_shutdown(&transport);
+
+    close(srv.ring.fd);
+    close(srv.masterSocket);
+    exit(EXIT_SUCCESS);
+}